@@ -0,0 +1,84 @@
+#pragma once
+#include <string>
+#include <deque>
+#include <fstream>
+#include <cstdint>
+#include "llm_session_engine.hpp"
+#include "llm_json.hpp"
+
+/**
+ * @brief answers a JSONL file of independent prompts with a SessionEngine, writing one JSONL result per input line
+ *
+ * Each input line is an object with a "prompt" string and optionally an "id" (echoed back) and "max_tokens". Prompts
+ * run concurrently as separate sequences of the engine's context. Results are written in input order as soon as every
+ * earlier line is done, so the output file is always a prefix of the input: after a crash, run resumes after the last
+ * complete output line. Only a bounded window of lines is held in memory however large the input is.
+ *
+ * output line fields: line (0-based input line), id, response, finish_reason, completion_tokens; or line, id and error
+ */
+class BatchRunner {
+  public:
+    /**
+     * @brief BatchRunner constructor
+     *
+     * @param engine engine to run prompts with, all of its sessions must be free
+     * @param max_tokens [optional] reply length limit for lines that do not set one, -1 for none
+     * @param window [optional] most input lines read ahead of the oldest unwritten one, 0 for four per session
+     * @param debug_level [optional] debug output level, see LLM
+     */
+    BatchRunner(SessionEngine& engine, int32_t max_tokens = 512, size_t window = 0, uint8_t debug_level = 0);
+
+    /**
+     * @brief answer every prompt of the input not yet answered in the output
+     *
+     * @param input_path JSONL file of prompts
+     * @param output_path JSONL file of results, appended to if it holds results of an earlier run
+     *
+     * @return whether every line was processed and written
+     */
+    bool run(const std::string& input_path, const std::string& output_path);
+
+  private:
+    /**
+     * @brief input line between being read and its result being written
+     */
+    struct Pending {
+        uint64_t    line = 0;  ///< 0-based input line number
+        JsonValue   id;  ///< id given in the input, null if none
+        std::string prompt;  ///< prompt waiting for a free session, cleared once submitted
+        int32_t     max_tokens = -1;  ///< reply length limit
+        int         session_id = -1;  ///< session answering the prompt, -1 if not submitted
+        bool        done = false;  ///< whether output holds the result line
+        std::string output;  ///< serialized result line
+    };
+
+    /**
+     * @brief count the complete result lines of an earlier run, removing a partly written last line
+     *
+     * @param output_path JSONL file of results
+     * @param count set to the number of complete lines
+     *
+     * @return whether the file is missing or holds results in input order
+     */
+    bool resumePoint(const std::string& output_path, uint64_t& count) const;
+
+    /**
+     * @brief parse an input line into a pending prompt, or an error result
+     */
+    void parseLine(const std::string& text, Pending& pending) const;
+
+    /**
+     * @brief start the result object of a line with its line number and id
+     */
+    static JsonValue resultFor(const Pending& pending);
+
+    /**
+     * @brief record the result of a line, it is written once every earlier line is done
+     */
+    static void complete(Pending& pending, const JsonValue& result);
+
+    SessionEngine& m_engine;  ///< engine running the prompts
+    int32_t        m_max_tokens  = 512;  ///< default reply length limit
+    size_t         m_window      = 0;  ///< most lines held in memory
+    uint8_t        m_debug_level = 0;  ///< debug level to use
+};
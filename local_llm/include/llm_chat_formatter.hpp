@@ -0,0 +1,143 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include "llama.h"
+
+/**
+ * @brief bump allocator for strings that need stable addresses, memory is only released by clear
+ */
+class StringArena {
+  public:
+    /**
+     * @brief copy a string into the arena
+     *
+     * @param text text to copy
+     *
+     * @return null terminated copy of the text, valid until clear is called
+     */
+    const char* store(std::string_view text);
+
+    /**
+     * @brief release all stored strings
+     */
+    void clear();
+
+    /**
+     * @brief get the number of bytes handed out since the last clear
+     */
+    size_t bytesUsed() const {
+        return m_bytes_used;
+    }
+
+  private:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;  ///< default block size, larger strings get a block of their own
+
+    std::vector<std::unique_ptr<char[]>> m_blocks;  ///< allocated blocks, the last one is being filled
+    size_t                               m_block_used     = 0;  ///< bytes used in the last block
+    size_t                               m_block_capacity = 0;  ///< size of the last block
+    size_t                               m_bytes_used     = 0;  ///< bytes handed out in total
+};
+
+/**
+ * @brief keeps a chat formatted with the model chat template as an append-only buffer
+ *
+ * Appending a message only formats the new message against the one before it (so templates that depend on the previous
+ * role still work), rather than re-applying the template to the whole conversation, keeping per-turn cost flat as the
+ * conversation grows. Message contents are owned by an arena so no per-message allocation or free is needed.
+ */
+class ChatFormatter {
+  public:
+    /**
+     * @brief ChatFormatter constructor
+     *
+     * @param chat_template [optional] chat template string or name accepted by llama_chat_apply_template
+     */
+    ChatFormatter(const char* chat_template = nullptr);
+
+    /**
+     * @brief set the chat template and clear the chat
+     *
+     * @param chat_template chat template string or name accepted by llama_chat_apply_template
+     */
+    void setTemplate(const char* chat_template);
+
+    /**
+     * @brief add a message to the end of the chat
+     *
+     * @param role role of the message, must stay valid for the lifetime of the formatter (e.g. a string literal)
+     * @param content message content, copied into the arena
+     * @param add_assistant whether to end the formatted chat with the prompt for the assistant's reply
+     *
+     * @return offset of the first character of the formatted chat changed by the append; this is the previous length
+     *         unless the template could not be applied incrementally and earlier text was rewritten, -1 on template failure
+     */
+    int64_t append(const char* role, std::string_view content, bool add_assistant);
+
+    /**
+     * @brief remove messages from the chat, re-formatting it in full; removing the last message also removes the reply prompt
+     *
+     * @param first index of the first message to remove
+     * @param count number of messages to remove
+     *
+     * @return whether the chat could be re-formatted
+     */
+    bool erase(size_t first, size_t count);
+
+    /**
+     * @brief remove every message
+     */
+    void clear();
+
+    /**
+     * @brief get the formatted chat
+     */
+    const std::string& formatted() const {
+        return m_formatted;
+    }
+
+    /**
+     * @brief get the chat messages
+     */
+    const std::vector<llama_chat_message>& messages() const {
+        return m_messages;
+    }
+
+    /**
+     * @brief get the number of bytes of message content held
+     */
+    size_t contentBytes() const {
+        return m_arena.bytesUsed();
+    }
+
+    /**
+     * @brief get how many messages after the first needed the whole chat formatted since the formatter was created
+     */
+    uint64_t fullFormats() const {
+        return m_full_formats;
+    }
+
+  private:
+    /**
+     * @brief apply the chat template to a list of messages
+     *
+     * @param messages messages to format
+     * @param n_messages number of messages
+     * @param add_assistant whether to add the assistant reply prompt
+     * @param output string to write the formatted text to
+     *
+     * @return whether the template could be applied
+     */
+    bool format(const llama_chat_message* messages, size_t n_messages, bool add_assistant, std::string& output);
+
+    const char*                     m_template = nullptr;  ///< chat template
+    StringArena                     m_arena;  ///< storage for message contents
+    std::vector<llama_chat_message> m_messages;  ///< chat messages, contents point into the arena
+    std::string                     m_formatted;  ///< formatted chat
+    bool                            m_add_assistant = false;  ///< whether the formatted chat ends with the assistant reply prompt
+    uint64_t                        m_full_formats  = 0;  ///< messages after the first that could not be formatted incrementally
+    std::string                     m_base_buffer;  ///< scratch buffer for the formatted previous message
+    std::string                     m_full_buffer;  ///< scratch buffer for the formatted previous and new message
+};
@@ -0,0 +1,188 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include "llama.h"
+
+/**
+ * @brief CPU threading, NUMA, offload and KV cache settings for a llama context
+ *
+ * Zero valued context size, thread and batch counts are resolved against the local machine by resolved().
+ */
+struct EngineConfig {
+    uint32_t              n_ctx           = 0;  ///< context size in tokens, 0 for the default of the engine using the config
+    ggml_type             type_k          = GGML_TYPE_F16;  ///< KV cache key type, q8_0 halves and q4_0 roughly quarters the f16 size
+    ggml_type             type_v          = GGML_TYPE_F16;  ///< KV cache value type, a quantized type needs flash attention
+    llama_flash_attn_type flash_attn      = LLAMA_FLASH_ATTN_TYPE_AUTO;  ///< flash attention, auto enables it where the backend supports it
+    int32_t               n_threads       = 0;  ///< threads used for generation, 0 for one per physical core
+    int32_t               n_threads_batch = 0;  ///< threads used for prompt processing, 0 for the same as n_threads
+    std::string           cpu_mask        = "";  ///< hex mask of the CPUs worker threads may run on (e.g. "0xff00"), empty for no affinity
+    bool                  strict_cpu      = false;  ///< pin each worker thread to its own CPU of the mask rather than letting them float within it
+    ggml_numa_strategy    numa            = GGML_NUMA_STRATEGY_DISABLED;  ///< NUMA placement policy, applied once per process
+    uint32_t              n_batch         = 0;  ///< maximum tokens per llama_decode call, 0 for the context size
+    uint32_t              n_ubatch        = 512;  ///< tokens per physical compute batch
+    int32_t               n_gpu_layers    = 100;  ///< layers to offload to the GPU, 0 to run on the CPU only
+
+    /**
+     * @brief get a copy with automatic values replaced by values for this machine
+     *
+     * @param n_ctx context size used if the config does not set one
+     */
+    EngineConfig resolved(uint32_t n_ctx) const;
+
+    /**
+     * @brief set the fields of a llama context parameter struct from the config
+     *
+     * @param context_parameters parameters to set, n_ctx must already be set to the size used if the config does not set one
+     */
+    void apply(llama_context_params& context_parameters) const;
+
+    /**
+     * @brief estimate the KV cache size of a context created with the config
+     *
+     * The estimate assumes every layer caches keys and values for the whole context, as in a plain transformer. It is
+     * too high for models with sliding-window attention layers, whose caches are smaller, and does not describe the
+     * state of recurrent layers, so it is only a guide for comparing cache types and context sizes.
+     *
+     * @param model model the context is created for
+     *
+     * @return estimated bytes of key and value cells for every layer at the resolved context size, shared by all sequences
+     */
+    uint64_t estimateKvCacheBytes(const llama_model* model) const;
+
+    /**
+     * @brief get the number of physical CPU cores, hyperthread siblings are counted once
+     */
+    static int32_t physicalCores();
+
+    /**
+     * @brief get the number of CPUs set in cpu_mask, or the number of logical CPUs if there is no mask
+     */
+    int32_t availableCpus() const;
+
+    /**
+     * @brief expand cpu_mask into one flag per CPU
+     *
+     * @param cpus flags to set, CPU i is usable if cpus[i] is true
+     *
+     * @return whether the mask is valid and selects at least one CPU
+     */
+    bool parseCpuMask(bool (&cpus)[GGML_MAX_N_THREADS]) const;
+
+    /**
+     * @brief parse a NUMA strategy name
+     *
+     * @param name one of "", "disabled", "distribute", "isolate", "numactl" or "mirror"
+     * @param numa strategy to set
+     *
+     * @return whether the name was recognised
+     */
+    static bool parseNuma(const std::string& name, ggml_numa_strategy& numa);
+
+    /**
+     * @brief parse a KV cache type name
+     *
+     * @param name one of "f16", "bf16", "f32", "q8_0", "q5_1", "q5_0", "q4_1" or "q4_0"
+     * @param type type to set
+     *
+     * @return whether the name was recognised
+     */
+    static bool parseCacheType(const std::string& name, ggml_type& type);
+
+    /**
+     * @brief parse a flash attention setting
+     *
+     * @param name one of "", "auto", "on" or "off"
+     * @param flash_attn setting to set
+     *
+     * @return whether the name was recognised
+     */
+    static bool parseFlashAttn(const std::string& name, llama_flash_attn_type& flash_attn);
+};
+
+/**
+ * @brief CPU threadpools pinned according to an engine config, attached to a context in place of llama's own threads
+ * @note the context must be freed before the threadpools
+ */
+class CpuThreadpools {
+  public:
+    CpuThreadpools() = default;
+    CpuThreadpools(const CpuThreadpools&)            = delete;
+    CpuThreadpools& operator=(const CpuThreadpools&) = delete;
+
+    /**
+     * @brief CpuThreadpools destructor
+     */
+    ~CpuThreadpools();
+
+    /**
+     * @brief create threadpools for the config and attach them to a context; nothing is done if the config sets no affinity
+     *
+     * @param context context to attach the threadpools to
+     * @param config resolved engine config
+     *
+     * @return whether the threadpools were attached or not needed, false if the mask is invalid or the CPU backend has no threadpool support
+     */
+    bool attach(llama_context* context, const EngineConfig& config);
+
+  private:
+    /**
+     * @brief free the threadpools
+     */
+    void release();
+
+    ggml_threadpool_t m_threadpool       = nullptr;  ///< threadpool for generation
+    ggml_threadpool_t m_threadpool_batch = nullptr;  ///< threadpool for prompt processing, nullptr if it is shared with generation
+    void (*m_free_threadpool)(ggml_threadpool_t) = nullptr;  ///< CPU backend function freeing a threadpool
+};
+
+/**
+ * @brief benchmarks thread and micro-batch configurations for a model on the local machine, caching the fastest
+ *
+ * Prompt processing is timed for each n_ubatch and n_threads_batch candidate, then single token generation for each
+ * n_threads candidate, with synthetic tokens so no prompt is needed. Results are cached per model file, offload and CPU
+ * affinity so tuning only runs once per machine.
+ */
+class EngineTuner {
+  public:
+    /**
+     * @brief EngineTuner constructor
+     *
+     * @param cache_path path of the file caching tuning results
+     * @param debug_level [optional] 1 or above prints each measurement
+     */
+    EngineTuner(std::string cache_path, uint8_t debug_level = 0);
+
+    /**
+     * @brief get the fastest config for a model, benchmarking if there is no cached result
+     *
+     * @param model_path path to the model
+     * @param config config whose thread and micro-batch settings are tuned, all other settings are kept
+     *
+     * @return the tuned config, or the resolved input config if the model could not be benchmarked
+     */
+    EngineConfig tune(const std::string& model_path, const EngineConfig& config);
+
+  private:
+    static constexpr uint32_t TUNE_PROMPT_TOKENS   = 512;  ///< tokens per prompt processing measurement
+    static constexpr uint32_t TUNE_GENERATE_TOKENS = 32;  ///< tokens per generation measurement
+
+    /**
+     * @brief get the key identifying a model and machine setup in the cache
+     */
+    std::string cacheKey(const std::string& model_path, const EngineConfig& config) const;
+
+    /**
+     * @brief look up a cached result
+     *
+     * @return whether a result was found, in which case config holds it
+     */
+    bool loadCached(const std::string& key, EngineConfig& config) const;
+
+    /**
+     * @brief add a result to the cache, replacing any previous result for the key
+     */
+    void saveCached(const std::string& key, const EngineConfig& config) const;
+
+    std::string m_cache_path;  ///< file caching tuning results
+    uint8_t     m_debug_level = 0;  ///< debug level to use
+};
@@ -0,0 +1,186 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include "llama.h"
+#include "llm_json.hpp"
+
+struct llama_grammar;
+
+/**
+ * @brief counts of how constrained tokens were sampled
+ */
+struct GrammarStats {
+    uint64_t sampled     = 0;  ///< tokens sampled under the grammar
+    uint64_t resampled   = 0;  ///< tokens whose unconstrained choice was rejected and drawn again from the allowed tokens
+    uint64_t masks_built = 0;  ///< allowed token sets computed by checking the whole vocabulary
+    uint64_t mask_hits   = 0;  ///< allowed token sets taken from the cache
+};
+
+/**
+ * @brief GBNF grammar the sampled tokens must follow, so the reply always matches it
+ *
+ * Each token is first sampled without the grammar and only that token is checked, which is cheap and almost always
+ * passes for a model asked for the format. Only a rejected token needs the set of allowed tokens over the whole
+ * vocabulary, to draw again from the allowed tokens. Like llama.cpp's own grammar sampling this approximates masking
+ * first: it matches exactly without filters, but cutoffs such as min-p and top-p are computed over the whole vocabulary
+ * for the first draw and over the allowed tokens for the second. The allowed set depends only on the grammar state, the
+ * positions in the grammar rules and any partial UTF-8 character, so it is computed once per state and cached as a bit
+ * mask, the least recently used mask making way when the cache is full. The cache lives as long as the grammar, so
+ * replies to the same grammar reuse it.
+ *
+ * The grammar is compiled with the llama.cpp grammar implementation, whose state is read to key the cache. This uses
+ * llama.cpp internals rather than its public API: the llama_grammar_*_impl functions and the rules, stacks and
+ * partial_utf8 members declared in its src/llama-grammar.h, which the build checks against the llama.cpp tree it uses.
+ */
+class GrammarConstraint {
+  public:
+    /**
+     * @brief GrammarConstraint constructor, check valid for whether the grammar could be parsed
+     *
+     * @param vocab vocabulary of the model sampling under the grammar
+     * @param grammar GBNF grammar starting at the rule root
+     */
+    GrammarConstraint(const llama_vocab* vocab, const std::string& grammar);
+
+    /**
+     * @brief GrammarConstraint destructor
+     */
+    ~GrammarConstraint();
+
+    GrammarConstraint(const GrammarConstraint&)            = delete;
+    GrammarConstraint& operator=(const GrammarConstraint&) = delete;
+
+    /**
+     * @brief get whether the grammar could be parsed
+     */
+    bool valid() const {
+        return m_grammar != nullptr;
+    }
+
+    /**
+     * @brief start replies at the start of the grammar
+     *
+     * @param n_states [optional] number of replies generated together, each following the grammar on its own
+     */
+    void begin(size_t n_states = 1);
+
+    /**
+     * @brief sample a token allowed by the grammar from the logits of a batch position and advance the grammar by it
+     *
+     * @param sampler sampler drawing the token
+     * @param context context holding the logits
+     * @param idx batch position of the logits, -1 for the last
+     * @param state [optional] reply the token is sampled for
+     *
+     * @return the token, end of generation once the grammar is complete
+     */
+    llama_token sample(llama_sampler* sampler, llama_context* context, int32_t idx, size_t state = 0);
+
+    /**
+     * @brief get the counts of how tokens were sampled since the grammar was created
+     */
+    const GrammarStats& stats() const {
+        return m_stats;
+    }
+
+  private:
+    static constexpr size_t MAX_CACHED_MASKS = 512;  ///< allowed token sets cached, the least recently used is dropped for a new one
+
+    using Mask = std::vector<uint64_t>;  ///< bit per vocabulary token, set if the token is allowed
+
+    /**
+     * @brief allowed tokens of a grammar state held in the cache
+     */
+    struct CachedMask {
+        Mask     allowed;  ///< the allowed tokens
+        uint64_t last_used = 0;  ///< use counter value of the last lookup, for LRU
+    };
+
+    /**
+     * @brief hash the rule positions and partial UTF-8 character of a reply's grammar state
+     */
+    uint64_t stateKey(size_t state) const;
+
+    /**
+     * @brief get the allowed tokens in a reply's grammar state, computing and caching them if needed
+     */
+    const Mask& mask(size_t state, uint64_t key);
+
+    const llama_vocab*                              m_vocab;  ///< vocabulary the grammar is applied to
+    int32_t                                         m_n_vocab;  ///< number of tokens in the vocabulary
+    llama_grammar*                                  m_grammar = nullptr;  ///< the parsed grammar in its start state
+    std::vector<llama_grammar*>                     m_states;  ///< grammar state of each reply being generated
+    std::vector<std::vector<std::pair<uintptr_t, uint32_t>>> m_rule_starts;  ///< start address and index of each rule of each state, sorted by address
+    std::unordered_map<uint64_t, CachedMask>        m_masks;  ///< allowed tokens by grammar state key
+    uint64_t                                        m_use_counter = 0;  ///< incremented by every mask lookup, orders masks for LRU
+    std::vector<llama_token_data>                   m_candidates;  ///< token buffer reused to compute masks and draw from allowed tokens
+    GrammarStats                                    m_stats;  ///< how tokens were sampled
+};
+
+/**
+ * @brief converts a JSON schema into a GBNF grammar for the JSON values it describes
+ *
+ * Supports the type, properties, required, additionalProperties, items, minItems, maxItems, minLength, maxLength, enum,
+ * const, anyOf, oneOf and $ref to $defs or definitions keywords. Keywords only narrowing values further, such as
+ * pattern, format, minimum or maximum, are not enforced. Objects list their properties in schema order, required ones
+ * always and optional ones only if they are generated.
+ */
+class JsonSchemaGrammar {
+  public:
+    /**
+     * @brief convert a JSON schema
+     *
+     * @param schema JSON schema text
+     * @param grammar string to write the GBNF grammar to
+     * @param error string to write why the schema could not be converted to
+     *
+     * @return whether the schema was converted
+     */
+    static bool convert(std::string_view schema, std::string& grammar, std::string& error);
+
+    /**
+     * @brief get a grammar for any JSON object
+     */
+    static std::string anyObject();
+
+  private:
+    static constexpr int MAX_DEPTH = 64;  ///< deepest nesting of subschemas converted
+
+    JsonSchemaGrammar(const JsonValue& root);
+
+    /**
+     * @brief get a GBNF expression for the values a subschema allows, adding the rules it needs
+     *
+     * @param schema subschema to convert
+     * @param name name for a rule holding the expression
+     * @param depth nesting of the subschema
+     *
+     * @return the expression, empty if the subschema could not be converted
+     */
+    std::string visit(const JsonValue& schema, const std::string& name, int depth);
+
+    /**
+     * @brief get a GBNF expression for the values of one JSON type a subschema allows
+     */
+    std::string visitType(const JsonValue& schema, const std::string& type, const std::string& name, int depth);
+
+    /**
+     * @brief add a rule under a name not yet used, made unique if needed
+     *
+     * @return the name of the rule
+     */
+    std::string addRule(const std::string& name, const std::string& body);
+
+    /**
+     * @brief get a GBNF string literal matching text exactly
+     */
+    static std::string literal(std::string_view text);
+
+    const JsonValue&                                 m_root;  ///< schema whose $defs references resolve in
+    std::vector<std::pair<std::string, std::string>> m_rules;  ///< rule names and bodies in the order they were added
+    std::unordered_map<std::string, std::string>     m_refs;  ///< rule name of each reference already converted
+    std::string                                      m_error;  ///< why the schema could not be converted
+};
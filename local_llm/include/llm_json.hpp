@@ -0,0 +1,164 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+/**
+ * @brief minimal JSON document value for the server API, parsing and serializing RFC 8259 text
+ *
+ * Objects keep their members in insertion order so serialized output is stable.
+ */
+class JsonValue {
+  public:
+    /**
+     * @brief kind of value held
+     */
+    enum class Type : uint8_t {
+        NUL,  ///< null
+        BOOL,  ///< true or false
+        NUMBER,  ///< double precision number
+        STRING,  ///< UTF-8 string
+        ARRAY,  ///< ordered list of values
+        OBJECT,  ///< list of key and value members
+    };
+
+    JsonValue() = default;
+    JsonValue(bool value);
+    JsonValue(int value);
+    JsonValue(int64_t value);
+    JsonValue(uint64_t value);
+    JsonValue(double value);
+    JsonValue(const char* value);
+    JsonValue(std::string value);
+
+    /**
+     * @brief create an empty array
+     */
+    static JsonValue array();
+
+    /**
+     * @brief create an empty object
+     */
+    static JsonValue object();
+
+    /**
+     * @brief parse JSON text
+     *
+     * @param text text to parse, must hold exactly one value apart from whitespace
+     * @param value value to write the result to
+     *
+     * @return whether the text was valid JSON
+     */
+    static bool parse(std::string_view text, JsonValue& value);
+
+    /**
+     * @brief get the kind of value held
+     */
+    Type type() const {
+        return m_type;
+    }
+
+    /**
+     * @brief get a boolean value
+     *
+     * @param fallback value to return if this is not a boolean
+     */
+    bool asBool(bool fallback = false) const {
+        return m_type == Type::BOOL ? m_bool : fallback;
+    }
+
+    /**
+     * @brief get a numeric value
+     *
+     * @param fallback value to return if this is not a number
+     */
+    double asNumber(double fallback = 0.0) const {
+        return m_type == Type::NUMBER ? m_number : fallback;
+    }
+
+    /**
+     * @brief get a string value, empty if this is not a string
+     */
+    const std::string& asString() const {
+        return m_string;
+    }
+
+    /**
+     * @brief get the elements of an array, empty if this is not an array
+     */
+    const std::vector<JsonValue>& items() const {
+        return m_items;
+    }
+
+    /**
+     * @brief get the members of an object in insertion order, empty if this is not an object
+     */
+    const std::vector<std::pair<std::string, JsonValue>>& members() const {
+        return m_members;
+    }
+
+    /**
+     * @brief find an object member
+     *
+     * @param key member name
+     *
+     * @return the member value, nullptr if this is not an object or has no such member
+     */
+    const JsonValue* find(std::string_view key) const;
+
+    /**
+     * @brief get an object member, adding it if it does not exist; a null value becomes an object
+     *
+     * @param key member name
+     */
+    JsonValue& operator[](std::string_view key);
+
+    /**
+     * @brief add an element to an array; a null value becomes an array
+     *
+     * @param value element to add
+     */
+    void push(JsonValue value);
+
+    /**
+     * @brief serialize the value as compact JSON text
+     */
+    std::string dump() const;
+
+  private:
+    static constexpr int MAX_DEPTH = 64;  ///< deepest nesting accepted by the parser
+
+    /**
+     * @brief append the serialized value to a string
+     */
+    void dump(std::string& output) const;
+
+    /**
+     * @brief append a string as a quoted and escaped JSON string
+     */
+    static void dumpString(std::string_view text, std::string& output);
+
+    /**
+     * @brief parse the value starting at a position, advancing the position past it
+     */
+    static bool parseValue(std::string_view text, size_t& pos, JsonValue& value, int depth);
+
+    /**
+     * @brief parse the quoted string starting at a position, advancing the position past it
+     */
+    static bool parseString(std::string_view text, size_t& pos, std::string& output);
+
+    /**
+     * @brief advance the position past whitespace
+     */
+    static void skipWhitespace(std::string_view text, size_t& pos);
+
+    Type                                          m_type   = Type::NUL;  ///< kind of value held
+    bool                                          m_bool   = false;  ///< boolean value
+    double                                        m_number = 0.0;  ///< numeric value
+    std::string                                   m_string;  ///< string value
+    std::vector<JsonValue>                        m_items;  ///< array elements
+    std::vector<std::pair<std::string, JsonValue>> m_members;  ///< object members in insertion order
+};
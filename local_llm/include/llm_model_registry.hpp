@@ -0,0 +1,57 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+#include "llama.h"
+
+/**
+ * @brief process-wide registry of loaded models so the weights of a gguf are only loaded (and mapped) once
+ *
+ * Handles are reference counted; the model is freed when the last handle is released and reloaded on the next acquire.
+ * Contexts, samplers and KV caches stay per instance, only the static weights and LoRA adapters are shared.
+ */
+class ModelRegistry {
+  public:
+    /**
+     * @brief get the registry
+     */
+    static ModelRegistry& instance();
+
+    /**
+     * @brief load the llama backends and apply the NUMA policy; only the first call in a process has any effect
+     *
+     * @param numa [optional] NUMA placement policy for model weights and worker threads
+     */
+    void initBackend(ggml_numa_strategy numa = GGML_NUMA_STRATEGY_DISABLED);
+
+    /**
+     * @brief get a handle to a model, loading it if no other instance holds it
+     *
+     * @param model_path path to the .gguf file
+     * @param n_gpu_layers [optional] number of layers to offload to the GPU; models with different offload are loaded separately
+     *
+     * @return handle to the model, empty if the model could not be loaded
+     */
+    std::shared_ptr<llama_model> acquire(const std::string& model_path, int32_t n_gpu_layers = 100);
+
+    /**
+     * @brief get a handle to a LoRA adapter of a model, loading it if no other instance holds it
+     *
+     * @param model model the adapter was trained for, kept loaded while the adapter handle is held
+     * @param adapter_path path to the adapter .gguf
+     *
+     * @return handle to the adapter, empty if the adapter could not be loaded for the model
+     */
+    std::shared_ptr<llama_adapter_lora> acquireAdapter(const std::shared_ptr<llama_model>& model, const std::string& adapter_path);
+
+  private:
+    ModelRegistry() = default;
+
+    std::mutex                                                  m_mutex;  ///< guards the model map and loading
+    std::once_flag                                              m_backend_init;  ///< llama backends and NUMA are initialized once per process
+    std::unordered_map<std::string, std::weak_ptr<llama_model>> m_models;  ///< loaded models keyed by path and offload
+
+    std::unordered_map<std::string, std::weak_ptr<llama_adapter_lora>> m_adapters;  ///< loaded adapters keyed by model and path
+};
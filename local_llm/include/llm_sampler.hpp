@@ -0,0 +1,95 @@
+#pragma once
+#include <vector>
+#include <random>
+#include <cstdint>
+#include <cmath>
+#include "llama.h"
+
+/**
+ * @brief settings of the fused sampler, stages apply in the order of the stock chain min-p, temperature, top-k, top-p
+ */
+struct SamplerParams {
+    float    temperature = 0.8f;  ///< divides the logits, 0 or below always picks the most likely token
+    float    min_p       = 0.05f;  ///< drops tokens less likely than this fraction of the most likely token at temperature 1, 0 to disable
+    int32_t  top_k       = 0;  ///< keeps this many most likely tokens, 0 to disable
+    float    top_p       = 1.0f;  ///< keeps the most likely tokens until their probabilities add up to this, 1 to disable
+    uint32_t seed        = LLAMA_DEFAULT_SEED;  ///< random seed, LLAMA_DEFAULT_SEED for a random seed
+};
+
+/**
+ * @brief llama_sampler applying min-p, temperature, top-k and top-p and drawing a token with one pass over the vocabulary
+ *
+ * The stock chain makes a pass over the vocabulary for each stage and sorts the tokens it keeps. This sampler makes one
+ * vectorized pass that skips every token below a running threshold, the larger of the min-p bound of the maximum logit so
+ * far and the k-th largest logit so far, so later stages only see the few tokens that can survive: top-k is a partial
+ * selection and top-p sorts a growing prefix of the most likely tokens until enough probability is covered. The tokens
+ * kept and their probabilities are the same as with min_p, temp, top_k, top_p and dist.
+ */
+class FusedSampler {
+  public:
+    /**
+     * @brief FusedSampler constructor, for using the sampler directly; init creates one owned by a llama_sampler
+     *
+     * @param params sampling settings
+     */
+    FusedSampler(const SamplerParams& params);
+
+    /**
+     * @brief create a sampler for llama_sampler_sample, freed with llama_sampler_free
+     *
+     * @param params sampling settings
+     */
+    static llama_sampler* init(const SamplerParams& params);
+
+    /**
+     * @brief reduce token candidates to the tokens a token is drawn from, setting their normalized probabilities
+     *
+     * @param cur_p candidates, replaced by the tokens kept; they are sorted by probability if top-p applied
+     */
+    void filter(llama_token_data_array* cur_p);
+
+    /**
+     * @brief filter the candidates and draw a token from them, setting cur_p->selected
+     */
+    void sample(llama_token_data_array* cur_p);
+
+    /**
+     * @brief seed the random number generator again with the seed of the settings
+     */
+    void reset();
+
+  private:
+    static constexpr size_t TOP_P_FIRST_SORT = 32;  ///< most likely tokens sorted first for top-p, the sorted prefix doubles until it covers top_p
+
+    using ScanFunction = void (FusedSampler::*)(const llama_token_data* data, size_t n);  ///< passes the tokens at or above the running threshold to keep
+
+    /**
+     * @brief add a token at or above the threshold to the candidates, raising the threshold by its logit
+     */
+    void keep(const llama_token_data& token);
+
+    /**
+     * @brief threshold scan without SIMD
+     */
+    void scanScalar(const llama_token_data* data, size_t n);
+
+    /**
+     * @brief threshold scan comparing eight logits at a time with AVX2, the CPU must support it
+     */
+    void scanAvx2(const llama_token_data* data, size_t n);
+
+    /**
+     * @brief get the fastest scan the CPU supports
+     */
+    static ScanFunction selectScan();
+
+    SamplerParams                 m_params;  ///< sampling settings
+    std::mt19937                  m_rng;  ///< draws the token
+    std::vector<llama_token_data> m_candidates;  ///< tokens kept by the stages, its capacity is reused between tokens
+    std::vector<float>            m_top_logits;  ///< min-heap of the top_k largest logits seen in the scan
+    size_t                        m_top_k     = 0;  ///< tokens kept by the scan's top-k threshold, 0 for no limit
+    float                         m_log_min_p = -INFINITY;  ///< min-p threshold relative to the maximum logit
+    float                         m_max_logit = -INFINITY;  ///< largest logit seen in the scan
+    float                         m_threshold = -INFINITY;  ///< tokens below this logit can not be kept by min-p or top-k
+    ScanFunction                  m_scan      = nullptr;  ///< scan implementation chosen for the CPU
+};
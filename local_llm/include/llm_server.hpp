@@ -0,0 +1,224 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <utility>
+#include <cstdint>
+#include "llm_wrapper.hpp"
+#include "llm_json.hpp"
+
+/**
+ * @brief HTTP server exposing OpenAI-style chat completions from a pool of LLM engines
+ *
+ * Listens on a localhost TCP port and/or a Unix domain socket. Each request is parsed on its own connection thread and
+ * placed in a bounded admission queue, requests arriving while the queue is full are rejected with 429 straight away.
+ * One worker thread per engine takes requests from the queue and answers them, streaming the reply as server-sent
+ * events when the request sets "stream"; a reply is cancelled if its client disconnects. Engines share the model weights
+ * through the model registry.
+ *
+ * Requests carry the whole conversation. An engine keeps the conversation it last answered, so a follow-up request that
+ * extends it only prefills the new messages; any other conversation is replayed into the engine from the start.
+ *
+ * LoRA adapters added with addAdapter are served as further models on the same base weights. A request naming one in
+ * "model" is answered by an engine switched to that adapter, unknown model names get the base weights.
+ *
+ * endpoints:
+ *  POST /v1/chat/completions  - model, messages, stream, max_tokens, stop, temperature and seed are honoured
+ *  GET  /v1/models            - the served model and its adapters
+ *  GET  /health               - engine, estimated KV cache and queue state
+ */
+class InferenceServer {
+  public:
+    /**
+     * @brief InferenceServer constructor, loads the engines
+     *
+     * @param model_path path to the model
+     * @param n_engines [optional] number of engines answering requests concurrently
+     * @param queue_capacity [optional] requests that may wait for an engine before new ones are rejected
+     * @param engine_config [optional] threading, batch and offload settings used for every engine
+     * @param debug_level [optional] debug output level, see LLM
+     */
+    InferenceServer(std::string model_path, int n_engines = 1, size_t queue_capacity = 16, EngineConfig engine_config = EngineConfig(), uint8_t debug_level = 0);
+
+    /**
+     * @brief InferenceServer destructor, closes the sockets and stops the workers
+     */
+    ~InferenceServer();
+
+    InferenceServer(const InferenceServer&)            = delete;
+    InferenceServer& operator=(const InferenceServer&) = delete;
+
+    /**
+     * @brief listen for HTTP connections on a TCP port
+     *
+     * @param host address to bind, keep to a loopback address unless the server is meant to be reachable from other hosts
+     * @param port port to bind
+     *
+     * @return whether the socket is listening
+     */
+    bool listenTcp(const std::string& host, uint16_t port);
+
+    /**
+     * @brief listen for HTTP connections on a Unix domain socket, an existing socket file is replaced
+     *
+     * @param path path of the socket file
+     *
+     * @return whether the socket is listening
+     */
+    bool listenUnix(const std::string& path);
+
+    /**
+     * @brief serve a LoRA adapter of the model under its own model name, call before run
+     *
+     * @param name model name clients select the adapter with
+     * @param adapter_path path to the adapter .gguf, an engine loads it the first time a request uses it
+     *
+     * @return whether the adapter file exists and the name is not taken
+     */
+    bool addAdapter(const std::string& name, const std::string& adapter_path);
+
+    /**
+     * @brief accept connections until stop is called
+     */
+    void run();
+
+    /**
+     * @brief make run return, safe to call from a signal handler
+     */
+    void stop() {
+        m_stopping = true;
+    }
+
+  private:
+    static constexpr size_t MAX_HEADER_BYTES    = 64 * 1024;  ///< largest request line and headers accepted
+    static constexpr size_t MAX_BODY_BYTES      = 8 * 1024 * 1024;  ///< largest request body accepted
+    static constexpr int    POLL_INTERVAL_MS    = 200;  ///< how often run checks for stop
+    static constexpr int    RECEIVE_TIMEOUT_S   = 30;  ///< time a client has to send its request
+    static constexpr float  DEFAULT_TEMPERATURE = 0.1f;  ///< temperature for requests that do not set one
+
+    /**
+     * @brief HTTP request as read from a connection
+     */
+    struct HttpRequest {
+        std::string method;  ///< request method, e.g. POST
+        std::string path;  ///< request target without the query string
+        std::string body;  ///< request body
+    };
+
+    /**
+     * @brief chat completion request waiting for an engine
+     */
+    struct Job {
+        int                                              fd = -1;  ///< connection to answer on, owned by the job
+        std::string                                      id;  ///< completion id returned to the client
+        std::string                                      model;  ///< model name reported to the client
+        std::string                                      adapter;  ///< LoRA adapter to answer with, empty for the base weights
+        std::string                                      system_prompt;  ///< system message, empty if none
+        std::vector<std::pair<std::string, std::string>> turns;  ///< earlier user messages and the replies to them
+        std::string                                      prompt;  ///< user message to answer
+        bool                                             stream      = false;  ///< whether to stream server-sent events
+        std::vector<std::string>                         stop;  ///< stop strings ending the reply
+        int32_t                                          max_tokens  = -1;  ///< reply length limit, -1 for none
+        float                                            temperature = -1.0f;  ///< sampling temperature, below 0 for the engine default
+        int64_t                                          seed        = -1;  ///< sampling seed, below 0 for a random seed
+        std::string                                      grammar;  ///< GBNF grammar the reply must match, empty for free text
+    };
+
+    /**
+     * @brief model instance and the conversation it holds
+     */
+    struct Engine {
+        std::unique_ptr<LLM>                             llm;  ///< the engine
+        std::string                                      system_prompt;  ///< system prompt the engine is set up with
+        std::vector<std::pair<std::string, std::string>> turns;  ///< exchanges held in the engine's chat
+        std::thread                                      worker;  ///< thread answering requests with the engine
+    };
+
+    /**
+     * @brief read a request from a connection, queue chat completions and answer everything else directly
+     *
+     * @param fd connection, closed unless it was handed to a job
+     */
+    void handleConnection(int fd);
+
+    /**
+     * @brief read the request line, headers and body of an HTTP request
+     *
+     * @return whether a complete request was read
+     */
+    bool readRequest(int fd, HttpRequest& request) const;
+
+    /**
+     * @brief build a job from a chat completion request body
+     *
+     * @param body request JSON
+     * @param job job to fill in
+     * @param error description of what is wrong with the request
+     *
+     * @return whether the request is valid
+     */
+    bool parseChatRequest(const std::string& body, Job& job, std::string& error) const;
+
+    /**
+     * @brief take jobs from the queue and answer them with an engine until the server stops
+     */
+    void workerLoop(Engine& engine);
+
+    /**
+     * @brief bring an engine's chat in line with a job's conversation and generate the reply
+     */
+    void processJob(Engine& engine, Job& job);
+
+    /**
+     * @brief check whether the client has closed a connection
+     */
+    static bool clientClosed(int fd);
+
+    /**
+     * @brief write all bytes to a connection
+     *
+     * @return whether everything was written, false if the client went away
+     */
+    static bool sendAll(int fd, std::string_view data);
+
+    /**
+     * @brief write a complete HTTP response
+     */
+    static void sendResponse(int fd, int status, std::string_view content_type, std::string_view body);
+
+    /**
+     * @brief write an OpenAI-style error response
+     */
+    static void sendError(int fd, int status, const std::string& message, const std::string& type);
+
+    // settings
+    std::string m_model_path;  ///< path to the model
+    std::string m_model_name;  ///< model name reported to clients, the file name of the model
+    size_t      m_queue_capacity = 16;  ///< maximum queued jobs
+    uint8_t     m_debug_level    = 0;  ///< debug level to use
+
+    std::vector<std::pair<std::string, std::string>> m_adapters;  ///< names and paths of the adapters served besides the base model
+
+    // engines
+    std::vector<std::unique_ptr<Engine>> m_engines;  ///< engines and their worker threads
+
+    // admission queue
+    std::mutex              m_queue_mutex;  ///< guards the queue and the active job count
+    std::condition_variable m_queue_cv;  ///< signals workers that a job was queued or the server is stopping
+    std::deque<Job>         m_queue;  ///< jobs waiting for an engine
+    size_t                  m_active_jobs = 0;  ///< jobs being answered by an engine
+    std::atomic<bool>       m_stopping    = false;  ///< set to make run return and the workers exit
+    std::atomic<uint64_t>   m_next_id     = 0;  ///< counter for completion ids
+
+    // connections
+    std::vector<int>        m_listen_fds;  ///< listening sockets
+    std::string             m_unix_path;  ///< Unix socket file to remove on shutdown, empty if none
+    std::mutex              m_connections_mutex;  ///< guards the open connection count
+    std::condition_variable m_connections_cv;  ///< signals that a connection thread finished
+    size_t                  m_open_connections = 0;  ///< connection threads still running
+};
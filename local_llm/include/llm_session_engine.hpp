@@ -0,0 +1,212 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include "llama.h"
+#include "llm_chat_formatter.hpp"
+#include "llm_tokenizer.hpp"
+#include "llm_wrapper.hpp"
+
+/**
+ * @brief serves many chat sessions from one llama context using continuous batching
+ *
+ * Each session owns a sequence id in a shared, unified KV cache. Every call to step() builds a single batch containing
+ * one decode token for each generating session and fills the remaining batch space with prefill chunks of sessions
+ * that have a new prompt queued, so prompt processing of new requests overlaps with generation for active ones.
+ * When the KV cache is full the least recently used idle session loses its history first; a running turn is only ended
+ * with FinishReason::CONTEXT_FULL when no idle session holds cells.
+ *
+ * usage:
+ *  1) openSession to reserve a sequence
+ *  2) submit a prompt for the session
+ *  3) call step (or run) until isBusy returns false for the session
+ *  4) takeResponse to get the reply; the session keeps its history for the next submit until closeSession
+ */
+class SessionEngine {
+  public:
+    /**
+     * @brief SessionEngine constructor
+     *
+     * @param model_path path to the model
+     * @param max_sessions [optional] maximum number of concurrent sessions (sequences in the context)
+     * @param n_ctx [optional] total context size in tokens, shared between all sessions, used if the engine config does not set one
+     * @param temperature [optional] temperature to use for sampling
+     * @param debug_level [optional] debug output level, see LLM
+     * @param engine_config [optional] KV cache, threading, batch and offload settings
+     */
+    SessionEngine(std::string model_path, int max_sessions = 8, int n_ctx = 8192, float temperature = 0.1f, uint8_t debug_level = 0, EngineConfig engine_config = EngineConfig());
+
+    /**
+     * @brief SessionEngine destructor
+     */
+    ~SessionEngine();
+
+    /**
+     * @brief reserve a session
+     *
+     * @return id of the session, -1 if all sessions are in use
+     */
+    int openSession();
+
+    /**
+     * @brief release a session and its KV cache cells
+     *
+     * @param session_id id of the session to close
+     */
+    void closeSession(int session_id);
+
+    /**
+     * @brief queue a chat turn for a session; the prompt is prefilled and answered by subsequent calls to step
+     *
+     * @param session_id id of an idle session
+     * @param prompt user message to respond to
+     * @param max_tokens [optional] reply length limit in tokens, -1 for no limit
+     *
+     * @return whether the turn was queued, false if the session is not open or is still busy
+     */
+    bool submit(int session_id, const std::string& prompt, int32_t max_tokens = -1);
+
+    /**
+     * @brief run one decode over a batch mixing decode tokens of generating sessions and prefill chunks of new requests
+     *
+     * @return whether there was any work to do
+     */
+    bool step();
+
+    /**
+     * @brief call step until every session is idle
+     */
+    void run();
+
+    /**
+     * @brief check whether a session is still processing its last submitted turn
+     *
+     * @param session_id id of the session
+     */
+    bool isBusy(int session_id) const;
+
+    /**
+     * @brief get the reply to the last completed turn of a session
+     *
+     * @param session_id id of the session
+     *
+     * @return the reply, empty if the session has not finished a turn since the last call
+     */
+    std::string takeResponse(int session_id);
+
+    /**
+     * @brief get why the last completed turn of a session ended
+     *
+     * @param session_id id of the session
+     */
+    FinishReason finishReason(int session_id) const;
+
+    /**
+     * @brief get the number of reply tokens generated in the last turn of a session
+     *
+     * @param session_id id of the session
+     */
+    uint32_t generatedTokens(int session_id) const;
+
+    /**
+     * @brief get the number of sessions currently processing a turn
+     */
+    int busySessions() const;
+
+    /**
+     * @brief get the number of session slots
+     */
+    int maxSessions() const {
+        return m_sessions.size();
+    }
+
+    /**
+     * @brief get the estimated size of the KV cache shared by all sessions, see EngineConfig::estimateKvCacheBytes
+     */
+    uint64_t estimatedKvCacheBytes() const {
+        return m_engine_config.estimateKvCacheBytes(m_model);
+    }
+
+  private:
+    /**
+     * @brief processing state of a session
+     */
+    enum class SessionState : uint8_t {
+        FREE,  ///< not in use
+        IDLE,  ///< open with no turn in progress
+        PREFILL,  ///< prompt tokens are being evaluated
+        DECODE,  ///< reply tokens are being generated
+    };
+
+    /**
+     * @brief a chat session held as one sequence in the shared context
+     */
+    struct Session {
+        SessionState             state = SessionState::FREE;  ///< processing state
+        llama_seq_id             seq_id = 0;  ///< sequence in the context
+        llama_sampler*           sampler = nullptr;  ///< per-session sampler so sampling state is independent
+        ChatFormatter            chat;  ///< chat messages and their incrementally formatted text
+        size_t                   prev_prompt_length = 0;  ///< formatted chat length already given to the model
+        std::vector<llama_token> prompt_tokens;  ///< tokens of the turn being prefilled
+        size_t                   prefill_offset = 0;  ///< number of prompt tokens already added to a batch
+        llama_pos                n_past = 0;  ///< number of tokens in the sequence
+        llama_token              next_token = 0;  ///< sampled token to feed back in the next step
+        int32_t                  batch_index = -1;  ///< index of this session's output in the current batch, -1 if none
+        std::string              response;  ///< reply being generated
+        bool                     response_ready = false;  ///< whether response holds a finished reply
+        int32_t                  max_tokens = -1;  ///< reply length limit of the current turn, -1 for none
+        uint32_t                 n_generated = 0;  ///< reply tokens generated in the current turn
+        FinishReason             finish_reason = FinishReason::END_OF_TEXT;  ///< why the last turn ended
+        uint64_t                 last_used = 0;  ///< use counter value of the last submit, for LRU
+    };
+
+    /**
+     * @brief format a session's chat history with the new user message and tokenize the part the model has not seen
+     *
+     * @param session session to prepare
+     * @param prompt new user message
+     *
+     * @return whether the prompt was prepared
+     */
+    bool preparePrompt(Session& session, const std::string& prompt);
+
+    /**
+     * @brief finish the current turn of a session, recording the reply in its history
+     *
+     * @param session session to finish
+     * @param reason why the turn ended
+     */
+    void finishTurn(Session& session, FinishReason reason);
+
+    /**
+     * @brief remove a session's KV cells and chat history, leaving it open with no turn in progress
+     *
+     * @param session session to reset
+     */
+    void resetSession(Session& session);
+
+    /**
+     * @brief add a token to the engine batch
+     */
+    void addToBatch(llama_token token, llama_pos pos, llama_seq_id seq_id, bool output);
+
+    // misc
+    uint8_t m_debug_level = 0;  ///< debug level to use
+
+    // model components
+    std::shared_ptr<llama_model> m_model_handle;  ///< registry handle keeping the shared model loaded
+    llama_model*                 m_model         = nullptr;  ///< the llama model
+    const llama_vocab*           m_vocab         = nullptr;  ///< the model vocabulary
+    llama_context*               m_context       = nullptr;  ///< context shared by all sessions
+    const char*                  m_chat_template = nullptr;  ///< template for chat
+    float                        m_temperature   = 0.1f;  ///< sampling temperature
+    Tokenizer                    m_tokenizer;  ///< converts text to token IDs
+    EngineConfig                 m_engine_config;  ///< resolved context, KV cache, threading and batch settings
+
+    // batching
+    llama_batch          m_batch;  ///< batch rebuilt every step
+    std::vector<Session> m_sessions;  ///< session slots, indexed by session id
+    size_t               m_next_prefill = 0;  ///< session to give prefill budget to first, rotated for fairness
+    uint64_t             m_use_counter  = 0;  ///< incremented by every submit, orders idle sessions for LRU
+};
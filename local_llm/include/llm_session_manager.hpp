@@ -0,0 +1,125 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include "llm_wrapper.hpp"
+
+/**
+ * @brief where a session's chat is held
+ */
+enum class SessionTier {
+    NONE,  ///< unknown session, the next chat starts it
+    HOT,  ///< resident in the context of an engine, chats continue straight away
+    RAM,  ///< serialized in host memory, restored into an engine on the next chat
+    DISK,  ///< serialized to a file, restored into an engine on the next chat
+};
+
+/**
+ * @brief serves many chat sessions from a few LLM engines by moving idle sessions out of the context
+ *
+ * Each engine holds one hot session in its KV cache. A chat for a session that is not hot takes the least recently used
+ * idle engine: the engine's session is serialized with its KV cells into host memory and the requested session is
+ * restored from memory or disk, so reactivating a session costs a state copy instead of a prefill of its transcript.
+ * Serialized sessions beyond the memory budget are written to disk, least recently used first, or discarded if there
+ * is no disk directory.
+ *
+ * Sessions are independent, chats for different sessions run concurrently on different engines and chats for the same
+ * session run one after the other. Files written to the disk directory are removed when their session is restored,
+ * closed, or the manager is destroyed.
+ */
+class SessionManager {
+  public:
+    /**
+     * @brief SessionManager constructor
+     *
+     * @param engines engines to hold hot sessions, each holds one; they must outlive the manager and not be used directly
+     * @param ram_budget [optional] bytes of serialized sessions kept in host memory
+     * @param disk_path [optional] directory for sessions beyond the memory budget, empty to discard them instead
+     * @param debug_level [optional] 1 or above prints every session move
+     */
+    SessionManager(std::vector<LLM*> engines, size_t ram_budget = 1ull << 30, std::string disk_path = "", uint8_t debug_level = 0);
+
+    /**
+     * @brief SessionManager destructor, removes the session files it wrote
+     */
+    ~SessionManager();
+
+    SessionManager(const SessionManager&)            = delete;
+    SessionManager& operator=(const SessionManager&) = delete;
+
+    /**
+     * @brief answer a prompt in a session, making the session hot first
+     *
+     * @param session_id session to continue, an unknown id starts a new session
+     * @param prompt user message to respond to
+     * @param options [optional] length limit, deadline, stop strings and streaming callback for this turn
+     *
+     * @return the reply and why it ended
+     */
+    ChatResult chat(const std::string& session_id, std::string prompt, const ChatOptions& options = ChatOptions());
+
+    /**
+     * @brief forget a session in whichever tier it is held, waiting for a running chat of the session to finish
+     */
+    void closeSession(const std::string& session_id);
+
+    /**
+     * @brief get where a session is held
+     */
+    SessionTier tier(const std::string& session_id) const;
+
+    /**
+     * @brief get the bytes of serialized sessions held in host memory
+     */
+    size_t ramBytes() const;
+
+  private:
+    /**
+     * @brief engine and the hot session it holds
+     */
+    struct Slot {
+        LLM*        llm = nullptr;  ///< the engine
+        std::string session_id;  ///< hot session, empty if the engine holds none
+        bool        busy      = false;  ///< whether a chat or session move is using the engine
+        uint64_t    last_used = 0;  ///< use counter value of the last chat, for LRU
+    };
+
+    /**
+     * @brief session moved out of the context
+     */
+    struct Parked {
+        std::vector<uint8_t> state;  ///< serialized chat, empty if it is on disk
+        std::string          file;  ///< session file, empty if it is in memory
+        uint64_t             last_used = 0;  ///< use counter value of the last chat, for LRU
+    };
+
+    /**
+     * @brief write the least recently used sessions in memory to disk until the memory budget is met
+     * @note called with the mutex held, which is released while the files are written
+     *
+     * @param lock lock holding the mutex
+     */
+    void enforceRamBudget(std::unique_lock<std::mutex>& lock);
+
+    /**
+     * @brief remove a parked session and its file
+     * @note called with the mutex held
+     */
+    void dropParked(std::unordered_map<std::string, Parked>::iterator it);
+
+    std::vector<Slot>                       m_slots;  ///< engines and their hot sessions
+    std::unordered_map<std::string, Parked> m_parked;  ///< sessions in memory or on disk
+    std::unordered_set<std::string>         m_moving;  ///< sessions being serialized out of an engine or written to disk, in no tier until done
+    size_t                                  m_ram_budget = 0;  ///< most bytes of serialized sessions in memory
+    size_t                                  m_ram_bytes  = 0;  ///< bytes of serialized sessions in memory
+    std::string                             m_disk_path;  ///< directory for session files, empty for no disk tier
+    uint64_t                                m_use_counter = 0;  ///< incremented by every chat, orders sessions for LRU
+    uint64_t                                m_next_file   = 0;  ///< number of the next session file
+    uint8_t                                 m_debug_level = 0;  ///< debug level to use
+    mutable std::mutex                      m_mutex;  ///< guards every member above
+    std::condition_variable                 m_cv;  ///< signals that an engine was released
+};
@@ -0,0 +1,56 @@
+#pragma once
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include "llama.h"
+
+/**
+ * @brief tokenizes text in a single llama_tokenize call into caller-owned buffers that are reused between calls
+ *
+ * The output buffer is sized from the text length so one pass is normally enough, a second call only happens if the
+ * vocabulary produces more tokens than bytes. Very large inputs for BPE vocabularies are split at newline boundaries,
+ * which the BPE pre-tokenizer never merges across, and tokenized on several threads.
+ */
+class Tokenizer {
+  public:
+    /**
+     * @brief Tokenizer constructor
+     *
+     * @param vocab [optional] vocabulary to tokenize with
+     */
+    Tokenizer(const llama_vocab* vocab = nullptr);
+
+    /**
+     * @brief set the vocabulary to tokenize with
+     */
+    void setVocab(const llama_vocab* vocab);
+
+    /**
+     * @brief tokenize text, parsing special tokens
+     *
+     * @param text text to tokenize
+     * @param add_special whether to add BOS (and EOS if the vocabulary uses it)
+     * @param tokens buffer to write the tokens to; resized to the number of tokens, its capacity is kept for the next call
+     *
+     * @return whether the text was tokenized
+     */
+    bool tokenize(std::string_view text, bool add_special, std::vector<llama_token>& tokens);
+
+  private:
+    static constexpr size_t PARALLEL_MIN_CHARS  = 64 * 1024;  ///< inputs shorter than this are tokenized on the calling thread
+    static constexpr size_t PARALLEL_CHUNK_SIZE = 32 * 1024;  ///< minimum characters per parallel chunk
+
+    /**
+     * @brief tokenize text on the calling thread
+     */
+    bool tokenizeSerial(std::string_view text, bool add_special, std::vector<llama_token>& tokens);
+
+    /**
+     * @brief split text at safe boundaries and tokenize the chunks on separate threads
+     */
+    bool tokenizeParallel(std::string_view text, bool add_special, std::vector<llama_token>& tokens);
+
+    const llama_vocab*                    m_vocab = nullptr;  ///< vocabulary to tokenize with
+    bool                                  m_can_split = false;  ///< whether text can be split for parallel tokenization
+    std::vector<std::vector<llama_token>> m_chunk_tokens;  ///< per-chunk token buffers for parallel tokenization
+};
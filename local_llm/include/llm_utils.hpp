@@ -10,4 +10,29 @@ class ConsoleInput {
      * @brief get the input text from the commandline; single enter will be treated as \n, double enter will end input
      */
     std::string getInput();
-};
\ No newline at end of file
+};
+
+/**
+ * @brief accumulates streamed text pieces and only releases complete UTF-8 sequences, tokens can split multi-byte characters
+ */
+class Utf8StreamBuffer {
+  public:
+    /**
+     * @brief add a piece of text to the buffer
+     *
+     * @param piece the text to add, may end part way through a multi-byte character
+     *
+     * @return the buffered text up to the last complete character, removed from the buffer
+     */
+    std::string push(const std::string& piece);
+
+    /**
+     * @brief release whatever is left in the buffer, including any incomplete trailing sequence
+     *
+     * @return the remaining buffered text
+     */
+    std::string flush();
+
+  private:
+    std::string m_pending;  ///< text not yet released
+};
@@ -0,0 +1,293 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <span>
+#include <cstdint>
+#include "llm_wrapper.hpp"
+
+/**
+ * @brief document found by a vector index search
+ */
+struct SearchResult {
+    uint32_t id;  ///< index of the document in the order it was added
+    float    score;  ///< cosine similarity to the query
+};
+
+/**
+ * @brief stores unit length document embeddings and their text for retrieval, with exact and HNSW approximate search
+ *
+ * Embeddings are held as one contiguous row-major matrix, followed in the index file by the document text and the HNSW
+ * graph, each section 64 byte aligned. An index written with save is reopened with open by memory mapping the file, so
+ * nothing is re-embedded or rebuilt at startup. Adding documents to an opened index first copies it into memory.
+ *
+ * Exact search scans every embedding with AVX-512 or AVX2 dot products when the CPU supports them. The HNSW graph
+ * (hierarchical navigable small world) gives sub-millisecond approximate search on large corpora; once built with
+ * buildGraph, documents added later are inserted into it as they are added.
+ */
+class VectorIndex {
+  public:
+    /**
+     * @brief VectorIndex constructor
+     *
+     * @param pooling [optional] pooling used to embed documents and queries
+     */
+    VectorIndex(EmbeddingPooling pooling = EmbeddingPooling::MEAN);
+
+    /**
+     * @brief VectorIndex destructor
+     */
+    ~VectorIndex();
+
+    VectorIndex(const VectorIndex&)            = delete;
+    VectorIndex& operator=(const VectorIndex&) = delete;
+
+    /**
+     * @brief embed documents with a model and add them to the index
+     *
+     * @param llm model to embed the documents with, queries must be embedded with the same model
+     * @param documents document texts
+     *
+     * @return whether the documents were added
+     */
+    bool addDocuments(LLM& llm, std::span<const std::string> documents);
+
+    /**
+     * @brief add documents with precomputed embeddings, which are normalized to unit length
+     *
+     * @param embeddings one row per document, all rows must have the dimension of the index
+     * @param documents document texts
+     *
+     * @return whether the documents were added, false if the counts or dimension do not match
+     */
+    bool add(const EmbeddingMatrix& embeddings, std::span<const std::string> documents);
+
+    /**
+     * @brief build the HNSW graph over every document; later additions are inserted into the graph
+     *
+     * @param max_neighbors [optional] links per node on the upper layers, twice this on the bottom layer
+     * @param ef_construction [optional] candidate list size while inserting, higher builds a better graph more slowly
+     */
+    void buildGraph(uint32_t max_neighbors = 16, uint32_t ef_construction = 200);
+
+    /**
+     * @brief find the documents most similar to a query, using the HNSW graph if it has been built
+     *
+     * @param query unit length query embedding with the dimension of the index
+     * @param top_k number of results
+     * @param ef_search [optional] candidate list size for graph search, higher is more accurate and slower
+     *
+     * @return up to top_k results, most similar first
+     */
+    std::vector<SearchResult> search(const float* query, size_t top_k, uint32_t ef_search = 64) const;
+
+    /**
+     * @brief find the documents most similar to a query by comparing it with every document
+     *
+     * @param query unit length query embedding with the dimension of the index
+     * @param top_k number of results
+     *
+     * @return up to top_k results, most similar first
+     */
+    std::vector<SearchResult> searchExact(const float* query, size_t top_k) const;
+
+    /**
+     * @brief get the text of a document
+     *
+     * @param id index of the document
+     */
+    std::string_view document(uint32_t id) const;
+
+    /**
+     * @brief write the index to a file that can be reopened with open
+     *
+     * @param path path of the index file
+     *
+     * @return whether the file was written
+     */
+    bool save(const std::string& path) const;
+
+    /**
+     * @brief memory map an index file written with save, replacing the current contents
+     * @note section bounds, text offsets and graph links are checked first, so a truncated or corrupted file fails to open
+     *
+     * @param path path of the index file
+     *
+     * @return whether the index was opened, the index is left empty if not
+     */
+    bool open(const std::string& path);
+
+    /**
+     * @brief get the number of documents
+     */
+    size_t size() const {
+        return m_count;
+    }
+
+    /**
+     * @brief get the embedding dimension, 0 until documents are added
+     */
+    size_t dim() const {
+        return m_dim;
+    }
+
+    /**
+     * @brief get the pooling used to embed documents and queries
+     */
+    EmbeddingPooling pooling() const {
+        return m_pooling;
+    }
+
+  private:
+    static constexpr uint32_t INDEX_MAGIC   = 0x58444956;  ///< "VIDX" marker at the start of index files
+    static constexpr uint32_t INDEX_VERSION = 1;  ///< index file format version, bump when the layout changes
+    static constexpr uint32_t NO_NODE       = UINT32_MAX;  ///< unused neighbor slot
+    static constexpr uint32_t MAX_LEVEL     = 15;  ///< highest HNSW layer
+
+    /**
+     * @brief index file header, sections follow at the recorded 64 byte aligned offsets
+     */
+    struct FileHeader {
+        uint32_t magic;  ///< INDEX_MAGIC
+        uint32_t version;  ///< INDEX_VERSION
+        uint32_t dim;  ///< embedding dimension
+        uint32_t pooling;  ///< EmbeddingPooling used for the embeddings
+        uint64_t count;  ///< number of documents
+        uint32_t has_graph;  ///< whether the graph sections are present
+        uint32_t max_neighbors;  ///< HNSW links per node on upper layers
+        uint32_t ef_construction;  ///< HNSW candidate list size used while inserting
+        uint32_t entry_point;  ///< HNSW node on the highest layer
+        uint32_t max_level;  ///< highest layer of the graph
+        uint32_t reserved;  ///< padding
+        uint64_t vectors_offset;  ///< count x dim floats
+        uint64_t text_offsets_offset;  ///< count + 1 uint64 offsets into the text
+        uint64_t text_offset;  ///< concatenated document text
+        uint64_t levels_offset;  ///< count uint8 node levels
+        uint64_t links_offset;  ///< count x 2 max_neighbors uint32 bottom layer links
+        uint64_t upper_offsets_offset;  ///< count uint64 offsets into the upper layer links
+        uint64_t upper_links_offset;  ///< upper layer links, max_neighbors per layer above 0 for each node
+        uint64_t upper_links_count;  ///< number of upper layer links
+    };
+
+    using DotFunction = float (*)(const float* a, const float* b, size_t n);  ///< dot product of two vectors of n floats
+
+    /**
+     * @brief dot product without SIMD
+     */
+    static float dotScalar(const float* a, const float* b, size_t n);
+
+    /**
+     * @brief dot product using AVX2 and FMA, the CPU must support them
+     */
+    static float dotAvx2(const float* a, const float* b, size_t n);
+
+    /**
+     * @brief dot product using AVX-512, the CPU must support it
+     */
+    static float dotAvx512(const float* a, const float* b, size_t n);
+
+    /**
+     * @brief get the fastest dot product the CPU supports
+     */
+    static DotFunction selectDot();
+
+    /**
+     * @brief copy a memory mapped index into owned buffers so it can be modified
+     */
+    void materialize();
+
+    /**
+     * @brief point the section views at the owned buffers
+     */
+    void refreshViews();
+
+    /**
+     * @brief release the memory mapped file, if any
+     */
+    void unmap();
+
+    /**
+     * @brief get the embedding of a document
+     */
+    const float* vector(uint32_t id) const {
+        return m_vectors + (size_t)id * m_dim;
+    }
+
+    /**
+     * @brief get the neighbor list of a node on a layer
+     *
+     * @return max_neighbors slots, or twice that on layer 0, unused slots hold NO_NODE
+     */
+    const uint32_t* neighbors(uint32_t id, uint32_t level) const;
+
+    /**
+     * @brief get the neighbor list of a node on a layer for modification, the index must not be mapped
+     */
+    uint32_t* mutableNeighbors(uint32_t id, uint32_t level);
+
+    /**
+     * @brief get the neighbor slots per node on a layer
+     */
+    uint32_t neighborSlots(uint32_t level) const {
+        return level == 0 ? 2 * m_max_neighbors : m_max_neighbors;
+    }
+
+    /**
+     * @brief best-first search of one graph layer
+     *
+     * @param query query embedding
+     * @param entry node to start from
+     * @param ef number of candidates to keep
+     * @param level layer to search
+     *
+     * @return up to ef nodes, most similar first
+     */
+    std::vector<SearchResult> searchLayer(const float* query, uint32_t entry, uint32_t ef, uint32_t level) const;
+
+    /**
+     * @brief insert a document into the HNSW graph
+     */
+    void insertNode(uint32_t id);
+
+    /**
+     * @brief choose up to n diverse neighbors from candidates sorted most similar first, preferring candidates closer to the node than to already chosen neighbors
+     */
+    void selectNeighbors(std::vector<SearchResult>& candidates, uint32_t n) const;
+
+    // contents
+    EmbeddingPooling m_pooling = EmbeddingPooling::MEAN;  ///< pooling used for the embeddings
+    size_t           m_dim     = 0;  ///< embedding dimension
+    size_t           m_count   = 0;  ///< number of documents
+    DotFunction      m_dot     = nullptr;  ///< dot product implementation chosen for the CPU
+
+    // HNSW graph parameters
+    bool     m_has_graph       = false;  ///< whether the graph covers every document
+    uint32_t m_max_neighbors   = 16;  ///< links per node on upper layers
+    uint32_t m_ef_construction = 200;  ///< candidate list size while inserting
+    uint32_t m_entry_point     = NO_NODE;  ///< node on the highest layer
+    uint32_t m_max_level       = 0;  ///< highest layer of the graph
+    uint64_t m_level_rng       = 0x9E3779B97F4A7C15;  ///< state of the generator drawing node levels
+
+    // owned buffers, used while the index is built in memory
+    std::vector<float>    m_owned_vectors;  ///< embeddings, row-major
+    std::vector<uint64_t> m_owned_text_offsets = { 0 };  ///< start of each document's text, plus the end
+    std::string           m_owned_text;  ///< concatenated document text
+    std::vector<uint8_t>  m_owned_levels;  ///< highest layer of each node
+    std::vector<uint32_t> m_owned_links;  ///< bottom layer neighbors
+    std::vector<uint64_t> m_owned_upper_offsets;  ///< start of each node's upper layer neighbors
+    std::vector<uint32_t> m_owned_upper_links;  ///< upper layer neighbors
+
+    // views of the sections, into the owned buffers or the mapped file
+    const float*    m_vectors       = nullptr;  ///< embeddings
+    const uint64_t* m_text_offsets  = nullptr;  ///< text offsets
+    const char*     m_text          = nullptr;  ///< document text
+    const uint8_t*  m_levels        = nullptr;  ///< node levels
+    const uint32_t* m_links         = nullptr;  ///< bottom layer neighbors
+    const uint64_t* m_upper_offsets = nullptr;  ///< upper layer neighbor offsets
+    const uint32_t* m_upper_links   = nullptr;  ///< upper layer neighbors
+    uint64_t        m_upper_links_count = 0;  ///< number of upper layer neighbor slots
+
+    // memory mapped file
+    void*  m_mapped      = nullptr;  ///< start of the mapped file, nullptr if the index is held in memory
+    size_t m_mapped_size = 0;  ///< size of the mapping
+};
@@ -1,14 +1,190 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <span>
 #include <algorithm>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <cstdint>
 #include "llama.h"
+#include "llm_chat_formatter.hpp"
+#include "llm_tokenizer.hpp"
+#include "llm_engine_config.hpp"
+
+ /**
+  * @brief timings and sizes recorded for one chat turn, times are at nanosecond resolution
+  */
+ struct TurnMetrics {
+        std::chrono::nanoseconds              retrieval_time{ 0 };  ///< embedding the prompt and searching the retrieval index
+        std::chrono::nanoseconds              format_time{ 0 };  ///< applying the chat template to the user message
+        std::chrono::nanoseconds              tokenize_time{ 0 };  ///< tokenizing the new chat text
+        std::chrono::nanoseconds              prefill_time{ 0 };  ///< evaluating the prompt tokens up to the first sampled token
+        std::chrono::nanoseconds              total_time{ 0 };  ///< whole turn, from formatting to the last token
+        std::vector<std::chrono::nanoseconds> token_times;  ///< time taken to produce each reply token after the first
+        uint32_t                              prompt_tokens       = 0;  ///< tokens prefilled for the turn
+        uint32_t                              prefix_tokens_saved = 0;  ///< preamble tokens reused from the prefix cache instead of prefilled
+        uint32_t                              reused_tokens       = 0;  ///< tokens kept from a replaced conversation up to its first difference instead of prefilled
+        uint32_t                              sampled_tokens      = 0;  ///< reply tokens generated
+        uint32_t                              drafted_tokens      = 0;  ///< tokens proposed by the draft model
+        uint32_t                              accepted_tokens     = 0;  ///< proposed tokens accepted by the model
+        uint32_t                              kv_cells_used       = 0;  ///< tokens held in the chat sequence after the turn
+        uint32_t                              n_ctx               = 0;  ///< context size in tokens
+        size_t                                history_bytes       = 0;  ///< bytes of chat message content held after the turn
+ };
+
+ /**
+  * @brief limits, callbacks and output constraints for one chat turn
+  */
+ struct ChatOptions {
+        int32_t                                 max_tokens = -1;  ///< reply length limit in tokens, -1 for the limit set with setMaxTokens
+        std::chrono::steady_clock::time_point   deadline   = std::chrono::steady_clock::time_point::max();  ///< time after which no more tokens are generated
+        std::vector<std::string>                stop;  ///< the reply ends before the first of these strings it contains, which is not returned or streamed
+        std::function<void(const std::string&)> on_piece;  ///< called with each newly decoded piece of the reply, on the thread generating it
+        std::string                             grammar;  ///< GBNF grammar starting at rule root the reply must match, empty for free text
+        std::string                             json_schema;  ///< JSON schema the reply must be a value of when no grammar is set, empty for free text
+ };
+
+ /**
+  * @brief why a reply ended
+  */
+ enum class FinishReason : uint8_t {
+        END_OF_TEXT,  ///< the model finished its reply
+        LENGTH,  ///< the token limit was reached
+        STOP_STRING,  ///< a stop string was generated
+        DEADLINE,  ///< the deadline passed
+        CANCELLED,  ///< the reply was cancelled
+        CONTEXT_FULL,  ///< no more tokens fit in the context
+        GRAMMAR_ERROR,  ///< the grammar or JSON schema could not be used, nothing was generated
+        DECODE_ERROR,  ///< the model failed to evaluate the tokens for a reason other than a full context
+ };
+
+ /**
+  * @brief reply to a chat turn
+  */
+ struct ChatResult {
+        std::string  text;  ///< reply text
+        FinishReason finish_reason = FinishReason::END_OF_TEXT;  ///< why the reply ended
+ };
+
+ /**
+  * @brief handle to a reply being generated on the LLM worker thread
+  */
+ class ChatHandle {
+    public:
+        ChatHandle() = default;
+
+        /**
+         * @brief ChatHandle constructor
+         *
+         * @param result reply once it is complete
+         * @param cancel flag checked before each generated token
+         */
+        ChatHandle(std::future<ChatResult> result, std::shared_ptr<std::atomic<bool>> cancel) : m_result(std::move(result)), m_cancel(std::move(cancel)) {}
+
+        /**
+         * @brief stop generating, the reply ends within one decode step and keeps the text generated so far
+         */
+        void cancel() {
+          if (m_cancel) {
+            m_cancel->store(true, std::memory_order_relaxed);
+          }
+        }
+
+        /**
+         * @brief check whether the reply is complete
+         */
+        bool ready() const {
+          return m_result.valid() && m_result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+
+        /**
+         * @brief wait for the reply to complete
+         */
+        void wait() const {
+          m_result.wait();
+        }
+
+        /**
+         * @brief wait for the reply to complete for at most some time
+         *
+         * @param timeout longest time to wait
+         *
+         * @return whether the reply is complete
+         */
+        template <typename Rep, typename Period>
+        bool waitFor(std::chrono::duration<Rep, Period> timeout) const {
+          return m_result.wait_for(timeout) == std::future_status::ready;
+        }
+
+        /**
+         * @brief wait for the reply and take it, the handle is empty afterwards
+         */
+        ChatResult get() {
+          return m_result.get();
+        }
+
+        /**
+         * @brief check whether the handle refers to a reply that has not been taken yet
+         */
+        bool valid() const {
+          return m_result.valid();
+        }
+
+    private:
+        std::future<ChatResult>            m_result;  ///< reply once it is complete
+        std::shared_ptr<std::atomic<bool>> m_cancel;  ///< set to stop generating
+ };
+
+ class VectorIndex;
+ class GrammarConstraint;
+
+ /**
+  * @brief how token embeddings are reduced to one embedding per input text
+  */
+ enum class EmbeddingPooling : uint8_t {
+        MEAN,  ///< average of all token embeddings
+        CLS,  ///< embedding of the first token
+        LAST,  ///< embedding of the last token, for causal models
+ };
+
+ /**
+  * @brief embeddings of several texts stored in one contiguous row-major buffer
+  */
+ struct EmbeddingMatrix {
+        std::vector<float> values;  ///< rows x dim values, row i is the embedding of input i
+        size_t             rows = 0;  ///< number of embeddings
+        size_t             dim  = 0;  ///< size of each embedding
+
+        /**
+         * @brief get the embedding of an input
+         *
+         * @param index index of the input
+         */
+        const float* row(size_t index) const {
+          return values.data() + index * dim;
+        }
+ };
 
  /**
   * @brief wrapper class for LLM using llama.cpp
   */
  class LLM {
     public:
+        // roles the chat templates know, the reply must use the role the generation prompt ends with so only new messages are formatted
+        static constexpr const char* SYSTEM_ROLE  = "system";  ///< role used for the system prompt message
+        static constexpr const char* USER_ROLE    = "user";  ///< role used for user chat messages
+        static constexpr const char* MACHINE_ROLE = "assistant";  ///< role used for LLM chat messages
+
         /**
          * @brief LLM class constructor
          * 
@@ -17,10 +193,12 @@
          * @param print_progress [optional] whether to print indication of response processing progress
          * @param debug_level [optional] sets debug output level, higher level outputs include output from lower levels:
          *          0 - no output (default)
-         *          1 - statistics (inference time, number of input tokens)
+         *          1 - statistics (inference time, number of input tokens, draft acceptance rate)
          *          2 - print llama and class debug messages
+         * @param draft_model_path [optional] path to a smaller model sharing the vocabulary, used to propose tokens for speculative decoding
+         * @param engine_config [optional] threading, NUMA, batch and offload settings, defaults suit the local machine
          */
-        LLM(std::string model_path, float temperature = 0.0f, bool print_progress = false, uint8_t debug_level = 0);
+        LLM(std::string model_path, float temperature = 0.0f, bool print_progress = false, uint8_t debug_level = 0, std::string draft_model_path = "", EngineConfig engine_config = EngineConfig());
 
         /**
          * @brief LLM class destructor
@@ -28,10 +206,45 @@
         ~LLM();
 
         /**
-         * @brief clear the chat history and associated caches
+         * @brief clear the chat history and associated caches; the evaluated system prompt preamble is kept and reused
          */
         void clearChat();
 
+        /**
+         * @brief set the system prompt that starts every conversation; the chat is cleared and the preamble re-evaluated
+         *
+         * @param system_prompt system prompt text, an empty string means no system message
+         */
+        void setSystemPrompt(const std::string& system_prompt);
+
+        /**
+         * @brief run the chat on a LoRA adapter of the model, or on the base weights
+         *
+         * Adapters are loaded once and shared with every instance using the same model, the most recently used ones stay
+         * loaded up to the adapter cache size so switching back is fast. The preamble and the current chat are evaluated
+         * again with the new weights, the chat itself is kept. Waits for a running turn to finish.
+         *
+         * @param adapter_path path to a LoRA .gguf trained for the model, empty to detach the adapter
+         * @param scale [optional] strength the adapter is applied with
+         *
+         * @return whether the adapter is in use, on failure the previous adapter stays in use
+         */
+        bool setAdapter(const std::string& adapter_path, float scale = 1.0f);
+
+        /**
+         * @brief get the path of the LoRA adapter in use, empty for the base weights
+         */
+        const std::string& getAdapter() const {
+          return m_adapter_path;
+        }
+
+        /**
+         * @brief set how many adapters stay loaded, least recently used ones beyond this are released
+         *
+         * @param cache_size adapters kept loaded, the adapter in use is always kept
+         */
+        void setAdapterCacheSize(size_t cache_size);
+
         /**
          * @brief set the temperature for the network
          * 
@@ -41,39 +254,668 @@
           m_temperature = std::clamp(temperature, 0.1f, 1.0f);
         }
 
+        /**
+         * @brief check that the grammar or JSON schema of turn options can be used, compiling it so the turn finds it cached
+         *
+         * @param options options of the turn
+         * @param error [optional] set to why the grammar or JSON schema cannot be used
+         *
+         * @return false if a turn with the options would end with FinishReason::GRAMMAR_ERROR
+         */
+        bool checkGrammar(const ChatOptions& options, std::string* error = nullptr);
+
+        /**
+         * @brief seed the token sampler so replies are reproducible, this also applies the current temperature
+         *
+         * @param seed random seed, LLAMA_DEFAULT_SEED for a random seed
+         */
+        void setSeed(uint32_t seed);
+
+        /**
+         * @brief limit the number of tokens generated for each reply
+         *
+         * @param max_tokens maximum reply length in tokens, -1 for no limit
+         */
+        void setMaxTokens(int32_t max_tokens) {
+          m_max_tokens = max_tokens;
+        }
+
+        /**
+         * @brief propose draft tokens by finding the latest tokens earlier in the context, for replies that quote or rewrite the prompt
+         * @note proposals are verified like draft model proposals, so replies are unchanged; ignored while a draft model is loaded
+         *
+         * @param max_ngram longest run of latest tokens looked up, shorter runs down to two tokens are tried next; 0 disables prompt lookup
+         * @param n_draft [optional] most tokens proposed per verification step
+         */
+        void setPromptLookup(int32_t max_ngram, int32_t n_draft = 8) {
+          m_lookup_ngram = max_ngram > 0 ? std::max<int32_t>(max_ngram, LOOKUP_MIN_NGRAM) : 0;
+          m_lookup_draft = std::max(1, n_draft);
+        }
+
+        /**
+         * @brief enable recording of TurnMetrics for each chat turn; metrics are also recorded while an observer is set
+         *
+         * @param enable whether to record metrics
+         */
+        void enableMetrics(bool enable) {
+          m_record_metrics = enable;
+        }
+
+        /**
+         * @brief set a callback invoked with the metrics of each completed chat turn
+         *
+         * @param observer callback, an empty function removes the observer
+         */
+        void setMetricsObserver(std::function<void(const TurnMetrics&)> observer) {
+          m_metrics_observer = std::move(observer);
+        }
+
+        /**
+         * @brief get the metrics of the last chat turn, empty unless metrics were recorded for it
+         */
+        const TurnMetrics& getTurnMetrics() const {
+          return m_turn_metrics;
+        }
+
+        /**
+         * @brief get the estimated KV cache size of the chat context from the context size and cache types of the engine
+         * config, see EngineConfig::estimateKvCacheBytes
+         */
+        uint64_t getEstimatedKvCacheBytes() const {
+          return m_engine_config.estimateKvCacheBytes(m_model);
+        }
+
+        /**
+         * @brief get the resolved engine config the chat context was created with
+         */
+        const EngineConfig& getEngineConfig() const {
+          return m_engine_config;
+        }
+
+        /**
+         * @brief get the prompt and generation timings of the chat context accumulated since the last resetPerformance
+         */
+        llama_perf_context_data getPerformance() const {
+          return llama_perf_context(m_context);
+        }
+
+        /**
+         * @brief reset the timings returned by getPerformance
+         */
+        void resetPerformance() {
+          llama_perf_context_reset(m_context);
+        }
+
         /**
          * @brief get the network response to the specified prompt using a chat-style interaction
          */
         std::string getChatResponse(std::string prompt);
 
+        /**
+         * @brief get the network response to the specified prompt, streaming the reply as it is generated
+         *
+         * @param prompt the user message
+         * @param on_piece callback invoked with each newly decoded piece of the reply; pieces always end on a complete UTF-8 character
+         *
+         * @return the full reply
+         */
+        std::string getChatResponse(std::string prompt, const std::function<void(const std::string&)>& on_piece);
+
+        /**
+         * @brief get the network response to the specified prompt, stopping at the limits set in the options
+         *
+         * @param prompt the user message
+         * @param options limits and streaming callback for the turn
+         *
+         * @return the reply and why it ended
+         */
+        ChatResult getChatResponse(std::string prompt, const ChatOptions& options);
+
+        /**
+         * @brief generate the response to the specified prompt on the LLM worker thread
+         * @note turns run one at a time in the order they were requested; other methods must not be called until the handle is ready
+         *
+         * @param prompt the user message
+         * @param options [optional] limits and streaming callback for the turn, on_piece is called on the worker thread
+         *
+         * @return handle to wait for, take or cancel the reply
+         */
+        ChatHandle getChatResponseAsync(std::string prompt, ChatOptions options = ChatOptions());
+
+        /**
+         * @brief add a completed exchange to the chat without generating, used to replay a conversation held elsewhere
+         *
+         * @param prompt the user message
+         * @param reply the reply to record for it
+         *
+         * @return whether the exchange was evaluated, false if it does not fit in the context
+         */
+        bool addTurn(const std::string& prompt, const std::string& reply);
+
+        /**
+         * @brief replace the conversation after the system prompt, keeping the KV cells of the current one up to the first token that differs
+         *
+         * Only the tokens after the point where the conversations diverge are evaluated, and cells the new conversation
+         * does not reach yet stay reusable by the next turn: replacing the conversation by its own history and asking the
+         * last prompt again only evaluates the last prompt token.
+         *
+         * @param turns user messages and the replies to them, oldest first
+         *
+         * @return whether the conversation was evaluated, false if it does not fit in the context, which clears the chat
+         */
+        bool setChat(const std::vector<std::pair<std::string, std::string>>& turns);
+
+        /**
+         * @brief discard the last reply and answer its prompt again, only the new reply tokens are evaluated
+         *
+         * @param options [optional] limits and streaming callback for the turn
+         *
+         * @return the new reply and why it ended, an empty reply if the chat has no reply yet
+         */
+        ChatResult regenerate(const ChatOptions& options = ChatOptions());
+
+        /**
+         * @brief replace the last user message and its reply, only the tokens after the edit are evaluated
+         *
+         * @param prompt the edited user message
+         * @param options [optional] limits and streaming callback for the turn
+         *
+         * @return the reply and why it ended
+         */
+        ChatResult editLastMessage(std::string prompt, const ChatOptions& options = ChatOptions());
+
+        /**
+         * @brief generate several candidate replies to the prompt, evaluating the prompt once and every candidate's next token in one batch
+         *
+         * The prompt is evaluated in the chat sequence and forked into a sequence per candidate that shares its KV cells, each
+         * candidate samples with its own sampler. The chat continues with the first candidate until selectResponse picks another.
+         * Candidates only differ through sampling, so they are more varied at higher temperatures.
+         *
+         * @param prompt the user message
+         * @param n_replies number of candidates, limited by the fork sequences not held by forkChat
+         * @param options [optional] limits for each candidate, on_piece is not called
+         *
+         * @return the candidates and why each ended
+         */
+        std::vector<ChatResult> getChatResponses(std::string prompt, size_t n_replies, const ChatOptions& options = ChatOptions());
+
+        /**
+         * @brief continue the chat with another candidate of the last getChatResponses call, without evaluating it again
+         *
+         * @param index index of the candidate in the replies returned
+         *
+         * @return whether the candidate was selected, false if there is no such candidate or the chat changed since
+         */
+        bool selectResponse(size_t index);
+
+        /**
+         * @brief keep the current conversation in a fork that restoreFork returns to, sharing its KV cells rather than copying them
+         * @note a fork only holds its own cells where it differs from the chat; they are given up when the chat needs the context
+         *       space or is evaluated again with other weights, after which restoring the fork evaluates its conversation again
+         *
+         * @return id of the fork, -1 if every fork sequence is in use
+         */
+        int32_t forkChat();
+
+        /**
+         * @brief continue the conversation held in a fork, replacing the current chat; only tokens the fork no longer holds are evaluated
+         *
+         * @param fork_id id returned by forkChat, the fork is kept
+         *
+         * @return whether the conversation was restored, false if there is no such fork or it does not fit in the context
+         */
+        bool restoreFork(int32_t fork_id);
+
+        /**
+         * @brief release a fork and the KV cells only it holds
+         *
+         * @param fork_id id returned by forkChat
+         */
+        void dropFork(int32_t fork_id);
+
+        /**
+         * @brief compute embeddings for many texts, packing them into shared batches with one sequence per text
+         * @note uses a separate embeddings context created on first use, the chat is not affected; texts longer than the batch are truncated
+         *
+         * @param texts texts to embed
+         * @param pooling [optional] how token embeddings are reduced to one embedding per text
+         * @param normalize [optional] whether to scale each embedding to unit length
+         *
+         * @return one row per text, empty if the embeddings could not be computed
+         */
+        EmbeddingMatrix embed(std::span<const std::string> texts, EmbeddingPooling pooling = EmbeddingPooling::MEAN, bool normalize = true);
+
+        /**
+         * @brief prepend the passages most relevant to each prompt from a retrieval index, the index must outlive its use here
+         *
+         * @param index index of passages embedded with this model, nullptr to disable retrieval
+         * @param top_k [optional] number of passages to add to each prompt
+         */
+        void setRetrieval(const VectorIndex* index, size_t top_k = 3) {
+          m_retrieval_index = index;
+          m_retrieval_top_k = top_k;
+        }
+
+        /**
+         * @brief save the current chat (KV cache of the chat sequence and message history) to disk
+         *
+         * @param path path of the session file to write
+         *
+         * @return whether the session was saved successfully
+         */
+        bool saveSession(const std::string& path);
+
+        /**
+         * @brief restore a chat previously written with saveSession, replacing the current chat
+         * @note files written for a different model or session format version are rejected and leave the chat cleared
+         *
+         * @param path path of the session file to read
+         *
+         * @return whether the session was restored successfully
+         */
+        bool loadSession(const std::string& path);
+
+        /**
+         * @brief serialize the current chat in the session file format, for keeping it in memory
+         *
+         * @param state buffer replaced with the chat state
+         */
+        void saveState(std::vector<uint8_t>& state);
+
+        /**
+         * @brief restore a chat serialized with saveState or read from a session file, replacing the current chat
+         * @note state for a different model or session format version is rejected, corrupt state leaves the chat cleared
+         *
+         * @param state serialized chat
+         *
+         * @return whether the chat was restored successfully
+         */
+        bool loadState(std::span<const uint8_t> state);
+
       private:
 
+        static constexpr uint32_t     SESSION_MAGIC   = 0x534D4C4C;  ///< "LLMS" marker at the start of session files
+        static constexpr uint32_t     SESSION_VERSION = 4;  ///< session file format version, bump when the layout changes
+        static constexpr llama_seq_id CHAT_SEQ        = 0;  ///< sequence holding the current conversation
+        static constexpr llama_seq_id PREFIX_SEQ      = 1;  ///< reserved sequence holding the evaluated conversation preamble
+        static constexpr uint32_t     EMBED_BATCH     = 8192;  ///< tokens per embeddings batch
+        static constexpr uint32_t     EMBED_MAX_SEQ   = 64;  ///< texts per embeddings batch
+        static constexpr uint32_t     DEFAULT_N_CTX   = 4096;  ///< context size in tokens when the engine config does not set one
+        static constexpr llama_seq_id FIRST_FORK_SEQ  = 2;  ///< first sequence used for forks and reply candidates
+        static constexpr llama_seq_id MAX_FORKS       = 8;  ///< sequences for forks and reply candidates, unified KV cells make them cost only their own tokens
+        static constexpr int32_t      LOOKUP_MIN_NGRAM = 2;  ///< shortest run of tokens looked up for prompt lookup, single tokens recur too often to predict what follows
+
+        /**
+         * @brief run a chat turn, the turn mutex must be held
+         *
+         * @param prompt the user message
+         * @param options limits and streaming callback for the turn
+         * @param cancel flag stopping generation when set, may be nullptr
+         * @param retrieve [optional] whether to add retrieved passages to the prompt, false for a prompt that already holds them
+         *
+         * @return the reply and why it ended
+         */
+        ChatResult runTurn(std::string prompt, const ChatOptions& options, const std::atomic<bool>* cancel, bool retrieve = true);
+
+        /**
+         * @brief get the exchanges of the chat held in the context, oldest first
+         */
+        std::vector<std::pair<std::string, std::string>> chatTurns() const;
+
+        /**
+         * @brief empty the chat history, leaving the KV cells and context tokens to the caller
+         */
+        void resetHistory();
+
+        /**
+         * @brief remove the cells of a replaced conversation that were not reused
+         */
+        void dropStaleTokens();
+
+        /**
+         * @brief add the user message to the chat, retrieving passages for it first if enabled
+         *
+         * @param prompt the user message
+         * @param retrieve whether to add retrieved passages to the prompt
+         *
+         * @return the formatted chat text the model has not been given yet
+         */
+        std::string appendPrompt(std::string prompt, bool retrieve);
+
+        /**
+         * @brief add a generated reply to the chat
+         *
+         * @param response the reply
+         * @param context_bytes length of the start of the reply whose tokens are held in the context
+         */
+        void appendReply(const std::string& response, size_t context_bytes);
+
+        /**
+         * @brief remove the user message added by appendPrompt when its tokens could not be evaluated, so the chat and the KV cache agree
+         *
+         * @param prompt_length length of the formatted text appendPrompt returned
+         */
+        void rollbackPrompt(size_t prompt_length);
+
+        /**
+         * @brief create the sampler chain used for replies, a fused min-p and temperature sampler
+         *
+         * @param temperature temperature for token sampling
+         * @param seed random seed, LLAMA_DEFAULT_SEED for a random seed
+         */
+        static llama_sampler* createSampler(float temperature, uint32_t seed);
+
+        /**
+         * @brief set up the grammar of the options for the replies of a turn, compiling it unless it is cached
+         *
+         * @param options options of the turn, the grammar is cleared if they set none
+         * @param n_replies number of replies generated together
+         * @param error [optional] set to why the grammar or JSON schema could not be used
+         *
+         * @return false if the grammar or JSON schema could not be used
+         */
+        bool prepareGrammar(const ChatOptions& options, size_t n_replies, std::string* error = nullptr);
+
+        /**
+         * @brief find where the first stop string in the end of a response starts
+         *
+         * @param response reply generated so far
+         * @param piece_size length of the piece just added to the response, earlier text was already searched
+         * @param stop stop strings
+         * @param max_stop length of the longest stop string
+         *
+         * @return start of the stop string, std::string::npos if there is none
+         */
+        static size_t findStop(const std::string& response, size_t piece_size, const std::vector<std::string>& stop, size_t max_stop);
+
+        /**
+         * @brief release the sequences of the reply candidates of the last getChatResponses call
+         */
+        void releaseCandidates();
+
+        /**
+         * @brief get the KV cells held by forks and not by the chat sequence, counting cells shared between forks once per fork
+         */
+        size_t forkCells() const;
+
+        /**
+         * @brief remove the KV cells of every fork, their conversations are evaluated again when restored
+         */
+        void releaseForkCells();
+
+        /**
+         * @brief remove the chat sequence's KV cells from a position on, forks sharing them keep their own reference
+         *
+         * @param start_pos first position to remove
+         */
+        void removeChatCells(llama_pos start_pos);
+
+        /**
+         * @brief record the metrics of a completed turn and pass them to the observer
+         *
+         * @param turn_start time the turn started
+         */
+        void completeTurnMetrics(std::chrono::steady_clock::time_point turn_start);
+
         /**
          * @brief generates a response to the specified string
          * 
          * @param prompt the prompt to process with the LLM
+         * @param options limits and streaming callback for the turn
+         * @param cancel flag stopping generation when set, may be nullptr
+         * @param context_bytes set to the length of the start of the reply whose tokens are held in the context
+         * @param prompt_evaluated set to whether the prompt tokens were evaluated, if not nothing was generated
          * 
-         * @return the response from the LLM
+         * @return the response from the LLM and why it ended
+         */
+        ChatResult getResponseString(std::string prompt, const ChatOptions& options, const std::atomic<bool>* cancel, size_t& context_bytes, bool& prompt_evaluated);
+
+        /**
+         * @brief run queued asynchronous turns until the LLM is destroyed
+         */
+        void asyncLoop();
+
+        /**
+         * @brief find the passages of the retrieval index most relevant to a prompt
+         *
+         * @param prompt user message
+         *
+         * @return the passages formatted to go before the prompt, empty if there are none
+         */
+        std::string retrieveContext(const std::string& prompt);
+
+        /**
+         * @brief create the embeddings context for a pooling type, replacing one created for another pooling type
+         *
+         * @return whether the context is ready
+         */
+        bool ensureEmbedContext(EmbeddingPooling pooling);
+
+        /**
+         * @brief check whether metrics are recorded for the current turn, debug output is built from them too
+         */
+        bool metricsEnabled() const {
+          return m_record_metrics || m_metrics_observer || m_debug_level > 0;
+        }
+
+        /**
+         * @brief get a hash identifying the loaded model and adapter, used to reject session files written for other models
+         *
+         * @return 64-bit FNV-1a hash of the model description and hyperparameters, and of the adapter in use if any
+         */
+        uint64_t getModelHash() const;
+
+        /**
+         * @brief evaluate the conversation preamble (BOS and system prompt) into the reserved prefix sequence
+         */
+        void buildPrefixCache();
+
+        /**
+         * @brief evaluate the preamble and the chat sequence again, after a change of weights made their KV cells stale
+         *
+         * @return whether the chat was evaluated, if not it is cleared
+         */
+        bool rebuildKvCache();
+
+        /**
+         * @brief release the least recently used adapters beyond the adapter cache size, keeping the one in use
+         */
+        void trimAdapterCache();
+
+        /**
+         * @brief run the specified tokens through a model for a sequence, splitting them into chunks of at most n_batch tokens
+         * @note logits are always produced for the last token
+         *
+         * @param context context to decode with
+         * @param tokens tokens to evaluate
+         * @param n_tokens number of tokens to evaluate
+         * @param seq_id sequence to add the tokens to
+         * @param start_pos position of the first token in the sequence
+         * @param output_all [optional] whether to produce logits for every token rather than just the last, tokens must fit in one batch
+         *
+         * @return whether all tokens were decoded successfully
+         */
+        bool decodeTokens(llama_context* context, const llama_token* tokens, size_t n_tokens, llama_seq_id seq_id, llama_pos start_pos, bool output_all = false);
+
+        /**
+         * @brief evaluate tokens in the chat sequence, appending them to the tokens held in the context
+         *
+         * @param tokens tokens to evaluate
+         * @param n_tokens number of tokens to evaluate
+         * @param output_all [optional] whether to produce logits for every token rather than just the last
+         * @param need_logits [optional] whether logits are needed for the last token, if not cells of a replaced conversation matching all tokens are kept as they are
+         *
+         * @return whether the tokens were evaluated, false if they cannot fit in the context
          */
-        std::string getResponseString(std::string prompt);
+        bool decodeChatTokens(const llama_token* tokens, size_t n_tokens, bool output_all = false, bool need_logits = true);
+
+        /**
+         * @brief make room in the context for new tokens by discarding the oldest chat turns after the preamble and shifting the rest back
+         *
+         * @param n_tokens number of tokens that need to fit
+         *
+         * @return whether there is room for the tokens
+         */
+        bool ensureContextSpace(size_t n_tokens);
+
+        /**
+         * @brief use the draft model or prompt lookup to propose tokens following the chat context and the specified token
+         *
+         * @param last_token sampled token that has not been evaluated yet
+         *
+         * @return the proposed tokens, empty if neither the draft model nor prompt lookup is enabled
+         */
+        std::vector<llama_token> draftTokens(llama_token last_token);
+
+        /**
+         * @brief propose the tokens that followed the latest occurrence of the longest run of latest tokens found earlier in the context
+         *
+         * @param last_token sampled token that has not been evaluated yet, it ends the run looked up
+         *
+         * @return the proposed tokens, empty if no run was found
+         */
+        std::vector<llama_token> lookupTokens(llama_token last_token);
+
+        /**
+         * @brief hash a run of tokens for the prompt lookup index
+         *
+         * @param tokens first token of the run
+         * @param n_tokens length of the run
+         *
+         * @return 64-bit FNV-1a hash of the run and its length
+         */
+        static uint64_t ngramKey(const llama_token* tokens, size_t n_tokens);
 
         // misc
         bool    m_print_progress      = false;  ///< whether to print model progress to command line
         float   m_time_between_dots_s = 0.75;  ///< number of seconds between printing dots
         uint8_t m_debug_level         = 0;  ///< debug level to use
 
+        // metrics
+        bool                                    m_record_metrics = false;  ///< whether to record metrics without an observer
+        std::function<void(const TurnMetrics&)> m_metrics_observer;  ///< called with the metrics of each turn
+        TurnMetrics                             m_turn_metrics;  ///< metrics of the last turn
+
         // model parameters
-        float m_temperature = 0.1; ///< temperature for the LLM
+        float    m_temperature = 0.1; ///< temperature for the LLM
+        uint32_t m_seed        = LLAMA_DEFAULT_SEED;  ///< sampler seed set with setSeed
+        int32_t  m_max_tokens  = -1;  ///< maximum tokens per reply, -1 for no limit
 
         // model components
-        llama_model*       m_model   = nullptr;  ///< the llama model, static weights loaded from the disk into memory Usually shared between contexts
-        const llama_vocab* m_vocab   = nullptr;  ///< the vocabulary, matching of strings to token IDs
-        llama_sampler*     m_sampler = nullptr;  ///< selects token ID from raw "logits" score for each possible token
+        std::shared_ptr<llama_model> m_model_handle;  ///< registry handle keeping the shared model loaded
+        llama_model*                 m_model   = nullptr;  ///< the llama model, static weights loaded from the disk into memory shared between contexts
+        const llama_vocab*           m_vocab   = nullptr;  ///< the vocabulary, matching of strings to token IDs
+        llama_sampler*               m_sampler = nullptr;  ///< selects token ID from raw "logits" score for each possible token
+        Tokenizer                    m_tokenizer;  ///< converts text to token IDs
+        std::vector<llama_token>     m_prompt_tokens;  ///< token buffer reused for each prompt
+
+        // prefix cache
+        std::string              m_system_prompt;  ///< system prompt that starts each conversation
+        int                      m_prefix_text_length  = 0;  ///< number of formatted chat characters covered by the prefix cache
+        std::vector<llama_token> m_prefix_tokens;  ///< tokens held in the prefix sequence
+        int                      m_prefix_tokens_saved = 0;  ///< prefix tokens copied into the chat sequence that the next turn does not need to prefill
+        size_t                   m_unshared_prefix     = 0;  ///< prefix cells held a second time because the chat sequence does not share them, 0 if it does
+        llama_batch              m_batch;  ///< batch used for explicit sequence decoding
+
+        // embeddings
+        llama_context*           m_embed_context = nullptr;  ///< context producing pooled embeddings, created on first use
+        EmbeddingPooling         m_embed_pooling = EmbeddingPooling::MEAN;  ///< pooling the embeddings context was created with
+        llama_batch              m_embed_batch{};  ///< batch packing several texts
+        std::vector<llama_token> m_embed_tokens;  ///< tokens of every text being embedded
+        std::vector<size_t>      m_embed_offsets;  ///< start of each text's tokens in m_embed_tokens, plus the end
+
+        // retrieval
+        const VectorIndex* m_retrieval_index = nullptr;  ///< passages to retrieve from, nullptr if retrieval is disabled
+        size_t             m_retrieval_top_k = 3;  ///< passages added to each prompt
+
+        // speculative decoding
+        std::shared_ptr<llama_model> m_draft_model_handle;  ///< registry handle keeping the shared draft model loaded
+        llama_model*                 m_draft_model   = nullptr;  ///< small model proposing tokens, nullptr if speculative decoding is disabled
+        llama_context*               m_draft_context = nullptr;  ///< context for the draft model
+        llama_sampler*               m_draft_sampler = nullptr;  ///< greedy sampler for draft proposals
+        std::vector<llama_token>     m_draft_tokens;  ///< tokens held in the draft context
+        int                          m_n_draft    = 8;  ///< number of tokens to propose per verification step
+        uint64_t                     m_n_drafted  = 0;  ///< tokens proposed by the draft model this turn
+        uint64_t                     m_n_accepted = 0;  ///< proposed tokens accepted by the main model this turn
+
+        // prompt lookup
+        int32_t                                m_lookup_ngram = 0;  ///< longest run of tokens looked up, 0 if prompt lookup is disabled
+        int32_t                                m_lookup_draft = 8;  ///< most tokens proposed per verification step
+        std::unordered_map<uint64_t, uint32_t> m_lookup_index;  ///< position following the latest occurrence of each run of tokens in the context
+        std::vector<llama_token>               m_lookup_tokens;  ///< context tokens when the index was last updated, runs ending before the last one are indexed
+
+        // constrained decoding
+        static constexpr size_t                                               GRAMMAR_CACHE_SIZE = 8;  ///< most compiled grammars kept with their token masks
+        std::list<std::pair<std::string, std::unique_ptr<GrammarConstraint>>> m_grammars;  ///< compiled grammars by GBNF text, most recently used first
+        GrammarConstraint*                                                    m_grammar = nullptr;  ///< grammar of the replies being generated, nullptr for free text
+
+        // LoRA adapters
+        std::list<std::pair<std::string, std::shared_ptr<llama_adapter_lora>>> m_adapters;  ///< loaded adapters by path, most recently used first
+        size_t                                                                 m_adapter_cache_size = 4;  ///< most adapters kept loaded
+        std::string                                                            m_adapter_path;  ///< adapter applied to the chat context, empty for the base weights
+        float                                                                  m_adapter_scale = 1.0f;  ///< strength of the adapter in use
+
+        /**
+         * @brief where a chat turn starts, used to discard whole turns when the context is full
+         */
+        struct TurnStart {
+            uint32_t token_pos;  ///< position in the chat sequence of the first token of the turn
+            uint32_t message_index;  ///< index in the chat history of the user message starting the turn
+        };
+
+        /**
+         * @brief conversation kept by forkChat
+         */
+        struct Fork {
+            llama_seq_id                                     seq_id;  ///< sequence sharing the KV cells of the conversation
+            std::vector<llama_token>                         tokens;  ///< tokens held in the sequence, empty once its cells were given up
+            size_t                                           shared = 0;  ///< leading tokens whose cells the chat sequence holds too
+            std::vector<std::pair<std::string, std::string>> turns;  ///< exchanges of the conversation, replayed to restore it
+        };
+
+        /**
+         * @brief reply generated by getChatResponses
+         */
+        struct Candidate {
+            llama_seq_id             seq_id;  ///< sequence holding the conversation followed by the reply
+            std::vector<llama_token> tokens;  ///< reply tokens held in the sequence
+            std::string              text;  ///< reply text
+            size_t                   context_bytes = 0;  ///< length of the start of the reply whose tokens are held in the sequence
+        };
+
+        // forks and reply candidates
+        std::map<int32_t, Fork>   m_forks;  ///< forks by id
+        int32_t                   m_next_fork_id = 0;  ///< id of the next fork
+        std::vector<llama_seq_id> m_free_seqs;  ///< fork sequences not in use
+        std::vector<Candidate>    m_candidates;  ///< candidates of the last getChatResponses call, empty once the chat changed
+        size_t                    m_candidates_start = 0;  ///< position of the first reply token of the candidates
+
+        /**
+         * @brief turn requested with getChatResponseAsync
+         */
+        struct AsyncJob {
+            std::packaged_task<ChatResult()>   task;  ///< runs the turn and fulfils the handle
+            std::shared_ptr<std::atomic<bool>> cancel;  ///< cancel flag shared with the handle
+        };
+
+        // asynchronous turns
+        std::mutex                         m_turn_mutex;  ///< held while a turn runs so turns do not interleave
+        std::mutex                         m_async_mutex;  ///< guards the job queue
+        std::condition_variable            m_async_cv;  ///< signals the worker that a job was queued or the LLM is being destroyed
+        std::deque<AsyncJob>               m_async_jobs;  ///< turns waiting for the worker
+        std::shared_ptr<std::atomic<bool>> m_async_current;  ///< cancel flag of the turn the worker is running
+        bool                               m_async_stopping = false;  ///< set by the destructor to stop the worker
+        std::thread                        m_async_worker;  ///< runs asynchronous turns, started on first use
 
         // chat elements
+        EngineConfig                    m_engine_config;  ///< resolved context, KV cache, threading and batch settings
+        CpuThreadpools                  m_threadpools;  ///< pinned worker threads, only used if the engine config sets CPU affinity
         llama_context*                  m_context            = nullptr;  ///< the context for the current session
-        int                             m_prev_prompt_length = 0;  ///< length of prompt from previous iteration
-        std::vector<llama_chat_message> m_chat_history;  ///< current chat messages
-        std::vector<char>               m_formatted_chat_messages;  ///< llama format chat messages
+        std::vector<llama_token>        m_context_tokens;  ///< tokens held in the chat sequence of the context
+        std::vector<llama_token>        m_stale_tokens;  ///< tokens of a replaced conversation still held in the chat sequence after m_context_tokens
+        uint32_t                        m_reused_tokens      = 0;  ///< stale tokens kept since the last turn instead of prefilled
+        int                             m_prev_prompt_length = 0;  ///< number of formatted chat characters already given to the model
+        ChatFormatter                   m_chat;  ///< chat messages and their incrementally formatted text
+        std::vector<TurnStart>          m_turn_starts;  ///< start of each chat turn held in the context, oldest first
         const char*                     m_chat_template;  ///< template for chat
  };
\ No newline at end of file
@@ -0,0 +1,93 @@
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstring>
+#include "llm_chat_formatter.hpp"
+#include "llm_wrapper.hpp"
+#include "commandline_args.hpp"
+
+/**
+ * @brief compares per-turn chat formatting cost of re-applying the template to the whole chat against incremental formatting
+ */
+int main(int argc, char* argv[]) {
+
+    // get arguments
+    std::unique_ptr<CommandLineArgs> arg_parser = std::make_unique<CommandLineArgs>("Chat format benchmark", "Measures per-turn chat template overhead as a conversation grows; no model is needed");
+    arg_parser->addArgument<std::string>("template", "chat template name or string, e.g. llama3, chatml", "t", "llama3");
+    arg_parser->addArgument<int32_t>("turns", "number of user/assistant turns to simulate", "n", 200);
+    arg_parser->addArgument<int32_t>("report_every", "print the average per-turn time over windows of this many turns", "r", 10);
+    arg_parser->parse(argc, argv);
+
+    const std::string chat_template = arg_parser->getArgument<std::string>("template");
+    const int         n_turns       = arg_parser->getArgument<int32_t>("turns");
+    const int         report_every  = std::max(1, arg_parser->getArgument<int32_t>("report_every"));
+
+    // fixed, moderately long messages so the chat grows steadily
+    const std::string user_message  = "Please summarise the main points of the previous answer and suggest one follow-up question about the topic.";
+    const std::string reply_message = "Here is a summary of the previous answer along with a follow-up question that explores the topic in more depth. " + std::string(400, 'x');
+
+    // full re-application, as the chat was formatted before: the template is applied to every message twice per turn
+    std::vector<llama_chat_message> history;
+    std::vector<char>               formatted(1024);
+    std::vector<double>             full_times_us;
+    for (int turn = 0; turn < n_turns; ++turn) {
+        auto turn_start = std::chrono::steady_clock::now();
+
+        history.push_back({ LLM::USER_ROLE, strdup(user_message.c_str()) });
+        int new_len = llama_chat_apply_template(chat_template.c_str(), history.data(), history.size(), true, formatted.data(), formatted.size());
+        if (new_len > (int)formatted.size()) {
+            formatted.resize(new_len);
+            new_len = llama_chat_apply_template(chat_template.c_str(), history.data(), history.size(), true, formatted.data(), formatted.size());
+        }
+        if (new_len < 0) {
+            std::cout << "could not apply chat template '" << chat_template << "'!" << std::endl;
+            return 1;
+        }
+        history.push_back({ LLM::MACHINE_ROLE, strdup(reply_message.c_str()) });
+        llama_chat_apply_template(chat_template.c_str(), history.data(), history.size(), false, nullptr, 0);
+
+        full_times_us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - turn_start).count());
+    }
+    for (auto& message : history) {
+        free(const_cast<char*>(message.content));
+    }
+
+    // incremental formatting, with the roles LLM formats its chat with
+    ChatFormatter       chat(chat_template.c_str());
+    std::vector<double> incremental_times_us;
+    for (int turn = 0; turn < n_turns; ++turn) {
+        auto turn_start = std::chrono::steady_clock::now();
+
+        if (chat.append(LLM::USER_ROLE, user_message, true) < 0 || chat.append(LLM::MACHINE_ROLE, reply_message, false) < 0) {
+            std::cout << "could not apply chat template '" << chat_template << "'!" << std::endl;
+            return 1;
+        }
+
+        incremental_times_us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - turn_start).count());
+    }
+
+    // report average per-turn time over windows of turns
+    std::cout << "turns\tfull (us/turn)\tincremental (us/turn)" << std::endl;
+    for (int window_start = 0; window_start < n_turns; window_start += report_every) {
+        const int window_end      = std::min(n_turns, window_start + report_every);
+        double    full_sum        = 0.0;
+        double    incremental_sum = 0.0;
+        for (int turn = window_start; turn < window_end; ++turn) {
+            full_sum += full_times_us[turn];
+            incremental_sum += incremental_times_us[turn];
+        }
+        std::cout << window_start + 1 << "-" << window_end << "\t" << full_sum / (window_end - window_start) << "\t" << incremental_sum / (window_end - window_start) << std::endl;
+    }
+    std::cout << "formatted chat length: " << chat.formatted().size() << " characters" << std::endl;
+
+    // the per-turn cost only stays flat while no message falls back to formatting the whole chat
+    std::cout << "messages formatted with the whole chat: " << chat.fullFormats() << std::endl;
+    if (chat.fullFormats() > 0) {
+        std::cout << "chat template '" << chat_template << "' is not formatted incrementally with these roles!" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,201 @@
+#include "llm_batch_runner.hpp"
+#include <iostream>
+#include <filesystem>
+#include <chrono>
+#include <algorithm>
+
+BatchRunner::BatchRunner(SessionEngine& engine, int32_t max_tokens, size_t window, uint8_t debug_level) : m_engine(engine) {
+    m_max_tokens  = max_tokens;
+    m_window      = window > 0 ? window : 4 * (size_t)engine.maxSessions();
+    m_debug_level = debug_level;
+}
+
+bool BatchRunner::run(const std::string& input_path, const std::string& output_path) {
+    // skip the lines answered by an earlier run
+    uint64_t done_lines = 0;
+    if (!resumePoint(output_path, done_lines)) {
+        return false;
+    }
+    std::ifstream input(input_path);
+    if (!input) {
+        std::cout << "could not open " << input_path << std::endl;
+        return false;
+    }
+    std::string text;
+    for (uint64_t i = 0; i < done_lines && std::getline(input, text); ++i) {
+    }
+    if (done_lines > 0) {
+        std::cout << "resuming after " << done_lines << " completed lines" << std::endl;
+    }
+
+    std::ofstream output(output_path, std::ios::binary | std::ios::app);
+    if (!output) {
+        std::cout << "could not open " << output_path << std::endl;
+        return false;
+    }
+
+    std::deque<Pending> window;  // oldest unwritten line first
+    uint64_t            next_line  = done_lines;
+    uint64_t            written    = 0;
+    bool                input_done = false;
+    auto                run_start  = std::chrono::steady_clock::now();
+
+    while (true) {
+        // read ahead while the window has room
+        while (!input_done && window.size() < m_window) {
+            if (!std::getline(input, text)) {
+                input_done = true;
+                break;
+            }
+            Pending& pending = window.emplace_back();
+            pending.line     = next_line++;
+            parseLine(text, pending);
+        }
+
+        // hand waiting prompts to free sessions, oldest first
+        for (auto& pending : window) {
+            if (pending.done || pending.session_id >= 0) {
+                continue;
+            }
+            const int session_id = m_engine.openSession();
+            if (session_id < 0) {
+                break;
+            }
+            if (!m_engine.submit(session_id, pending.prompt, pending.max_tokens)) {
+                m_engine.closeSession(session_id);
+                JsonValue result = resultFor(pending);
+                result["error"]  = "could not format or tokenize the prompt";
+                complete(pending, result);
+                continue;
+            }
+            pending.session_id = session_id;
+            pending.prompt     = std::string();
+        }
+
+        // one batch of decode tokens and prefill chunks across every running prompt
+        const bool worked = m_engine.step();
+
+        // collect finished prompts, each one frees its sequence for the next waiting prompt
+        for (auto& pending : window) {
+            if (pending.session_id < 0 || m_engine.isBusy(pending.session_id)) {
+                continue;
+            }
+            const FinishReason reason = m_engine.finishReason(pending.session_id);
+            JsonValue          result = resultFor(pending);
+            result["response"]          = m_engine.takeResponse(pending.session_id);
+            result["finish_reason"]     = reason == FinishReason::LENGTH ? "length" : reason == FinishReason::CONTEXT_FULL ? "context_full" : reason == FinishReason::DECODE_ERROR ? "error" : "stop";
+            result["completion_tokens"] = (uint64_t)m_engine.generatedTokens(pending.session_id);
+            m_engine.closeSession(pending.session_id);
+            pending.session_id = -1;
+            complete(pending, result);
+        }
+
+        // write results in input order, flushing so a crash loses at most the lines still in the window
+        const uint64_t written_before = written;
+        while (!window.empty() && window.front().done) {
+            output << window.front().output << '\n';
+            window.pop_front();
+            ++written;
+        }
+        if (written > written_before) {
+            output.flush();
+            if (!output) {
+                std::cout << "could not write " << output_path << std::endl;
+                return false;
+            }
+            if (m_debug_level > 0) {
+                std::cout << "written " << done_lines + written << " lines" << std::endl;
+            }
+        }
+
+        if (window.empty() && input_done) {
+            break;
+        }
+        if (!worked && m_engine.busySessions() == 0 && !window.empty() && !window.front().done && window.front().session_id < 0) {
+            std::cout << "no free session to run prompts with" << std::endl;
+            return false;
+        }
+    }
+
+    const double run_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+    std::cout << "answered " << written << " lines in " << run_s << " s (" << (run_s > 0.0 ? written / run_s : 0.0) << " lines/s), results in " << output_path << std::endl;
+    return true;
+}
+
+bool BatchRunner::resumePoint(const std::string& output_path, uint64_t& count) const {
+    count = 0;
+    if (!std::filesystem::exists(output_path)) {
+        return true;
+    }
+
+    // count complete lines, a last line without a newline was being written when the previous run stopped
+    std::ifstream file(output_path, std::ios::binary);
+    std::string   line;
+    std::string   last_line;
+    uint64_t      complete_bytes = 0;
+    while (std::getline(file, line)) {
+        if (file.eof()) {
+            break;
+        }
+        complete_bytes += line.size() + 1;
+        ++count;
+        last_line = std::move(line);
+    }
+    file.close();
+
+    std::error_code error;
+    if (std::filesystem::file_size(output_path, error) > complete_bytes) {
+        std::filesystem::resize_file(output_path, complete_bytes, error);
+        if (error) {
+            std::cout << "could not remove the partly written last line of " << output_path << std::endl;
+            return false;
+        }
+    }
+
+    // the output holds one line per input line in order, so the last line must be for input line count - 1
+    JsonValue last;
+    if (count > 0 && (!JsonValue::parse(last_line, last) || !last.find("line") || last.find("line")->asNumber(-1.0) != (double)(count - 1))) {
+        std::cout << output_path << " was not written by a batch run over this input, remove it to start again" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void BatchRunner::parseLine(const std::string& text, Pending& pending) const {
+    JsonValue request;
+    if (!JsonValue::parse(text, request) || request.type() != JsonValue::Type::OBJECT) {
+        JsonValue result = resultFor(pending);
+        result["error"]  = "line is not a JSON object";
+        complete(pending, result);
+        return;
+    }
+    if (const JsonValue* id = request.find("id")) {
+        pending.id = *id;
+    }
+
+    const JsonValue* prompt = request.find("prompt");
+    if (!prompt || prompt->type() != JsonValue::Type::STRING || prompt->asString().empty()) {
+        JsonValue result = resultFor(pending);
+        result["error"]  = "'prompt' must be a non-empty string";
+        complete(pending, result);
+        return;
+    }
+    pending.prompt = prompt->asString();
+
+    const JsonValue* max_tokens = request.find("max_tokens");
+    pending.max_tokens          = max_tokens && max_tokens->type() == JsonValue::Type::NUMBER ? (int32_t)std::max(1.0, max_tokens->asNumber()) : m_max_tokens;
+}
+
+JsonValue BatchRunner::resultFor(const Pending& pending) {
+    JsonValue result;
+    result["line"] = pending.line;
+    if (pending.id.type() != JsonValue::Type::NUL) {
+        result["id"] = pending.id;
+    }
+    return result;
+}
+
+void BatchRunner::complete(Pending& pending, const JsonValue& result) {
+    pending.output = result.dump();
+    pending.done   = true;
+}
@@ -0,0 +1,414 @@
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <numeric>
+#include <span>
+#include "llm_wrapper.hpp"
+#include "llm_json.hpp"
+#include "commandline_args.hpp"
+
+/**
+ * @brief write benchmark results to a JSON file
+ *
+ * @param json_path file to write, nothing is written if it is empty
+ * @param results results of the benchmark
+ *
+ * @return exit code of the benchmark, 1 if the file could not be written
+ */
+static int writeResults(const std::string& json_path, const JsonValue& results) {
+    if (json_path == "") {
+        return 0;
+    }
+    std::ofstream json(json_path);
+    json << results.dump() << "\n";
+    if (!json) {
+        std::cout << "could not write " << json_path << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief runs fixed-seed scripted conversations through the LLM wrapper and reports prompt and generation performance
+ */
+int main(int argc, char* argv[]) {
+
+    // get arguments
+    std::unique_ptr<CommandLineArgs> arg_parser = std::make_unique<CommandLineArgs>("LLM benchmark", "Runs scripted conversations against a model and reports prompt eval and decode throughput, time to first token and per-token latency");
+    arg_parser->addArgument<std::string>("model_path", "path to the .gguf file for the model to use", "mp");
+    arg_parser->addArgument<int32_t>("repetitions", "number of times to run the scripted conversation", "n", 3);
+    arg_parser->addArgument<int32_t>("warmup", "conversations to run before measuring", "w", 1);
+    arg_parser->addArgument<int32_t>("max_tokens", "maximum tokens generated per reply", "mt", 64);
+    arg_parser->addArgument<uint32_t>("seed", "sampling seed", "s", 42);
+    arg_parser->addArgument<int32_t>("threads", "threads used for generation, 0 for one per physical core", "t", 0);
+    arg_parser->addArgument<int32_t>("threads_batch", "threads used for prompt processing, 0 for the same as threads", "tb", 0);
+    arg_parser->addArgument<int32_t>("gpu_layers", "number of layers to offload to the GPU, 0 for CPU only", "ngl", 0);
+    arg_parser->addArgument<int32_t>("context_size", "context size in tokens, 0 for 4096", "c", 0);
+    arg_parser->addArgument<std::string>("cache_type_k", "KV cache key type: f16, bf16, f32, q8_0, q5_1, q5_0, q4_1 or q4_0", "ctk", "f16");
+    arg_parser->addArgument<std::string>("cache_type_v", "KV cache value type: f16, bf16, f32, q8_0, q5_1, q5_0, q4_1 or q4_0", "ctv", "f16");
+    arg_parser->addArgument<std::string>("flash_attn", "flash attention: auto, on or off", "fa", "auto");
+    arg_parser->addArgument<int32_t>("context_fill", "approximate tokens of filler system prompt, so replies are decoded over a long context", "cf", 0);
+    arg_parser->addFlag("kv_sweep", "compare estimated KV cache memory and speed for f16, f16 with flash attention, q8_0 and q4_0 caches instead of a single run", "kv");
+    arg_parser->addArgument<std::string>("json_path", "file to write the results to as JSON", "j", "");
+    arg_parser->addArgument<int32_t>("embed_texts", "if above 0, benchmark batched against one-at-a-time embeddings of this many texts instead of chat", "e", 0);
+    arg_parser->addArgument<int32_t>("prompt_lookup", "if above 0, benchmark rewrite and quote prompts with and without prompt lookup of runs up to this many tokens instead of chat", "pl", 0);
+    arg_parser->addFlag("json_schema", "compare replies constrained to a JSON schema with free replies to the same prompts instead of chat, raise max_tokens so replies are not cut off", "js");
+    arg_parser->addArgument<int32_t>("candidates", "if above 1, benchmark generating this many replies to one prompt in a shared batch against one after the other instead of chat", "nc", 0);
+    arg_parser->parse(argc, argv);
+
+    const std::string model_path  = arg_parser->getArgument<std::string>("model_path");
+    const int         repetitions = std::max(1, arg_parser->getArgument<int32_t>("repetitions"));
+    const int         warmup      = std::max(0, arg_parser->getArgument<int32_t>("warmup"));
+    const int         max_tokens  = arg_parser->getArgument<int32_t>("max_tokens");
+    const uint32_t    seed        = arg_parser->getArgument<uint32_t>("seed");
+    const std::string json_path   = arg_parser->getArgument<std::string>("json_path");
+
+    EngineConfig engine_config;
+    engine_config.n_threads       = arg_parser->getArgument<int32_t>("threads");
+    engine_config.n_threads_batch = arg_parser->getArgument<int32_t>("threads_batch");
+    engine_config.n_gpu_layers    = arg_parser->getArgument<int32_t>("gpu_layers");
+    engine_config.n_ctx           = std::max(0, arg_parser->getArgument<int32_t>("context_size"));
+    if (!EngineConfig::parseCacheType(arg_parser->getArgument<std::string>("cache_type_k"), engine_config.type_k) || !EngineConfig::parseCacheType(arg_parser->getArgument<std::string>("cache_type_v"), engine_config.type_v) || !EngineConfig::parseFlashAttn(arg_parser->getArgument<std::string>("flash_attn"), engine_config.flash_attn)) {
+        std::cout << "unknown KV cache type or flash attention setting" << std::endl;
+        return 1;
+    }
+
+    // fixed conversation, the later turns exercise prefill on a growing context
+    const std::vector<std::string> script = {
+        "Explain in a few sentences how a hash map handles collisions.",
+        "Now compare that with open addressing.",
+        "Write a short C++ function that inserts a key into a linear probing table.",
+        "Summarise our conversation in one paragraph.",
+    };
+
+    // filler system prompt of roughly four characters per token, held in the KV cache for every reply
+    std::string  system_prompt;
+    const size_t fill_chars = 4 * (size_t)std::max(0, arg_parser->getArgument<int32_t>("context_fill"));
+    for (int i = 0; system_prompt.size() < fill_chars; ++i) {
+        system_prompt += "Entry " + std::to_string(i) + " of the maintenance log records a routine inspection with nothing to report. ";
+    }
+
+    // every mode writes its results with the model they were measured on
+    JsonValue results;
+    results["model"] = model_path;
+
+    // the same conversations for each KV cache setting, the context size and fill are kept
+    if (arg_parser->getArgument<bool>("kv_sweep")) {
+        const std::vector<std::pair<std::string, std::string>> settings = {
+            { "f16", "off" },
+            { "f16", "on" },
+            { "q8_0", "on" },
+            { "q4_0", "on" },
+        };
+        results["context_fill"] = (uint64_t)(fill_chars / 4);
+        results["settings"]     = JsonValue::array();
+        for (size_t i = 0; i < settings.size(); ++i) {
+            EngineConfig config = engine_config;
+            EngineConfig::parseCacheType(settings[i].first, config.type_k);
+            EngineConfig::parseCacheType(settings[i].first, config.type_v);
+            EngineConfig::parseFlashAttn(settings[i].second, config.flash_attn);
+
+            std::unique_ptr<LLM> llm = std::make_unique<LLM>(model_path, 0.1, false, 0, "", config);
+            llm->setMaxTokens(max_tokens);
+            if (system_prompt != "") {
+                llm->setSystemPrompt(system_prompt);
+            }
+            for (int run = 0; run < warmup + repetitions; ++run) {
+                llm->clearChat();
+                llm->setSeed(seed);
+                if (run == warmup) {
+                    llm->resetPerformance();
+                }
+                for (const auto& prompt : script) {
+                    llm->getChatResponse(prompt);
+                }
+            }
+
+            const llama_perf_context_data performance = llm->getPerformance();
+            const double                  prompt_tps  = performance.t_p_eval_ms > 0.0 ? 1e3 * performance.n_p_eval / performance.t_p_eval_ms : 0.0;
+            const double                  decode_tps  = performance.t_eval_ms > 0.0 ? 1e3 * performance.n_eval / performance.t_eval_ms : 0.0;
+            const double                  kv_mib      = llm->getEstimatedKvCacheBytes() / (1024.0 * 1024.0);
+            std::cout << settings[i].first << " cache, flash attention " << settings[i].second << ": KV estimate " << kv_mib << " MiB for " << llm->getEngineConfig().n_ctx << " tokens, prompt eval " << prompt_tps << " tokens/s, decode " << decode_tps << " tokens/s" << std::endl;
+            JsonValue setting;
+            setting["cache_type"]            = settings[i].first;
+            setting["flash_attn"]            = settings[i].second;
+            setting["n_ctx"]                 = (uint64_t)llm->getEngineConfig().n_ctx;
+            setting["kv_cache_estimate_mib"] = kv_mib;
+            setting["prompt_tokens_per_s"]   = prompt_tps;
+            setting["decode_tokens_per_s"]   = decode_tps;
+            results["settings"].push(std::move(setting));
+        }
+        return writeResults(json_path, results);
+    }
+
+    std::unique_ptr<LLM> llm = std::make_unique<LLM>(model_path, 0.1, false, 0, "", engine_config);
+    llm->setMaxTokens(max_tokens);
+    if (system_prompt != "") {
+        llm->setSystemPrompt(system_prompt);
+    }
+
+    // embeddings throughput, packing texts into shared batches against embedding them one at a time
+    const int n_texts = arg_parser->getArgument<int32_t>("embed_texts");
+    if (n_texts > 0) {
+        std::vector<std::string> texts;
+        for (int i = 0; i < n_texts; ++i) {
+            texts.push_back("document " + std::to_string(i) + ": " + script[i % script.size()]);
+        }
+        llm->embed(std::span<const std::string>(texts.data(), 1));  // warm up, creates the embeddings context
+
+        auto            batched_start = std::chrono::steady_clock::now();
+        EmbeddingMatrix embeddings    = llm->embed(texts);
+        const double    batched_s     = std::chrono::duration<double>(std::chrono::steady_clock::now() - batched_start).count();
+
+        auto single_start = std::chrono::steady_clock::now();
+        for (const auto& text : texts) {
+            llm->embed(std::span<const std::string>(&text, 1));
+        }
+        const double single_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - single_start).count();
+
+        std::cout << "embeddings: " << embeddings.rows << " x " << embeddings.dim << std::endl;
+        std::cout << "batched: " << n_texts / batched_s << " texts/s, one at a time: " << n_texts / single_s << " texts/s" << std::endl;
+        results["texts"]               = n_texts;
+        results["dim"]                 = (uint64_t)embeddings.dim;
+        results["batched_texts_per_s"] = n_texts / batched_s;
+        results["single_texts_per_s"]  = n_texts / single_s;
+        return writeResults(json_path, results);
+    }
+
+    // rewriting and quoting repeat long spans of the prompt, which prompt lookup proposes as draft tokens
+    const int lookup_ngram = arg_parser->getArgument<int32_t>("prompt_lookup");
+    if (lookup_ngram > 0) {
+        const std::string passage =
+            "The lighthouse keeper climbed the spiral stairs every evening at dusk. He trimmed the wick, polished the great lens and "
+            "wound the clockwork that turned the beam across the water. Ships passing the headland relied on the light to find the "
+            "channel between the rocks, and in fifty years of service it had never once failed.\n\n"
+            "When the lamp was finally electrified, the keeper stayed on to maintain the new equipment. He kept a logbook of every "
+            "storm, every ship that signalled its thanks and every repair he made, and the logbook is now kept in the harbour museum.";
+        const std::vector<std::string> lookup_script = {
+            "Rewrite the following text in British spelling, changing nothing else:\n\n" + passage,
+            "Quote the second paragraph of the text exactly.",
+            "Summarise the text in three sentences, quoting its first sentence word for word.",
+        };
+
+        // decode speed after the first token, so the prompt evaluation shared by both settings does not dilute the comparison
+        uint64_t n_sampled  = 0;
+        uint64_t n_drafted  = 0;
+        uint64_t n_accepted = 0;
+        double   decode_s   = 0.0;
+        bool     measured   = false;
+        llm->setMetricsObserver([&](const TurnMetrics& metrics) {
+            if (measured) {
+                n_sampled  += metrics.sampled_tokens;
+                n_drafted  += metrics.drafted_tokens;
+                n_accepted += metrics.accepted_tokens;
+                decode_s   += std::chrono::duration<double>(metrics.total_time - metrics.prefill_time).count();
+            }
+        });
+
+        results["settings"] = JsonValue::array();
+        for (const int ngram : { 0, lookup_ngram }) {
+            llm->setPromptLookup(ngram);
+            n_sampled  = 0;
+            n_drafted  = 0;
+            n_accepted = 0;
+            decode_s   = 0.0;
+            for (int run = 0; run < warmup + repetitions; ++run) {
+                measured = run >= warmup;
+                llm->clearChat();
+                llm->setSeed(seed);
+                for (const auto& prompt : lookup_script) {
+                    llm->getChatResponse(prompt);
+                }
+            }
+
+            const double decode_tps = decode_s > 0.0 ? n_sampled / decode_s : 0.0;
+            const double acceptance = n_drafted > 0 ? 100.0 * n_accepted / n_drafted : 0.0;
+            std::cout << (ngram > 0 ? "prompt lookup of " + std::to_string(ngram) + " tokens" : std::string("no prompt lookup")) << ": decode " << decode_tps << " tokens/s, " << n_accepted << "/" << n_drafted << " draft tokens accepted (" << acceptance << "%)" << std::endl;
+            JsonValue setting;
+            setting["prompt_lookup"]       = ngram;
+            setting["decode_tokens_per_s"] = decode_tps;
+            setting["drafted_tokens"]      = n_drafted;
+            setting["accepted_tokens"]     = n_accepted;
+            results["settings"].push(std::move(setting));
+        }
+        return writeResults(json_path, results);
+    }
+
+    // structured extraction prompts, answered freely and constrained to a schema; only constrained replies are sure to parse
+    if (arg_parser->getArgument<bool>("json_schema")) {
+        const std::string schema = R"({"type": "object", "properties": {"title": {"type": "string"}, "year": {"type": "integer"}, "genres": {"type": "array", "items": {"type": "string"}, "maxItems": 4}, "rating": {"type": "number"}}, "required": ["title", "year", "genres"]})";
+        const std::vector<std::string> schema_script = {
+            "Describe the film Casablanca as a JSON object with its title, year, genres and rating out of ten. Reply with the JSON only.",
+            "Describe the film Spirited Away as a JSON object with its title, year, genres and rating out of ten. Reply with the JSON only.",
+            "Describe the film Alien as a JSON object with its title, year, genres and rating out of ten. Reply with the JSON only.",
+        };
+
+        uint64_t n_sampled = 0;
+        double   decode_s  = 0.0;
+        bool     measured  = false;
+        llm->setMetricsObserver([&](const TurnMetrics& metrics) {
+            if (measured) {
+                n_sampled += metrics.sampled_tokens;
+                decode_s  += std::chrono::duration<double>(metrics.total_time - metrics.prefill_time).count();
+            }
+        });
+
+        results["settings"] = JsonValue::array();
+        for (const bool constrained : { false, true }) {
+            ChatOptions options;
+            options.json_schema = constrained ? schema : "";
+            n_sampled           = 0;
+            decode_s            = 0.0;
+            int n_replies       = 0;
+            int n_parsed        = 0;
+            for (int run = 0; run < warmup + repetitions; ++run) {
+                measured = run >= warmup;
+                llm->setSeed(seed);
+                for (const auto& prompt : schema_script) {
+                    llm->clearChat();
+                    const ChatResult result = llm->getChatResponse(prompt, options);
+                    JsonValue        value;
+                    if (measured) {
+                        ++n_replies;
+                        n_parsed += JsonValue::parse(result.text, value) && value.type() == JsonValue::Type::OBJECT;
+                    }
+                }
+            }
+
+            const double decode_tps = decode_s > 0.0 ? n_sampled / decode_s : 0.0;
+            std::cout << (constrained ? "JSON schema" : "free replies") << ": decode " << decode_tps << " tokens/s, " << n_parsed << "/" << n_replies << " replies are JSON objects" << std::endl;
+            JsonValue setting;
+            setting["json_schema"]         = constrained;
+            setting["decode_tokens_per_s"] = decode_tps;
+            setting["replies"]             = n_replies;
+            setting["parsed_replies"]      = n_parsed;
+            results["settings"].push(std::move(setting));
+        }
+        return writeResults(json_path, results);
+    }
+
+    // candidate replies, forked from one prompt evaluation and decoded together against a fresh chat per reply
+    const int n_candidates = arg_parser->getArgument<int32_t>("candidates");
+    if (n_candidates > 1) {
+        llm->setTemperature(0.8f);
+        double batched_s    = 0.0;
+        double sequential_s = 0.0;
+        size_t n_batched    = 0;
+        for (int run = 0; run < warmup + repetitions; ++run) {
+            llm->clearChat();
+            llm->setSeed(seed + run);
+            auto                          batched_start = std::chrono::steady_clock::now();
+            const std::vector<ChatResult> replies       = llm->getChatResponses(script[0], n_candidates);
+            const double                  batched_run_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - batched_start).count();
+
+            auto sequential_start = std::chrono::steady_clock::now();
+            for (int i = 0; i < n_candidates; ++i) {
+                llm->clearChat();
+                llm->getChatResponse(script[0]);
+            }
+            if (run >= warmup) {
+                batched_s    += batched_run_s;
+                sequential_s += std::chrono::duration<double>(std::chrono::steady_clock::now() - sequential_start).count();
+                n_batched     = replies.size();
+            }
+        }
+
+        std::cout << n_batched << " candidates per prompt (fork sequences limit the batch)" << std::endl;
+        std::cout << "batched: " << batched_s / repetitions << " s per prompt, one after the other: " << sequential_s / repetitions << " s per prompt" << std::endl;
+        results["candidates"]              = (uint64_t)n_batched;
+        results["batched_s_per_prompt"]    = batched_s / repetitions;
+        results["sequential_s_per_prompt"] = sequential_s / repetitions;
+        return writeResults(json_path, results);
+    }
+
+    // per-turn time to first streamed piece and the time taken by each following token
+    std::vector<double> ttft_ms;
+    std::vector<double> token_latency_ms;
+    double              wall_s   = 0.0;
+    bool                measured = false;
+    llm->setMetricsObserver([&](const TurnMetrics& metrics) {
+        if (!measured) {
+            return;
+        }
+        for (auto token_time : metrics.token_times) {
+            token_latency_ms.push_back(std::chrono::duration<double, std::milli>(token_time).count());
+        }
+    });
+
+    for (int run = 0; run < warmup + repetitions; ++run) {
+        measured = run >= warmup;
+
+        // every run starts from the same state so runs are identical
+        llm->clearChat();
+        llm->setSeed(seed);
+        if (run == warmup) {
+            llm->resetPerformance();
+        }
+
+        auto run_start = std::chrono::steady_clock::now();
+        for (const auto& prompt : script) {
+            auto turn_start = std::chrono::steady_clock::now();
+            bool first      = true;
+            llm->getChatResponse(prompt, [&](const std::string& /* piece */) {
+                if (measured && first) {
+                    ttft_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - turn_start).count());
+                }
+                first = false;
+            });
+        }
+        if (measured) {
+            wall_s += std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+        }
+    }
+
+    // prompt eval and decode time as measured by llama for the measured runs
+    const llama_perf_context_data performance = llm->getPerformance();
+    const double                  prompt_tps  = performance.t_p_eval_ms > 0.0 ? 1e3 * performance.n_p_eval / performance.t_p_eval_ms : 0.0;
+    const double                  decode_tps  = performance.t_eval_ms > 0.0 ? 1e3 * performance.n_eval / performance.t_eval_ms : 0.0;
+
+    auto percentile = [](std::vector<double> values, double fraction) {
+        if (values.empty()) {
+            return 0.0;
+        }
+        const size_t index = std::min(values.size() - 1, (size_t)(fraction * values.size()));
+        std::nth_element(values.begin(), values.begin() + index, values.end());
+        return values[index];
+    };
+    const double ttft_mean = ttft_ms.empty() ? 0.0 : std::accumulate(ttft_ms.begin(), ttft_ms.end(), 0.0) / ttft_ms.size();
+
+    std::cout << "prompt eval: " << performance.n_p_eval << " tokens, " << prompt_tps << " tokens/s" << std::endl;
+    std::cout << "decode: " << performance.n_eval << " tokens, " << decode_tps << " tokens/s" << std::endl;
+    std::cout << "time to first token: mean " << ttft_mean << " ms, p50 " << percentile(ttft_ms, 0.50) << " ms, p95 " << percentile(ttft_ms, 0.95) << " ms" << std::endl;
+    std::cout << "token latency: p50 " << percentile(token_latency_ms, 0.50) << " ms, p95 " << percentile(token_latency_ms, 0.95) << " ms, p99 " << percentile(token_latency_ms, 0.99) << " ms" << std::endl;
+    std::cout << "wall time: " << wall_s << " s for " << repetitions << " conversations" << std::endl;
+    std::cout << "KV cache estimate: " << llm->getEstimatedKvCacheBytes() / (1024.0 * 1024.0) << " MiB for " << llm->getEngineConfig().n_ctx << " tokens" << std::endl;
+
+    JsonValue ttft;
+    ttft["mean"] = ttft_mean;
+    ttft["p50"]  = percentile(ttft_ms, 0.50);
+    ttft["p95"]  = percentile(ttft_ms, 0.95);
+    JsonValue token_latency;
+    token_latency["p50"] = percentile(token_latency_ms, 0.50);
+    token_latency["p95"] = percentile(token_latency_ms, 0.95);
+    token_latency["p99"] = percentile(token_latency_ms, 0.99);
+
+    results["seed"]                  = (uint64_t)seed;
+    results["repetitions"]           = repetitions;
+    results["turns"]                 = (uint64_t)script.size();
+    results["max_tokens"]            = max_tokens;
+    results["gpu_layers"]            = engine_config.n_gpu_layers;
+    results["n_ctx"]                 = (uint64_t)llm->getEngineConfig().n_ctx;
+    results["kv_cache_estimate_mib"] = llm->getEstimatedKvCacheBytes() / (1024.0 * 1024.0);
+    results["prompt_tokens"]         = performance.n_p_eval;
+    results["prompt_tokens_per_s"]   = prompt_tps;
+    results["decode_tokens"]         = performance.n_eval;
+    results["decode_tokens_per_s"]   = decode_tps;
+    results["ttft_ms"]               = std::move(ttft);
+    results["token_latency_ms"]      = std::move(token_latency);
+    results["wall_s"]                = wall_s;
+    return writeResults(json_path, results);
+}
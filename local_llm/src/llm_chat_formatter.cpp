@@ -0,0 +1,114 @@
+#include "llm_chat_formatter.hpp"
+#include <algorithm>
+#include <cstring>
+
+const char* StringArena::store(std::string_view text) {
+    const size_t size = text.size() + 1;
+
+    // start a new block when the current one is full
+    if (m_blocks.empty() || m_block_used + size > m_block_capacity) {
+        m_block_capacity = std::max(BLOCK_SIZE, size);
+        m_blocks.emplace_back(new char[m_block_capacity]);
+        m_block_used = 0;
+    }
+
+    char* destination = m_blocks.back().get() + m_block_used;
+    std::memcpy(destination, text.data(), text.size());
+    destination[text.size()] = '\0';
+
+    m_block_used += size;
+    m_bytes_used += size;
+    return destination;
+}
+
+void StringArena::clear() {
+    m_blocks.clear();
+    m_block_used     = 0;
+    m_block_capacity = 0;
+    m_bytes_used     = 0;
+}
+
+ChatFormatter::ChatFormatter(const char* chat_template) {
+    m_template = chat_template;
+}
+
+void ChatFormatter::setTemplate(const char* chat_template) {
+    m_template = chat_template;
+    clear();
+}
+
+int64_t ChatFormatter::append(const char* role, std::string_view content, bool add_assistant) {
+    const llama_chat_message message = { role, m_arena.store(content) };
+    m_messages.push_back(message);
+
+    const size_t n_messages = m_messages.size();
+
+    // format the previous message alone and followed by the new one, the difference is the text the new message adds
+    if (n_messages > 1) {
+        const llama_chat_message* window = &m_messages[n_messages - 2];
+        if (format(window, 1, m_add_assistant, m_base_buffer) && format(window, 2, add_assistant, m_full_buffer) && m_full_buffer.compare(0, m_base_buffer.size(), m_base_buffer) == 0) {
+            const int64_t changed = m_formatted.size();
+            m_formatted.append(m_full_buffer, m_base_buffer.size());
+            m_add_assistant = add_assistant;
+            return changed;
+        }
+        ++m_full_formats;
+    }
+
+    // first message, or the template is not append-only for this message, format the whole chat
+    if (!format(m_messages.data(), n_messages, add_assistant, m_full_buffer)) {
+        m_messages.pop_back();
+        return -1;
+    }
+    const int64_t changed = std::mismatch(m_formatted.begin(), m_formatted.end(), m_full_buffer.begin(), m_full_buffer.end()).first - m_formatted.begin();
+    m_formatted.swap(m_full_buffer);
+    m_add_assistant = add_assistant;
+    return changed;
+}
+
+bool ChatFormatter::erase(size_t first, size_t count) {
+    if (first >= m_messages.size()) {
+        return true;
+    }
+    count = std::min(count, m_messages.size() - first);
+    if (first + count == m_messages.size()) {
+        m_add_assistant = false;  // the reply prompt belonged to the messages removed from the end
+    }
+    m_messages.erase(m_messages.begin() + first, m_messages.begin() + first + count);
+
+    // move the remaining contents to a fresh arena so long running chats do not accumulate dead messages
+    StringArena compacted;
+    for (auto& message : m_messages) {
+        message.content = compacted.store(message.content);
+    }
+    std::swap(m_arena, compacted);
+
+    if (m_messages.empty()) {
+        m_formatted.clear();
+        return true;
+    }
+    return format(m_messages.data(), m_messages.size(), m_add_assistant, m_formatted);
+}
+
+void ChatFormatter::clear() {
+    m_messages.clear();
+    m_arena.clear();
+    m_formatted.clear();
+    m_add_assistant = false;
+}
+
+bool ChatFormatter::format(const llama_chat_message* messages, size_t n_messages, bool add_assistant, std::string& output) {
+    // the buffer keeps its capacity between calls so formatting normally does not allocate
+    output.resize(std::max(output.capacity(), (size_t)256));
+    int length = llama_chat_apply_template(m_template, messages, n_messages, add_assistant, output.data(), output.size());
+    if (length > (int)output.size()) {
+        output.resize(length);
+        length = llama_chat_apply_template(m_template, messages, n_messages, add_assistant, output.data(), output.size());
+    }
+    if (length < 0) {
+        output.clear();
+        return false;
+    }
+    output.resize(length);
+    return true;
+}
@@ -0,0 +1,394 @@
+#include "llm_engine_config.hpp"
+#include "llm_model_registry.hpp"
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string_view>
+#include <filesystem>
+#include <chrono>
+#include <thread>
+#include <set>
+#include <vector>
+#include <cstdlib>
+
+EngineConfig EngineConfig::resolved(uint32_t n_ctx) const {
+    EngineConfig config = *this;
+    if (config.n_ctx == 0) {
+        config.n_ctx = n_ctx;
+    }
+    if (config.n_threads <= 0) {
+        config.n_threads = std::min(physicalCores(), availableCpus());
+    }
+    if (config.n_threads_batch <= 0) {
+        config.n_threads_batch = config.n_threads;
+    }
+    if (config.n_batch == 0) {
+        config.n_batch = config.n_ctx;
+    }
+    config.n_ubatch = config.n_ubatch == 0 ? config.n_batch : std::min(config.n_ubatch, config.n_batch);
+
+    // llama refuses a quantized value cache without flash attention, so auto must not resolve to off
+    if (ggml_is_quantized(config.type_v) && config.flash_attn == LLAMA_FLASH_ATTN_TYPE_AUTO) {
+        config.flash_attn = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+    }
+    return config;
+}
+
+void EngineConfig::apply(llama_context_params& context_parameters) const {
+    const EngineConfig config          = resolved(context_parameters.n_ctx);
+    context_parameters.n_ctx           = config.n_ctx;
+    context_parameters.n_threads       = config.n_threads;
+    context_parameters.n_threads_batch = config.n_threads_batch;
+    context_parameters.n_batch         = config.n_batch;
+    context_parameters.n_ubatch        = config.n_ubatch;
+    context_parameters.type_k          = config.type_k;
+    context_parameters.type_v          = config.type_v;
+    context_parameters.flash_attn_type = config.flash_attn;
+}
+
+uint64_t EngineConfig::estimateKvCacheBytes(const llama_model* model) const {
+    // head sizes come from the model metadata, models without them use the embedding split evenly over the heads
+    auto metadata_int = [&](const std::string& key, int64_t fallback) {
+        char value[64];
+        return llama_model_meta_val_str(model, key.c_str(), value, sizeof(value)) > 0 ? std::atoll(value) : fallback;
+    };
+    char architecture[64] = "";
+    llama_model_meta_val_str(model, "general.architecture", architecture, sizeof(architecture));
+    const int64_t n_head     = std::max(1, llama_model_n_head(model));
+    const int64_t n_head_kv  = std::max(1, llama_model_n_head_kv(model));
+    const int64_t head_k     = metadata_int(std::string(architecture) + ".attention.key_length", llama_model_n_embd(model) / n_head);
+    const int64_t head_v     = metadata_int(std::string(architecture) + ".attention.value_length", llama_model_n_embd(model) / n_head);
+    const size_t  cell_bytes = ggml_row_size(type_k, n_head_kv * head_k) + ggml_row_size(type_v, n_head_kv * head_v);
+    return (uint64_t)cell_bytes * llama_model_n_layer(model) * n_ctx;
+}
+
+int32_t EngineConfig::physicalCores() {
+    const int32_t n_logical = std::max(1u, std::thread::hardware_concurrency());
+
+    // hyperthreads of one core share a sibling list, so count the distinct lists
+    std::set<std::string> sibling_lists;
+    for (int32_t cpu = 0; cpu < n_logical; ++cpu) {
+        std::ifstream siblings("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings");
+        std::string   line;
+        if (siblings && std::getline(siblings, line)) {
+            sibling_lists.insert(line);
+        }
+    }
+    return sibling_lists.empty() ? n_logical : (int32_t)sibling_lists.size();
+}
+
+int32_t EngineConfig::availableCpus() const {
+    bool cpus[GGML_MAX_N_THREADS];
+    if (cpu_mask == "" || !parseCpuMask(cpus)) {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+    return std::count(std::begin(cpus), std::end(cpus), true);
+}
+
+bool EngineConfig::parseCpuMask(bool (&cpus)[GGML_MAX_N_THREADS]) const {
+    std::fill(std::begin(cpus), std::end(cpus), false);
+
+    // the last hex digit holds CPUs 0-3
+    std::string_view digits = cpu_mask;
+    if (digits.starts_with("0x") || digits.starts_with("0X")) {
+        digits.remove_prefix(2);
+    }
+    bool any_set = false;
+    for (size_t i = 0; i < digits.size(); ++i) {
+        const char digit = digits[digits.size() - 1 - i];
+        int        value = 0;
+        if (digit >= '0' && digit <= '9') {
+            value = digit - '0';
+        } else if (digit >= 'a' && digit <= 'f') {
+            value = digit - 'a' + 10;
+        } else if (digit >= 'A' && digit <= 'F') {
+            value = digit - 'A' + 10;
+        } else {
+            return false;
+        }
+        for (size_t bit = 0; bit < 4 && i * 4 + bit < GGML_MAX_N_THREADS; ++bit) {
+            cpus[i * 4 + bit] = (value >> bit) & 1;
+            any_set |= cpus[i * 4 + bit];
+        }
+    }
+    return any_set;
+}
+
+bool EngineConfig::parseNuma(const std::string& name, ggml_numa_strategy& numa) {
+    if (name == "" || name == "disabled") {
+        numa = GGML_NUMA_STRATEGY_DISABLED;
+    } else if (name == "distribute") {
+        numa = GGML_NUMA_STRATEGY_DISTRIBUTE;
+    } else if (name == "isolate") {
+        numa = GGML_NUMA_STRATEGY_ISOLATE;
+    } else if (name == "numactl") {
+        numa = GGML_NUMA_STRATEGY_NUMACTL;
+    } else if (name == "mirror") {
+        numa = GGML_NUMA_STRATEGY_MIRROR;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool EngineConfig::parseCacheType(const std::string& name, ggml_type& type) {
+    for (ggml_type candidate : { GGML_TYPE_F16, GGML_TYPE_BF16, GGML_TYPE_F32, GGML_TYPE_Q8_0, GGML_TYPE_Q5_1, GGML_TYPE_Q5_0, GGML_TYPE_Q4_1, GGML_TYPE_Q4_0 }) {
+        if (name == ggml_type_name(candidate)) {
+            type = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool EngineConfig::parseFlashAttn(const std::string& name, llama_flash_attn_type& flash_attn) {
+    if (name == "" || name == "auto") {
+        flash_attn = LLAMA_FLASH_ATTN_TYPE_AUTO;
+    } else if (name == "on") {
+        flash_attn = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+    } else if (name == "off") {
+        flash_attn = LLAMA_FLASH_ATTN_TYPE_DISABLED;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+CpuThreadpools::~CpuThreadpools() {
+    release();
+}
+
+bool CpuThreadpools::attach(llama_context* context, const EngineConfig& config) {
+    release();
+    if (config.cpu_mask == "" && !config.strict_cpu) {
+        return true;
+    }
+
+    // the threadpool functions live in the CPU backend, which is loaded at runtime
+    ggml_backend_dev_t cpu_device = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (!cpu_device) {
+        return false;
+    }
+    ggml_backend_reg_t cpu_backend    = ggml_backend_dev_backend_reg(cpu_device);
+    auto               new_threadpool = (ggml_threadpool_t(*)(ggml_threadpool_params*))ggml_backend_reg_get_proc_address(cpu_backend, "ggml_threadpool_new");
+    m_free_threadpool                 = (void (*)(ggml_threadpool_t))ggml_backend_reg_get_proc_address(cpu_backend, "ggml_threadpool_free");
+    if (!new_threadpool || !m_free_threadpool) {
+        return false;
+    }
+
+    ggml_threadpool_params parameters = ggml_threadpool_params_default(config.n_threads);
+    if (config.cpu_mask != "" && !config.parseCpuMask(parameters.cpumask)) {
+        return false;
+    } else if (config.cpu_mask == "") {
+        std::fill(std::begin(parameters.cpumask), std::end(parameters.cpumask), true);
+    }
+    parameters.strict_cpu = config.strict_cpu;
+    m_threadpool          = new_threadpool(&parameters);
+    if (!m_threadpool) {
+        return false;
+    }
+
+    // prompt processing only gets its own pool if it uses a different number of threads
+    if (config.n_threads_batch != config.n_threads) {
+        parameters.n_threads = config.n_threads_batch;
+        m_threadpool_batch   = new_threadpool(&parameters);
+        if (!m_threadpool_batch) {
+            release();
+            return false;
+        }
+    }
+
+    llama_attach_threadpool(context, m_threadpool, m_threadpool_batch ? m_threadpool_batch : m_threadpool);
+    return true;
+}
+
+void CpuThreadpools::release() {
+    if (m_threadpool_batch) {
+        m_free_threadpool(m_threadpool_batch);
+        m_threadpool_batch = nullptr;
+    }
+    if (m_threadpool) {
+        m_free_threadpool(m_threadpool);
+        m_threadpool = nullptr;
+    }
+}
+
+EngineTuner::EngineTuner(std::string cache_path, uint8_t debug_level) {
+    m_cache_path  = cache_path;
+    m_debug_level = debug_level;
+}
+
+EngineConfig EngineTuner::tune(const std::string& model_path, const EngineConfig& config) {
+    EngineConfig       tuned    = config;
+    const EngineConfig defaults = config.resolved(TUNE_PROMPT_TOKENS);
+    tuned.n_threads             = defaults.n_threads;
+    tuned.n_threads_batch       = defaults.n_threads_batch;
+
+    const std::string key = cacheKey(model_path, config);
+    if (loadCached(key, tuned)) {
+        if (m_debug_level > 0) {
+            std::cout << "using cached tuning: threads " << tuned.n_threads << ", batch threads " << tuned.n_threads_batch << ", ubatch " << tuned.n_ubatch << std::endl;
+        }
+        return tuned;
+    }
+
+    ModelRegistry::instance().initBackend(config.numa);
+    std::shared_ptr<llama_model> model = ModelRegistry::instance().acquire(model_path, config.n_gpu_layers);
+    if (!model) {
+        std::cout << "could not load model for tuning" << std::endl;
+        return tuned;
+    }
+    const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model.get()));
+
+    // thread counts from a quarter of the physical cores up to every usable logical CPU
+    const int32_t         n_available  = config.availableCpus();
+    const int32_t         n_physical   = std::min(EngineConfig::physicalCores(), n_available);
+    std::set<int32_t>     thread_set   = { std::max(1, n_physical / 4), std::max(1, n_physical / 2), n_physical, n_available };
+    std::vector<int32_t>  thread_counts(thread_set.begin(), thread_set.end());
+    std::vector<uint32_t> ubatch_sizes = { 128, 256, 512 };
+
+    // synthetic tokens spread over the vocabulary, the content does not affect speed
+    llama_batch batch = llama_batch_init(TUNE_PROMPT_TOKENS, 0, 1);
+    auto        run   = [&](llama_context* context, uint32_t n_tokens, llama_pos start_pos) {
+        batch.n_tokens = n_tokens;
+        for (uint32_t i = 0; i < n_tokens; ++i) {
+            batch.token[i]     = (llama_token)(((start_pos + i) * 7919u + 13u) % n_vocab);
+            batch.pos[i]       = start_pos + i;
+            batch.n_seq_id[i]  = 1;
+            batch.seq_id[i][0] = 0;
+            batch.logits[i]    = i + 1 == n_tokens;
+        }
+        auto start = std::chrono::steady_clock::now();
+        bool ok    = llama_decode(context, batch) == 0;
+        llama_synchronize(context);
+        return ok ? std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() : -1.0;
+    };
+    auto make_context = [&](uint32_t n_ubatch) {
+        auto parameters            = llama_context_default_params();
+        parameters.n_ctx           = TUNE_PROMPT_TOKENS + TUNE_GENERATE_TOKENS;
+        parameters.n_batch         = TUNE_PROMPT_TOKENS;
+        parameters.n_ubatch        = n_ubatch;
+        parameters.n_threads       = n_available;
+        parameters.n_threads_batch = n_available;
+        parameters.type_k          = defaults.type_k;
+        parameters.type_v          = defaults.type_v;
+        parameters.flash_attn_type = defaults.flash_attn;
+        parameters.no_perf         = true;
+        return llama_init_from_model(model.get(), parameters);
+    };
+
+    // prompt processing for every micro-batch size and thread count
+    std::cout << "tuning engine for " << model_path << " ..." << std::endl;
+    double best_prompt_speed = 0.0;
+    for (uint32_t n_ubatch : ubatch_sizes) {
+        llama_context* context = make_context(n_ubatch);
+        if (!context) {
+            continue;
+        }
+        run(context, TUNE_PROMPT_TOKENS, 0);  // warm up, the first decode allocates compute buffers
+        for (int32_t n_threads : thread_counts) {
+            llama_set_n_threads(context, n_threads, n_threads);
+            llama_memory_clear(llama_get_memory(context), true);
+            const double seconds = run(context, TUNE_PROMPT_TOKENS, 0);
+            if (seconds <= 0.0) {
+                continue;
+            }
+            const double speed = TUNE_PROMPT_TOKENS / seconds;
+            if (m_debug_level > 0) {
+                std::cout << "prompt: ubatch " << n_ubatch << ", threads " << n_threads << ": " << speed << " tokens/s" << std::endl;
+            }
+            if (speed > best_prompt_speed) {
+                best_prompt_speed     = speed;
+                tuned.n_ubatch        = n_ubatch;
+                tuned.n_threads_batch = n_threads;
+            }
+        }
+        llama_free(context);
+    }
+
+    // single token generation for every thread count, micro-batch size does not matter here
+    double         best_generate_speed = 0.0;
+    llama_context* context             = make_context(tuned.n_ubatch);
+    if (context) {
+        for (int32_t n_threads : thread_counts) {
+            llama_set_n_threads(context, n_threads, n_threads);
+            llama_memory_clear(llama_get_memory(context), true);
+            run(context, 1, 0);  // warm up
+            double seconds = 0.0;
+            for (uint32_t i = 1; i <= TUNE_GENERATE_TOKENS; ++i) {
+                seconds += run(context, 1, i);
+            }
+            const double speed = TUNE_GENERATE_TOKENS / seconds;
+            if (m_debug_level > 0) {
+                std::cout << "generate: threads " << n_threads << ": " << speed << " tokens/s" << std::endl;
+            }
+            if (speed > best_generate_speed) {
+                best_generate_speed = speed;
+                tuned.n_threads     = n_threads;
+            }
+        }
+        llama_free(context);
+    }
+    llama_batch_free(batch);
+
+    if (best_prompt_speed == 0.0 || best_generate_speed == 0.0) {
+        std::cout << "engine tuning failed, using defaults" << std::endl;
+        return tuned;
+    }
+    std::cout << "tuned: threads " << tuned.n_threads << ", batch threads " << tuned.n_threads_batch << ", ubatch " << tuned.n_ubatch << std::endl;
+    saveCached(key, tuned);
+    return tuned;
+}
+
+std::string EngineTuner::cacheKey(const std::string& model_path, const EngineConfig& config) const {
+    // a changed model file, offload, CPU set or attention setup invalidates the result
+    std::error_code   error;
+    const uintmax_t   file_size = std::filesystem::file_size(model_path, error);
+    const auto        modified  = std::filesystem::last_write_time(model_path, error).time_since_epoch().count();
+    std::stringstream key;
+    key << std::filesystem::absolute(model_path, error).string() << "|" << file_size << "|" << modified << "|" << config.n_gpu_layers << "|" << config.cpu_mask << "|" << config.strict_cpu << "|" << std::thread::hardware_concurrency() << "|" << config.type_k << "|" << config.type_v << "|" << config.flash_attn;
+    return key.str();
+}
+
+bool EngineTuner::loadCached(const std::string& key, EngineConfig& config) const {
+    // one result per line: key, then tab separated n_threads, n_threads_batch and n_ubatch
+    std::ifstream file(m_cache_path);
+    std::string   line;
+    while (std::getline(file, line)) {
+        const size_t separator = line.find('\t');
+        if (separator == std::string::npos || line.compare(0, separator, key) != 0 || separator != key.size()) {
+            continue;
+        }
+        std::stringstream values(line.substr(separator + 1));
+        EngineConfig      cached = config;
+        if (values >> cached.n_threads >> cached.n_threads_batch >> cached.n_ubatch && cached.n_threads > 0 && cached.n_threads_batch > 0 && cached.n_ubatch > 0) {
+            config = cached;
+            return true;
+        }
+    }
+    return false;
+}
+
+void EngineTuner::saveCached(const std::string& key, const EngineConfig& config) const {
+    // keep results for other models and machines
+    std::vector<std::string> lines;
+    {
+        std::ifstream file(m_cache_path);
+        std::string   line;
+        while (std::getline(file, line)) {
+            if (line.compare(0, key.size() + 1, key + "\t") != 0) {
+                lines.push_back(line);
+            }
+        }
+    }
+    lines.push_back(key + "\t" + std::to_string(config.n_threads) + "\t" + std::to_string(config.n_threads_batch) + "\t" + std::to_string(config.n_ubatch));
+
+    std::ofstream file(m_cache_path, std::ios::trunc);
+    for (const auto& line : lines) {
+        file << line << "\n";
+    }
+    if (!file) {
+        std::cout << "could not write tuning cache " << m_cache_path << std::endl;
+    }
+}
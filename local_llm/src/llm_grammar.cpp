@@ -0,0 +1,456 @@
+#include "llm_grammar.hpp"
+#include "llama-grammar.h"
+#include <algorithm>
+#include <cmath>
+#include <cctype>
+
+// JSON values the converted schemas are built from, every value rule takes the whitespace after it
+static const char* JSON_BASE_RULES = R"(value ::= object | array | string | number | boolean | null
+object ::= "{" ws ( string ":" ws value ( "," ws string ":" ws value )* )? "}" ws
+array ::= "[" ws ( value ( "," ws value )* )? "]" ws
+string ::= "\"" char* "\"" ws
+char ::= [^"\\\x7F\x00-\x1F] | [\\] ( ["\\/bfnrt] | "u" [0-9a-fA-F]{4} )
+number ::= "-"? ( "0" | [1-9] [0-9]{0,15} ) ( "." [0-9]+ )? ( [eE] [-+]? [0-9]+ )? ws
+integer ::= "-"? ( "0" | [1-9] [0-9]{0,15} ) ws
+boolean ::= ( "true" | "false" ) ws
+null ::= "null" ws
+ws ::= | " " | "\n" [ \t]{0,20}
+)";
+
+GrammarConstraint::GrammarConstraint(const llama_vocab* vocab, const std::string& grammar) {
+    m_vocab   = vocab;
+    m_n_vocab = llama_vocab_n_tokens(vocab);
+    m_grammar = llama_grammar_init_impl(vocab, grammar.c_str(), "root", false, nullptr, 0, nullptr, 0);
+}
+
+GrammarConstraint::~GrammarConstraint() {
+    for (llama_grammar* state : m_states) {
+        llama_grammar_free_impl(state);
+    }
+    if (m_grammar) {
+        llama_grammar_free_impl(m_grammar);
+    }
+}
+
+void GrammarConstraint::begin(size_t n_states) {
+    for (llama_grammar* state : m_states) {
+        llama_grammar_free_impl(state);
+    }
+
+    // each state holds its own copy of the rules, which the positions in its stacks point into
+    m_states.resize(n_states);
+    m_rule_starts.resize(n_states);
+    for (size_t i = 0; i < n_states; ++i) {
+        m_states[i] = llama_grammar_clone_impl(*m_grammar);
+        m_rule_starts[i].clear();
+        for (size_t rule = 0; rule < m_states[i]->rules.size(); ++rule) {
+            m_rule_starts[i].push_back({ reinterpret_cast<uintptr_t>(m_states[i]->rules[rule].data()), (uint32_t)rule });
+        }
+        std::sort(m_rule_starts[i].begin(), m_rule_starts[i].end());
+    }
+}
+
+llama_token GrammarConstraint::sample(llama_sampler* sampler, llama_context* context, int32_t idx, size_t state) {
+    llama_grammar& grammar = *m_states[state];
+    const uint64_t key     = stateKey(state);
+    ++m_stats.sampled;
+
+    // draw without the grammar as llama_sampler_sample does, but leave accepting to the token finally chosen
+    const float* logits = llama_get_logits_ith(context, idx);
+    m_candidates.resize(m_n_vocab);
+    for (int32_t i = 0; i < m_n_vocab; ++i) {
+        m_candidates[i] = { i, logits[i], 0.0f };
+    }
+    llama_token_data_array draw = { m_candidates.data(), m_candidates.size(), -1, false };
+    llama_sampler_apply(sampler, &draw);
+    llama_token token = draw.data[std::max<int64_t>(draw.selected, 0)].id;
+
+    // check only the token drawn, against the cached mask if the state has one
+    bool allowed = false;
+    if (auto cached = m_masks.find(key); cached != m_masks.end()) {
+        ++m_stats.mask_hits;
+        cached->second.last_used = ++m_use_counter;
+        allowed                  = (cached->second.allowed[token / 64] >> (token % 64)) & 1;
+    } else {
+        llama_token_data       single = { token, 0.0f, 0.0f };
+        llama_token_data_array cur_p  = { &single, 1, -1, false };
+        llama_grammar_apply_impl(grammar, &cur_p);
+        allowed = single.logit != -INFINITY;
+    }
+
+    // draw again from the allowed tokens only
+    if (!allowed) {
+        ++m_stats.resampled;
+        const Mask& allowed_tokens = mask(state, key);
+        m_candidates.clear();
+        for (size_t word = 0; word < allowed_tokens.size(); ++word) {
+            for (uint64_t bits = allowed_tokens[word]; bits != 0; bits &= bits - 1) {
+                const llama_token id = (llama_token)(word * 64 + __builtin_ctzll(bits));
+                m_candidates.push_back({ id, logits[id], 0.0f });
+            }
+        }
+        if (m_candidates.empty()) {
+            return llama_vocab_eos(m_vocab);  // the grammar can not continue, end the reply
+        }
+        llama_token_data_array cur_p = { m_candidates.data(), m_candidates.size(), -1, false };
+        llama_sampler_apply(sampler, &cur_p);
+        token = cur_p.data[std::max<int64_t>(cur_p.selected, 0)].id;
+    }
+
+    llama_sampler_accept(sampler, token);
+    llama_grammar_accept_impl(grammar, token);
+    return token;
+}
+
+uint64_t GrammarConstraint::stateKey(size_t state) const {
+    const llama_grammar& grammar     = *m_states[state];
+    const auto&          rule_starts = m_rule_starts[state];
+    uint64_t             key         = 0;
+    auto                 mix         = [&key](uint64_t value) {
+        key ^= value + 0x9e3779b97f4a7c15ull + (key << 6) + (key >> 2);
+    };
+
+    // positions are taken as rule index and offset, so states with the same rule positions share a key
+    mix(grammar.partial_utf8.value);
+    mix((uint64_t)grammar.partial_utf8.n_remain);
+    for (const auto& stack : grammar.stacks) {
+        mix(stack.size());
+        for (const llama_grammar_element* element : stack) {
+            const uintptr_t address = reinterpret_cast<uintptr_t>(element);
+            auto            rule    = std::upper_bound(rule_starts.begin(), rule_starts.end(), std::make_pair(address, UINT32_MAX));
+            if (rule == rule_starts.begin()) {
+                mix(address);
+                continue;
+            }
+            --rule;
+            mix(((uint64_t)rule->second << 32) | ((address - rule->first) / sizeof(llama_grammar_element)));
+        }
+    }
+    return key;
+}
+
+const GrammarConstraint::Mask& GrammarConstraint::mask(size_t state, uint64_t key) {
+    if (auto cached = m_masks.find(key); cached != m_masks.end()) {
+        ++m_stats.mask_hits;
+        cached->second.last_used = ++m_use_counter;
+        return cached->second.allowed;
+    }
+
+    // make room by dropping only the mask unused for longest, so the states still being visited keep theirs
+    if (m_masks.size() >= MAX_CACHED_MASKS) {
+        auto oldest = std::min_element(m_masks.begin(), m_masks.end(), [](const auto& a, const auto& b) {
+            return a.second.last_used < b.second.last_used;
+        });
+        m_masks.erase(oldest);
+    }
+    ++m_stats.masks_built;
+
+    // check every token of the vocabulary against the grammar once for this state
+    m_candidates.resize(m_n_vocab);
+    for (int32_t i = 0; i < m_n_vocab; ++i) {
+        m_candidates[i] = { i, 0.0f, 0.0f };
+    }
+    llama_token_data_array cur_p = { m_candidates.data(), m_candidates.size(), -1, false };
+    llama_grammar_apply_impl(*m_states[state], &cur_p);
+
+    CachedMask& cached = m_masks[key];
+    cached.last_used   = ++m_use_counter;
+    Mask& allowed      = cached.allowed;
+    allowed.assign((m_n_vocab + 63) / 64, 0);
+    for (int32_t i = 0; i < m_n_vocab; ++i) {
+        if (m_candidates[i].logit != -INFINITY) {
+            allowed[i / 64] |= 1ull << (i % 64);
+        }
+    }
+    return allowed;
+}
+
+JsonSchemaGrammar::JsonSchemaGrammar(const JsonValue& root) : m_root(root) {}
+
+bool JsonSchemaGrammar::convert(std::string_view schema, std::string& grammar, std::string& error) {
+    JsonValue root;
+    if (!JsonValue::parse(schema, root)) {
+        error = "the JSON schema is not valid JSON";
+        return false;
+    }
+    JsonSchemaGrammar converter(root);
+    const std::string expression = converter.visit(root, "root", 0);
+    if (expression.empty()) {
+        error = converter.m_error;
+        return false;
+    }
+
+    grammar = "root ::= " + expression + "\n";
+    for (const auto& [name, body] : converter.m_rules) {
+        grammar += name + " ::= " + body + "\n";
+    }
+    grammar += JSON_BASE_RULES;
+    return true;
+}
+
+std::string JsonSchemaGrammar::anyObject() {
+    return std::string("root ::= object\n") + JSON_BASE_RULES;
+}
+
+std::string JsonSchemaGrammar::visit(const JsonValue& schema, const std::string& name, int depth) {
+    if (depth > MAX_DEPTH) {
+        m_error = "the JSON schema is nested too deeply";
+        return "";
+    }
+    if (schema.type() == JsonValue::Type::BOOL) {
+        if (!schema.asBool()) {
+            m_error = "the JSON schema at " + name + " allows no value";
+            return "";
+        }
+        return "value";
+    }
+    if (schema.type() != JsonValue::Type::OBJECT) {
+        m_error = "the JSON schema at " + name + " is not an object";
+        return "";
+    }
+
+    // references become rules of their own, named before they are converted so recursive references end at the name
+    if (const JsonValue* ref = schema.find("$ref")) {
+        const std::string& path = ref->asString();
+        if (auto converted = m_refs.find(path); converted != m_refs.end()) {
+            return converted->second;
+        }
+        const JsonValue* target = nullptr;
+        std::string      def_name;
+        for (const char* prefix : { "#/$defs/", "#/definitions/" }) {
+            const std::string_view section = std::string_view(prefix).substr(2, std::string_view(prefix).size() - 3);
+            if (path.starts_with(prefix)) {
+                const JsonValue* defs = m_root.find(section);
+                def_name              = path.substr(std::string_view(prefix).size());
+                target                = defs ? defs->find(def_name) : nullptr;
+            }
+        }
+        if (!target) {
+            m_error = "could not resolve $ref " + path + ", only references to $defs and definitions are supported";
+            return "";
+        }
+        const std::string rule = addRule("def-" + def_name, "");
+        m_refs[path]           = rule;
+        const std::string body = visit(*target, rule, depth + 1);
+        if (body.empty()) {
+            return "";
+        }
+        std::find_if(m_rules.begin(), m_rules.end(), [&rule](const std::pair<std::string, std::string>& entry) {
+            return entry.first == rule;
+        })->second = body;
+        return rule;
+    }
+
+    // fixed values are matched as their compact JSON text
+    if (const JsonValue* value = schema.find("const")) {
+        return literal(value->dump()) + " ws";
+    }
+    if (const JsonValue* values = schema.find("enum"); values && !values->items().empty()) {
+        std::string alternatives;
+        for (const auto& value : values->items()) {
+            alternatives += (alternatives.empty() ? "" : " | ") + literal(value.dump());
+        }
+        return "( " + alternatives + " ) ws";
+    }
+
+    for (const char* keyword : { "anyOf", "oneOf" }) {
+        if (const JsonValue* options = schema.find(keyword); options && !options->items().empty()) {
+            std::string alternatives;
+            for (size_t i = 0; i < options->items().size(); ++i) {
+                const std::string option = visit(options->items()[i], name + "-" + std::to_string(i), depth + 1);
+                if (option.empty()) {
+                    return "";
+                }
+                alternatives += (i == 0 ? "" : " | ") + option;
+            }
+            return "( " + alternatives + " )";
+        }
+    }
+    if (const JsonValue* all = schema.find("allOf"); all && !all->items().empty()) {
+        if (all->items().size() > 1) {
+            m_error = "allOf with more than one schema is not supported";
+            return "";
+        }
+        return visit(all->items()[0], name, depth + 1);
+    }
+
+    const JsonValue* type = schema.find("type");
+    if (!type) {
+        if (schema.find("properties")) {
+            return visitType(schema, "object", name, depth);
+        }
+        if (schema.find("items")) {
+            return visitType(schema, "array", name, depth);
+        }
+        return "value";
+    }
+    if (type->type() == JsonValue::Type::STRING) {
+        return visitType(schema, type->asString(), name, depth);
+    }
+    if (type->type() == JsonValue::Type::ARRAY && !type->items().empty()) {
+        std::string alternatives;
+        for (const auto& item : type->items()) {
+            const std::string option = visitType(schema, item.asString(), name + "-" + item.asString(), depth);
+            if (option.empty()) {
+                return "";
+            }
+            alternatives += (alternatives.empty() ? "" : " | ") + option;
+        }
+        return "( " + alternatives + " )";
+    }
+    m_error = "type at " + name + " must be a string or a list of strings";
+    return "";
+}
+
+std::string JsonSchemaGrammar::visitType(const JsonValue& schema, const std::string& type, const std::string& name, int depth) {
+    // a subschema embedded in a larger expression gets a rule of its own unless it already is a single rule
+    auto rule_for = [this](const std::string& expression, const std::string& rule_name) {
+        if (expression.empty() || std::all_of(expression.begin(), expression.end(), [](char c) {
+                return std::isalnum((unsigned char)c) || c == '-';
+            })) {
+            return expression;
+        }
+        return addRule(rule_name, expression);
+    };
+    auto count = [&schema](const char* keyword, int64_t fallback) {
+        const JsonValue* value = schema.find(keyword);
+        return value && value->type() == JsonValue::Type::NUMBER ? (int64_t)std::max(0.0, value->asNumber()) : fallback;
+    };
+    auto repeat = [](int64_t min, int64_t max) {
+        if (min == 0 && max < 0) {
+            return std::string("*");
+        }
+        return "{" + std::to_string(min) + "," + (max < 0 ? "" : std::to_string(max)) + "}";
+    };
+
+    if (type == "string") {
+        const int64_t min_length = count("minLength", 0);
+        const int64_t max_length = count("maxLength", -1);
+        if (min_length == 0 && max_length < 0) {
+            return "string";
+        }
+        return "\"\\\"\" char" + repeat(min_length, max_length) + " \"\\\"\" ws";
+    }
+    if (type == "integer" || type == "number" || type == "boolean" || type == "null") {
+        return type;
+    }
+
+    if (type == "array") {
+        const JsonValue*  items     = schema.find("items");
+        const std::string item      = items ? rule_for(visit(*items, name + "-item", depth + 1), name + "-item") : "value";
+        const int64_t     min_items = count("minItems", 0);
+        const int64_t     max_items = count("maxItems", -1);
+        if (item.empty()) {
+            return "";
+        }
+        if (max_items == 0) {
+            return "\"[\" ws \"]\" ws";
+        }
+        const std::string list = max_items == 1 ? item : item + " ( \",\" ws " + item + " )" + repeat(std::max<int64_t>(min_items - 1, 0), max_items < 0 ? -1 : max_items - 1);
+        return "\"[\" ws " + (min_items > 0 ? list : "( " + list + " )?") + " \"]\" ws";
+    }
+
+    if (type == "object") {
+        const JsonValue* properties = schema.find("properties");
+        if (!properties || properties->members().empty()) {
+            const JsonValue* additional = schema.find("additionalProperties");
+            if (additional && additional->type() == JsonValue::Type::OBJECT) {
+                const std::string value = rule_for(visit(*additional, name + "-value", depth + 1), name + "-value");
+                if (value.empty()) {
+                    return "";
+                }
+                const std::string member = "string \":\" ws " + value;
+                return "\"{\" ws ( " + member + " ( \",\" ws " + member + " )* )? \"}\" ws";
+            }
+            if (additional && additional->type() == JsonValue::Type::BOOL && !additional->asBool()) {
+                return "\"{\" ws \"}\" ws";
+            }
+            return "object";
+        }
+
+        std::vector<std::string> members;
+        std::vector<bool>        required;
+        for (const auto& [key, property] : properties->members()) {
+            const std::string value = rule_for(visit(property, name + "-" + key, depth + 1), name + "-" + key);
+            if (value.empty()) {
+                return "";
+            }
+            members.push_back(literal(JsonValue(key).dump()) + " ws \":\" ws " + value);
+            required.push_back(false);
+            if (const JsonValue* required_keys = schema.find("required")) {
+                for (const auto& required_key : required_keys->items()) {
+                    required.back() = required.back() || required_key.asString() == key;
+                }
+            }
+        }
+
+        // after the first member every member follows a comma, before it an optional member may be skipped or start the list
+        std::vector<std::string> after_first(members.size() + 1);
+        std::vector<std::string> from_first(members.size() + 1);
+        for (size_t i = members.size(); i-- > 0;) {
+            const std::string next = "\",\" ws " + members[i];
+            after_first[i]         = (required[i] ? next : "( " + next + " )?") + (after_first[i + 1].empty() ? "" : " " + after_first[i + 1]);
+            const std::string list = members[i] + (after_first[i + 1].empty() ? "" : " " + after_first[i + 1]);
+            from_first[i]          = required[i] ? list : "( " + list + (from_first[i + 1].empty() ? " )?" : " | " + from_first[i + 1] + " )");
+        }
+        return "\"{\" ws " + from_first[0] + " \"}\" ws";
+    }
+
+    m_error = "unsupported type '" + type + "' at " + name;
+    return "";
+}
+
+std::string JsonSchemaGrammar::addRule(const std::string& name, const std::string& body) {
+    static const char* RESERVED[] = { "root", "value", "object", "array", "string", "char", "number", "integer", "boolean", "null", "ws" };
+
+    // rule names only hold letters, digits and dashes
+    std::string base = name;
+    for (char& c : base) {
+        if (!std::isalnum((unsigned char)c) && c != '-') {
+            c = '-';
+        }
+    }
+    std::string unique = base;
+    for (int suffix = 1;; ++suffix) {
+        const bool taken = std::find(std::begin(RESERVED), std::end(RESERVED), unique) != std::end(RESERVED) || std::any_of(m_rules.begin(), m_rules.end(), [&unique](const std::pair<std::string, std::string>& rule) {
+            return rule.first == unique;
+        });
+        if (!taken) {
+            break;
+        }
+        unique = base + "-" + std::to_string(suffix);
+    }
+    m_rules.emplace_back(unique, body);
+    return unique;
+}
+
+std::string JsonSchemaGrammar::literal(std::string_view text) {
+    static const char* HEX = "0123456789ABCDEF";
+    std::string        output = "\"";
+    for (char c : text) {
+        switch (c) {
+            case '"':
+                output += "\\\"";
+                break;
+            case '\\':
+                output += "\\\\";
+                break;
+            case '\n':
+                output += "\\n";
+                break;
+            case '\r':
+                output += "\\r";
+                break;
+            case '\t':
+                output += "\\t";
+                break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    output += std::string("\\x") + HEX[(unsigned char)c >> 4] + HEX[c & 0xF];
+                } else {
+                    output += c;
+                }
+        }
+    }
+    return output + "\"";
+}
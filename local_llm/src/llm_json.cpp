@@ -0,0 +1,353 @@
+#include "llm_json.hpp"
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+
+JsonValue::JsonValue(bool value) : m_type(Type::BOOL), m_bool(value) {}
+
+JsonValue::JsonValue(int value) : m_type(Type::NUMBER), m_number(value) {}
+
+JsonValue::JsonValue(int64_t value) : m_type(Type::NUMBER), m_number((double)value) {}
+
+JsonValue::JsonValue(uint64_t value) : m_type(Type::NUMBER), m_number((double)value) {}
+
+JsonValue::JsonValue(double value) : m_type(Type::NUMBER), m_number(value) {}
+
+JsonValue::JsonValue(const char* value) : m_type(Type::STRING), m_string(value) {}
+
+JsonValue::JsonValue(std::string value) : m_type(Type::STRING), m_string(std::move(value)) {}
+
+JsonValue JsonValue::array() {
+    JsonValue value;
+    value.m_type = Type::ARRAY;
+    return value;
+}
+
+JsonValue JsonValue::object() {
+    JsonValue value;
+    value.m_type = Type::OBJECT;
+    return value;
+}
+
+bool JsonValue::parse(std::string_view text, JsonValue& value) {
+    size_t pos = 0;
+    value      = JsonValue();
+    if (!parseValue(text, pos, value, 0)) {
+        return false;
+    }
+    skipWhitespace(text, pos);
+    return pos == text.size();
+}
+
+const JsonValue* JsonValue::find(std::string_view key) const {
+    for (const auto& member : m_members) {
+        if (member.first == key) {
+            return &member.second;
+        }
+    }
+    return nullptr;
+}
+
+JsonValue& JsonValue::operator[](std::string_view key) {
+    if (m_type == Type::NUL) {
+        m_type = Type::OBJECT;
+    }
+    for (auto& member : m_members) {
+        if (member.first == key) {
+            return member.second;
+        }
+    }
+    m_members.emplace_back(std::string(key), JsonValue());
+    return m_members.back().second;
+}
+
+void JsonValue::push(JsonValue value) {
+    if (m_type == Type::NUL) {
+        m_type = Type::ARRAY;
+    }
+    m_items.push_back(std::move(value));
+}
+
+std::string JsonValue::dump() const {
+    std::string output;
+    dump(output);
+    return output;
+}
+
+void JsonValue::dump(std::string& output) const {
+    switch (m_type) {
+        case Type::NUL:
+            output += "null";
+            break;
+        case Type::BOOL:
+            output += m_bool ? "true" : "false";
+            break;
+        case Type::NUMBER: {
+            // JSON has no infinity or NaN, integers are written without a fraction
+            char buffer[32];
+            if (!std::isfinite(m_number)) {
+                output += "null";
+            } else if (m_number == std::floor(m_number) && std::fabs(m_number) < 1e15) {
+                output += std::to_string((int64_t)m_number);
+            } else {
+                output.append(buffer, std::snprintf(buffer, sizeof(buffer), "%.17g", m_number));
+            }
+            break;
+        }
+        case Type::STRING:
+            dumpString(m_string, output);
+            break;
+        case Type::ARRAY:
+            output += '[';
+            for (size_t i = 0; i < m_items.size(); ++i) {
+                if (i > 0) {
+                    output += ',';
+                }
+                m_items[i].dump(output);
+            }
+            output += ']';
+            break;
+        case Type::OBJECT:
+            output += '{';
+            for (size_t i = 0; i < m_members.size(); ++i) {
+                if (i > 0) {
+                    output += ',';
+                }
+                dumpString(m_members[i].first, output);
+                output += ':';
+                m_members[i].second.dump(output);
+            }
+            output += '}';
+            break;
+    }
+}
+
+void JsonValue::dumpString(std::string_view text, std::string& output) {
+    output += '"';
+    for (unsigned char c : text) {
+        switch (c) {
+            case '"':
+                output += "\\\"";
+                break;
+            case '\\':
+                output += "\\\\";
+                break;
+            case '\n':
+                output += "\\n";
+                break;
+            case '\r':
+                output += "\\r";
+                break;
+            case '\t':
+                output += "\\t";
+                break;
+            default:
+                if (c < 0x20) {
+                    char buffer[8];
+                    output.append(buffer, std::snprintf(buffer, sizeof(buffer), "\\u%04x", c));
+                } else {
+                    output += (char)c;
+                }
+        }
+    }
+    output += '"';
+}
+
+bool JsonValue::parseValue(std::string_view text, size_t& pos, JsonValue& value, int depth) {
+    if (depth > MAX_DEPTH) {
+        return false;
+    }
+    skipWhitespace(text, pos);
+    if (pos >= text.size()) {
+        return false;
+    }
+
+    const char c = text[pos];
+    if (c == '{') {
+        value = object();
+        ++pos;
+        skipWhitespace(text, pos);
+        if (pos < text.size() && text[pos] == '}') {
+            ++pos;
+            return true;
+        }
+        while (true) {
+            std::string key;
+            skipWhitespace(text, pos);
+            if (!parseString(text, pos, key)) {
+                return false;
+            }
+            skipWhitespace(text, pos);
+            if (pos >= text.size() || text[pos] != ':') {
+                return false;
+            }
+            ++pos;
+            JsonValue member;
+            if (!parseValue(text, pos, member, depth + 1)) {
+                return false;
+            }
+            value.m_members.emplace_back(std::move(key), std::move(member));
+            skipWhitespace(text, pos);
+            if (pos < text.size() && text[pos] == ',') {
+                ++pos;
+            } else if (pos < text.size() && text[pos] == '}') {
+                ++pos;
+                return true;
+            } else {
+                return false;
+            }
+        }
+    } else if (c == '[') {
+        value = array();
+        ++pos;
+        skipWhitespace(text, pos);
+        if (pos < text.size() && text[pos] == ']') {
+            ++pos;
+            return true;
+        }
+        while (true) {
+            JsonValue item;
+            if (!parseValue(text, pos, item, depth + 1)) {
+                return false;
+            }
+            value.m_items.push_back(std::move(item));
+            skipWhitespace(text, pos);
+            if (pos < text.size() && text[pos] == ',') {
+                ++pos;
+            } else if (pos < text.size() && text[pos] == ']') {
+                ++pos;
+                return true;
+            } else {
+                return false;
+            }
+        }
+    } else if (c == '"') {
+        value.m_type = Type::STRING;
+        return parseString(text, pos, value.m_string);
+    } else if (text.substr(pos, 4) == "true") {
+        value = JsonValue(true);
+        pos += 4;
+        return true;
+    } else if (text.substr(pos, 5) == "false") {
+        value = JsonValue(false);
+        pos += 5;
+        return true;
+    } else if (text.substr(pos, 4) == "null") {
+        value = JsonValue();
+        pos += 4;
+        return true;
+    }
+
+    // number, from_chars does not accept a leading '+' which JSON does not allow either
+    double number = 0.0;
+    auto   result = std::from_chars(text.data() + pos, text.data() + text.size(), number);
+    if (result.ec != std::errc() || result.ptr == text.data() + pos) {
+        return false;
+    }
+    pos   = result.ptr - text.data();
+    value = JsonValue(number);
+    return true;
+}
+
+bool JsonValue::parseString(std::string_view text, size_t& pos, std::string& output) {
+    if (pos >= text.size() || text[pos] != '"') {
+        return false;
+    }
+    ++pos;
+
+    auto read_hex = [&](uint32_t& code) {
+        if (pos + 4 > text.size()) {
+            return false;
+        }
+        auto result = std::from_chars(text.data() + pos, text.data() + pos + 4, code, 16);
+        if (result.ptr != text.data() + pos + 4) {
+            return false;
+        }
+        pos += 4;
+        return true;
+    };
+
+    while (pos < text.size()) {
+        const char c = text[pos++];
+        if (c == '"') {
+            return true;
+        } else if ((unsigned char)c < 0x20) {
+            return false;
+        } else if (c != '\\') {
+            output += c;
+            continue;
+        }
+
+        if (pos >= text.size()) {
+            return false;
+        }
+        const char escape = text[pos++];
+        switch (escape) {
+            case '"':
+            case '\\':
+            case '/':
+                output += escape;
+                break;
+            case 'b':
+                output += '\b';
+                break;
+            case 'f':
+                output += '\f';
+                break;
+            case 'n':
+                output += '\n';
+                break;
+            case 'r':
+                output += '\r';
+                break;
+            case 't':
+                output += '\t';
+                break;
+            case 'u': {
+                // characters outside the basic plane are written as a surrogate pair
+                uint32_t code = 0;
+                if (!read_hex(code)) {
+                    return false;
+                }
+                if (code >= 0xD800 && code <= 0xDBFF) {
+                    uint32_t low = 0;
+                    if (text.substr(pos, 2) != "\\u") {
+                        return false;
+                    }
+                    pos += 2;
+                    if (!read_hex(low) || low < 0xDC00 || low > 0xDFFF) {
+                        return false;
+                    }
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+
+                // encode as UTF-8
+                if (code < 0x80) {
+                    output += (char)code;
+                } else if (code < 0x800) {
+                    output += (char)(0xC0 | (code >> 6));
+                    output += (char)(0x80 | (code & 0x3F));
+                } else if (code < 0x10000) {
+                    output += (char)(0xE0 | (code >> 12));
+                    output += (char)(0x80 | ((code >> 6) & 0x3F));
+                    output += (char)(0x80 | (code & 0x3F));
+                } else {
+                    output += (char)(0xF0 | (code >> 18));
+                    output += (char)(0x80 | ((code >> 12) & 0x3F));
+                    output += (char)(0x80 | ((code >> 6) & 0x3F));
+                    output += (char)(0x80 | (code & 0x3F));
+                }
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+void JsonValue::skipWhitespace(std::string_view text, size_t& pos) {
+    while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r')) {
+        ++pos;
+    }
+}
@@ -0,0 +1,74 @@
+#include "llm_model_registry.hpp"
+#include <iostream>
+#include <chrono>
+
+ModelRegistry& ModelRegistry::instance() {
+    static ModelRegistry registry;
+    return registry;
+}
+
+void ModelRegistry::initBackend(ggml_numa_strategy numa) {
+    // initialize llama cpp backend
+    std::call_once(m_backend_init, [numa]() {
+        ggml_backend_load_all();
+        if (numa != GGML_NUMA_STRATEGY_DISABLED) {
+            llama_numa_init(numa);
+        }
+    });
+}
+
+std::shared_ptr<llama_model> ModelRegistry::acquire(const std::string& model_path, int32_t n_gpu_layers) {
+    initBackend();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // hand out the already loaded model if another instance still holds it
+    const std::string key = model_path + "|" + std::to_string(n_gpu_layers);
+    auto              it  = m_models.find(key);
+    if (it != m_models.end()) {
+        if (std::shared_ptr<llama_model> model = it->second.lock()) {
+            return model;
+        }
+        m_models.erase(it);
+    }
+
+    // setup model parameters, weights are memory mapped so the OS page cache is shared too
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers       = n_gpu_layers;
+    model_params.use_mmap           = true;
+
+    // load model
+    llama_model* raw_model = llama_model_load_from_file(model_path.c_str(), model_params);
+    if (!raw_model) {
+        return nullptr;
+    }
+
+    std::shared_ptr<llama_model> model(raw_model, llama_model_free);
+    m_models[key] = model;
+    return model;
+}
+
+std::shared_ptr<llama_adapter_lora> ModelRegistry::acquireAdapter(const std::shared_ptr<llama_model>& model, const std::string& adapter_path) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // an adapter keeps its model alive, so a live entry cannot belong to a freed model at the same address
+    const std::string key = std::to_string(reinterpret_cast<uintptr_t>(model.get())) + "|" + adapter_path;
+    auto              it  = m_adapters.find(key);
+    if (it != m_adapters.end()) {
+        if (std::shared_ptr<llama_adapter_lora> adapter = it->second.lock()) {
+            return adapter;
+        }
+        m_adapters.erase(it);
+    }
+
+    llama_adapter_lora* raw_adapter = llama_adapter_lora_init(model.get(), adapter_path.c_str());
+    if (!raw_adapter) {
+        return nullptr;
+    }
+
+    std::shared_ptr<llama_adapter_lora> adapter(raw_adapter, [model](llama_adapter_lora* loaded) {
+        llama_adapter_lora_free(loaded);
+    });
+    m_adapters[key] = adapter;
+    return adapter;
+}
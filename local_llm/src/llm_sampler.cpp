@@ -0,0 +1,224 @@
+#include "llm_sampler.hpp"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+// the llama_sampler owns its FusedSampler through the context pointer
+static const llama_sampler_i FUSED_SAMPLER_INTERFACE = {
+    .name = [](const llama_sampler* /* smpl */) {
+        return "fused";
+    },
+    .accept = nullptr,
+    .apply  = [](llama_sampler* smpl, llama_token_data_array* cur_p) {
+        static_cast<FusedSampler*>(smpl->ctx)->sample(cur_p);
+    },
+    .reset = [](llama_sampler* smpl) {
+        static_cast<FusedSampler*>(smpl->ctx)->reset();
+    },
+    .clone = [](const llama_sampler* smpl) {
+        return llama_sampler_init(&FUSED_SAMPLER_INTERFACE, new FusedSampler(*static_cast<const FusedSampler*>(smpl->ctx)));
+    },
+    .free = [](llama_sampler* smpl) {
+        delete static_cast<FusedSampler*>(smpl->ctx);
+    },
+};
+
+FusedSampler::FusedSampler(const SamplerParams& params) {
+    m_params = params;
+    m_scan   = selectScan();
+    reset();
+}
+
+llama_sampler* FusedSampler::init(const SamplerParams& params) {
+    return llama_sampler_init(&FUSED_SAMPLER_INTERFACE, new FusedSampler(params));
+}
+
+void FusedSampler::reset() {
+    m_rng.seed(m_params.seed == LLAMA_DEFAULT_SEED ? std::random_device()() : m_params.seed);
+}
+
+void FusedSampler::filter(llama_token_data_array* cur_p) {
+    if (cur_p->size == 0) {
+        return;
+    }
+
+    // one pass over the vocabulary keeps the tokens that can pass min-p and top-k, without temperature only the most likely is needed
+    m_top_k     = m_params.temperature <= 0.0f ? 1 : std::max<int32_t>(m_params.top_k, 0);
+    m_log_min_p = m_params.min_p > 0.0f ? logf(m_params.min_p) : -INFINITY;
+    m_max_logit = -INFINITY;
+    m_threshold = -INFINITY;
+    m_candidates.clear();
+    m_top_logits.clear();
+    if (m_top_k == 0 && m_params.min_p <= 0.0f) {
+        m_candidates.assign(cur_p->data, cur_p->data + cur_p->size);
+        for (const auto& token : m_candidates) {
+            m_max_logit = std::max(m_max_logit, token.logit);
+        }
+    } else {
+        (this->*m_scan)(cur_p->data, cur_p->size);
+    }
+
+    // tokens kept before the maximum was reached can be below its min-p bound, tokens kept before the k-th largest was known can be below it
+    if (m_params.min_p > 0.0f) {
+        const float min_logit = m_max_logit + m_log_min_p;
+        std::erase_if(m_candidates, [min_logit](const llama_token_data& token) {
+            return token.logit < min_logit;
+        });
+    }
+    if (m_top_k > 0 && m_top_k < m_candidates.size()) {
+        std::nth_element(m_candidates.begin(), m_candidates.begin() + m_top_k, m_candidates.end(), [](const llama_token_data& a, const llama_token_data& b) {
+            return a.logit > b.logit;
+        });
+        m_candidates.resize(m_top_k);
+    }
+
+    bool sorted = false;
+    if (m_params.temperature <= 0.0f) {
+        m_candidates[0].p = 1.0f;
+    } else {
+        // probabilities at the temperature, the maximum is always among the tokens kept
+        const float scaled_max = m_max_logit / m_params.temperature;
+        float       sum        = 0.0f;
+        for (auto& token : m_candidates) {
+            token.logit /= m_params.temperature;
+            token.p      = expf(token.logit - scaled_max);
+            sum         += token.p;
+        }
+        for (auto& token : m_candidates) {
+            token.p /= sum;
+        }
+
+        // sort the most likely tokens in chunks of doubling size until their probabilities reach top_p
+        if (m_params.top_p < 1.0f) {
+            auto by_probability = [](const llama_token_data& a, const llama_token_data& b) {
+                return a.p > b.p;
+            };
+            size_t n_sorted   = 0;
+            size_t n_keep     = m_candidates.size();
+            float  cumulative = 0.0f;
+            while (n_sorted < n_keep) {
+                const size_t n_chunk = std::min(std::max(TOP_P_FIRST_SORT, n_sorted), m_candidates.size() - n_sorted);
+                std::nth_element(m_candidates.begin() + n_sorted, m_candidates.begin() + n_sorted + n_chunk, m_candidates.end(), by_probability);
+                std::sort(m_candidates.begin() + n_sorted, m_candidates.begin() + n_sorted + n_chunk, by_probability);
+                for (size_t i = n_sorted; i < n_sorted + n_chunk; ++i) {
+                    cumulative += m_candidates[i].p;
+                    if (cumulative >= m_params.top_p) {
+                        n_keep = i + 1;
+                        break;
+                    }
+                }
+                n_sorted += n_chunk;
+            }
+            m_candidates.resize(n_keep);
+            sorted = true;
+
+            float kept = 0.0f;
+            for (const auto& token : m_candidates) {
+                kept += token.p;
+            }
+            for (auto& token : m_candidates) {
+                token.p /= kept;
+            }
+        }
+    }
+
+    std::copy(m_candidates.begin(), m_candidates.end(), cur_p->data);
+    cur_p->size     = m_candidates.size();
+    cur_p->sorted   = sorted;
+    cur_p->selected = -1;
+}
+
+void FusedSampler::sample(llama_token_data_array* cur_p) {
+    filter(cur_p);
+    if (cur_p->size == 0) {
+        return;
+    }
+
+    // walk the probabilities to the uniform draw, rounding can leave it past the last token
+    const float target     = std::uniform_real_distribution<float>(0.0f, 1.0f)(m_rng);
+    float       cumulative = 0.0f;
+    cur_p->selected        = cur_p->size - 1;
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        cumulative += cur_p->data[i].p;
+        if (target < cumulative) {
+            cur_p->selected = i;
+            break;
+        }
+    }
+}
+
+void FusedSampler::keep(const llama_token_data& token) {
+    m_max_logit = std::max(m_max_logit, token.logit);
+    m_threshold = m_max_logit + m_log_min_p;
+    if (m_top_k > 0) {
+        if (m_top_logits.size() < m_top_k) {
+            m_top_logits.push_back(token.logit);
+            std::push_heap(m_top_logits.begin(), m_top_logits.end(), std::greater<float>());
+        } else if (token.logit > m_top_logits.front()) {
+            std::pop_heap(m_top_logits.begin(), m_top_logits.end(), std::greater<float>());
+            m_top_logits.back() = token.logit;
+            std::push_heap(m_top_logits.begin(), m_top_logits.end(), std::greater<float>());
+        }
+        if (m_top_logits.size() == m_top_k) {
+            m_threshold = std::max(m_threshold, m_top_logits.front());
+        }
+    }
+    m_candidates.push_back(token);
+}
+
+void FusedSampler::scanScalar(const llama_token_data* data, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        if (data[i].logit >= m_threshold) {
+            keep(data[i]);
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+__attribute__((target("avx2"))) void FusedSampler::scanAvx2(const llama_token_data* data, size_t n) {
+    static_assert(sizeof(llama_token_data) == 3 * sizeof(float), "token data must be three packed 32-bit fields");
+
+    // eight tokens span three registers with their logits in disjoint lanes, two blends gather them into one register
+    static constexpr uint8_t LANE_TOKEN[8] = { 5, 0, 3, 6, 1, 4, 7, 2 };  // token of the block whose logit each lane holds
+    const float*             values        = reinterpret_cast<const float*>(data);
+    __m256                   threshold     = _mm256_set1_ps(m_threshold);
+    size_t                   i             = 0;
+    for (; i + 8 <= n; i += 8) {
+        const float* block  = values + 3 * i;
+        __m256       logits = _mm256_blend_ps(_mm256_loadu_ps(block), _mm256_loadu_ps(block + 8), 0x24);
+        logits              = _mm256_blend_ps(logits, _mm256_loadu_ps(block + 16), 0x49);
+
+        // almost every block has no token above the threshold once the largest logits have been seen
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(logits, threshold, _CMP_GE_OQ));
+        if (mask == 0) {
+            continue;
+        }
+        while (mask != 0) {
+            const llama_token_data& token = data[i + LANE_TOKEN[__builtin_ctz(mask)]];
+            mask &= mask - 1;
+            if (token.logit >= m_threshold) {
+                keep(token);
+            }
+        }
+        threshold = _mm256_set1_ps(m_threshold);
+    }
+    scanScalar(data + i, n - i);
+}
+#else
+void FusedSampler::scanAvx2(const llama_token_data* data, size_t n) {
+    scanScalar(data, n);
+}
+#endif
+
+FusedSampler::ScanFunction FusedSampler::selectScan() {
+#if defined(__x86_64__) || defined(_M_X64)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &FusedSampler::scanAvx2;
+    }
+#endif
+    return &FusedSampler::scanScalar;
+}
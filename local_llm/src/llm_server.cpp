@@ -0,0 +1,692 @@
+#include "llm_server.hpp"
+#include "llm_grammar.hpp"
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+InferenceServer::InferenceServer(std::string model_path, int n_engines, size_t queue_capacity, EngineConfig engine_config, uint8_t debug_level) {
+    m_model_path     = model_path;
+    m_model_name     = std::filesystem::path(model_path).filename().string();
+    m_queue_capacity = queue_capacity;
+    m_debug_level    = debug_level;
+
+    // every engine shares the weights loaded by the first one
+    for (int i = 0; i < std::max(1, n_engines); ++i) {
+        auto engine = std::make_unique<Engine>();
+        engine->llm = std::make_unique<LLM>(model_path, DEFAULT_TEMPERATURE, false, debug_level, "", engine_config);
+        engine->llm->enableMetrics(true);  // token counts for the usage reported to clients
+        m_engines.push_back(std::move(engine));
+    }
+    for (auto& engine : m_engines) {
+        engine->worker = std::thread(&InferenceServer::workerLoop, this, std::ref(*engine));
+    }
+}
+
+InferenceServer::~InferenceServer() {
+    m_stopping = true;
+
+    // reject the requests still waiting, connection threads check m_stopping before queueing more
+    {
+        std::lock_guard<std::mutex> lock(m_queue_mutex);
+        for (auto& job : m_queue) {
+            sendError(job.fd, 503, "server is shutting down", "server_error");
+            close(job.fd);
+        }
+        m_queue.clear();
+    }
+    m_queue_cv.notify_all();
+    for (auto& engine : m_engines) {
+        if (engine->worker.joinable()) {
+            engine->worker.join();
+        }
+    }
+
+    // connection threads finish once their client has sent a request or timed out
+    {
+        std::unique_lock<std::mutex> lock(m_connections_mutex);
+        m_connections_cv.wait(lock, [this]() {
+            return m_open_connections == 0;
+        });
+    }
+
+    for (int fd : m_listen_fds) {
+        close(fd);
+    }
+    if (m_unix_path != "") {
+        unlink(m_unix_path.c_str());
+    }
+}
+
+bool InferenceServer::listenTcp(const std::string& host, uint16_t port) {
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port   = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1) {
+        std::cout << "invalid listen address '" << host << "'" << std::endl;
+        return false;
+    }
+
+    const int fd    = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    const int reuse = 1;
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 || bind(fd, (const sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        std::cout << "could not listen on " << host << ":" << port << ": " << std::strerror(errno) << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    m_listen_fds.push_back(fd);
+    std::cout << "listening on http://" << host << ":" << port << std::endl;
+    return true;
+}
+
+bool InferenceServer::listenUnix(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cout << "Unix socket path is too long: " << path << std::endl;
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    // replace a socket left behind by a previous run, but never another kind of file
+    struct stat existing;
+    if (stat(path.c_str(), &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            std::cout << path << " exists and is not a socket" << std::endl;
+            return false;
+        }
+        unlink(path.c_str());
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (const sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        std::cout << "could not listen on " << path << ": " << std::strerror(errno) << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    m_listen_fds.push_back(fd);
+    m_unix_path = path;
+    std::cout << "listening on unix:" << path << std::endl;
+    return true;
+}
+
+bool InferenceServer::addAdapter(const std::string& name, const std::string& adapter_path) {
+    if (!std::filesystem::exists(adapter_path)) {
+        std::cout << "adapter file " << adapter_path << " not found" << std::endl;
+        return false;
+    }
+    const bool taken = std::any_of(m_adapters.begin(), m_adapters.end(), [&name](const auto& adapter) {
+        return adapter.first == name;
+    });
+    if (name == m_model_name || taken) {
+        std::cout << "model name " << name << " is already served" << std::endl;
+        return false;
+    }
+    m_adapters.emplace_back(name, adapter_path);
+    return true;
+}
+
+void InferenceServer::run() {
+    if (m_listen_fds.empty()) {
+        std::cout << "no socket to listen on" << std::endl;
+        return;
+    }
+
+    std::vector<pollfd> poll_fds;
+    for (int fd : m_listen_fds) {
+        poll_fds.push_back({ fd, POLLIN, 0 });
+    }
+
+    // wake up regularly to notice stop, which may be called from a signal handler
+    while (!m_stopping) {
+        const int ready = poll(poll_fds.data(), poll_fds.size(), POLL_INTERVAL_MS);
+        if (ready < 0 && errno != EINTR) {
+            std::cout << "poll failed: " << std::strerror(errno) << std::endl;
+            break;
+        }
+
+        for (const auto& poll_fd : poll_fds) {
+            if (ready <= 0 || !(poll_fd.revents & POLLIN)) {
+                continue;
+            }
+            const int client = accept4(poll_fd.fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) {
+                continue;
+            }
+
+            // streamed pieces are small, send each one as soon as it is written (fails harmlessly on Unix sockets)
+            const int no_delay = 1;
+            setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+            {
+                std::lock_guard<std::mutex> lock(m_connections_mutex);
+                ++m_open_connections;
+            }
+            std::thread([this, client]() {
+                handleConnection(client);
+                std::lock_guard<std::mutex> lock(m_connections_mutex);
+                --m_open_connections;
+                m_connections_cv.notify_all();
+            }).detach();
+        }
+    }
+}
+
+void InferenceServer::handleConnection(int fd) {
+    HttpRequest request;
+    if (!readRequest(fd, request)) {
+        sendError(fd, 400, "malformed HTTP request", "invalid_request_error");
+        close(fd);
+        return;
+    }
+    if (m_debug_level > 0) {
+        std::cout << request.method << " " << request.path << std::endl;
+    }
+
+    if (request.path == "/health" && request.method == "GET") {
+        JsonValue health;
+        health["status"] = "ok";
+        health["engines"] = (uint64_t)m_engines.size();
+        {
+            std::lock_guard<std::mutex> lock(m_queue_mutex);
+            health["active"] = (uint64_t)m_active_jobs;
+            health["queued"] = (uint64_t)m_queue.size();
+        }
+        health["queue_capacity"]          = (uint64_t)m_queue_capacity;
+        health["context_size"]            = (uint64_t)m_engines.front()->llm->getEngineConfig().n_ctx;
+        health["kv_cache_estimate_bytes"] = m_engines.front()->llm->getEstimatedKvCacheBytes() * m_engines.size();
+        sendResponse(fd, 200, "application/json", health.dump());
+    } else if (request.path == "/v1/models" && request.method == "GET") {
+        JsonValue models;
+        models["object"] = "list";
+        models["data"]   = JsonValue::array();
+        auto add_model   = [&models](const std::string& id) {
+            JsonValue model;
+            model["id"]       = id;
+            model["object"]   = "model";
+            model["owned_by"] = "local";
+            models["data"].push(std::move(model));
+        };
+        add_model(m_model_name);
+        for (const auto& adapter : m_adapters) {
+            add_model(adapter.first);
+        }
+        sendResponse(fd, 200, "application/json", models.dump());
+    } else if (request.path == "/v1/chat/completions") {
+        if (request.method != "POST") {
+            sendError(fd, 405, "use POST for chat completions", "invalid_request_error");
+            close(fd);
+            return;
+        }
+
+        Job         job;
+        std::string error;
+        if (!parseChatRequest(request.body, job, error)) {
+            sendError(fd, 400, error, "invalid_request_error");
+            close(fd);
+            return;
+        }
+        job.fd = fd;
+        job.id = "chatcmpl-" + std::to_string(m_next_id++);
+
+        // admit the request only if there is room to wait, so a burst cannot build an unbounded backlog
+        {
+            std::lock_guard<std::mutex> lock(m_queue_mutex);
+            if (m_stopping) {
+                sendError(fd, 503, "server is shutting down", "server_error");
+            } else if (m_queue.size() >= m_queue_capacity) {
+                sendError(fd, 429, "too many requests are waiting, retry later", "server_busy");
+            } else {
+                m_queue.push_back(std::move(job));
+                m_queue_cv.notify_one();
+                return;  // the worker answering the job closes the connection
+            }
+        }
+    } else {
+        sendError(fd, 404, "unknown endpoint " + request.path, "invalid_request_error");
+    }
+    close(fd);
+}
+
+bool InferenceServer::readRequest(int fd, HttpRequest& request) const {
+    // a client that connects and sends nothing must not hold the connection thread forever
+    timeval timeout{ RECEIVE_TIMEOUT_S, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    std::string data;
+    char        buffer[16 * 1024];
+    size_t      header_end = std::string::npos;
+    while ((header_end = data.find("\r\n\r\n")) == std::string::npos) {
+        if (data.size() > MAX_HEADER_BYTES) {
+            return false;
+        }
+        const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            return false;
+        }
+        data.append(buffer, n);
+    }
+
+    // request line
+    const size_t line_end     = data.find("\r\n");
+    const size_t method_end   = data.find(' ');
+    const size_t target_end   = data.find(' ', method_end + 1);
+    if (method_end == std::string::npos || target_end == std::string::npos || target_end > line_end) {
+        return false;
+    }
+    request.method = data.substr(0, method_end);
+    request.path   = data.substr(method_end + 1, target_end - method_end - 1);
+    request.path   = request.path.substr(0, request.path.find('?'));
+
+    // headers, only the body length and curl's 100-continue handshake matter here
+    size_t content_length = 0;
+    bool   expect_continue = false;
+    for (size_t pos = line_end + 2; pos < header_end;) {
+        const size_t end   = data.find("\r\n", pos);
+        const size_t colon = data.find(':', pos);
+        if (colon != std::string::npos && colon < end) {
+            std::string name  = data.substr(pos, colon - pos);
+            std::string value = data.substr(colon + 1, end - colon - 1);
+            std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) {
+                return std::tolower(c);
+            });
+            value.erase(0, value.find_first_not_of(" \t"));
+            if (name == "content-length") {
+                content_length = std::strtoull(value.c_str(), nullptr, 10);
+            } else if (name == "expect" && value.starts_with("100-continue")) {
+                expect_continue = true;
+            } else if (name == "transfer-encoding") {
+                return false;  // chunked request bodies are not supported
+            }
+        }
+        pos = end + 2;
+    }
+    if (content_length > MAX_BODY_BYTES) {
+        return false;
+    }
+
+    request.body = data.substr(header_end + 4);
+    if (expect_continue && request.body.size() < content_length && !sendAll(fd, "HTTP/1.1 100 Continue\r\n\r\n")) {
+        return false;
+    }
+    while (request.body.size() < content_length) {
+        const ssize_t n = recv(fd, buffer, std::min(sizeof(buffer), content_length - request.body.size()), 0);
+        if (n <= 0) {
+            return false;
+        }
+        request.body.append(buffer, n);
+    }
+    request.body.resize(content_length);
+    return true;
+}
+
+bool InferenceServer::parseChatRequest(const std::string& body, Job& job, std::string& error) const {
+    JsonValue root;
+    if (!JsonValue::parse(body, root) || root.type() != JsonValue::Type::OBJECT) {
+        error = "request body is not a JSON object";
+        return false;
+    }
+    // a served adapter is picked by name, any other model name is answered with the base weights
+    job.model = m_model_name;
+    if (const JsonValue* model = root.find("model"); model && model->type() == JsonValue::Type::STRING) {
+        for (const auto& adapter : m_adapters) {
+            if (adapter.first == model->asString()) {
+                job.model   = adapter.first;
+                job.adapter = adapter.second;
+            }
+        }
+    }
+
+    const JsonValue* messages = root.find("messages");
+    if (!messages || messages->type() != JsonValue::Type::ARRAY || messages->items().empty()) {
+        error = "'messages' must be a non-empty array";
+        return false;
+    }
+
+    // fold the messages into exchanges, consecutive messages with the same role are joined
+    std::string user;
+    std::string assistant;
+    bool        have_user      = false;
+    bool        have_assistant = false;
+    for (const auto& message : messages->items()) {
+        const JsonValue* role_value    = message.find("role");
+        const JsonValue* content_value = message.find("content");
+        const std::string role         = role_value ? role_value->asString() : "";
+
+        // content is either a string or a list of parts, of which only text parts are supported
+        std::string content;
+        if (content_value && content_value->type() == JsonValue::Type::ARRAY) {
+            for (const auto& part : content_value->items()) {
+                const JsonValue* text = part.find("text");
+                if (!text || text->type() != JsonValue::Type::STRING) {
+                    error = "only text content parts are supported";
+                    return false;
+                }
+                content += text->asString();
+            }
+        } else if (content_value && content_value->type() == JsonValue::Type::STRING) {
+            content = content_value->asString();
+        } else if (content_value && content_value->type() != JsonValue::Type::NUL) {
+            error = "message content must be a string or a list of text parts";
+            return false;
+        }
+
+        if (role == "system" || role == "developer") {
+            if (have_user || !job.turns.empty()) {
+                error = "system messages must come before the conversation";
+                return false;
+            }
+            job.system_prompt += (job.system_prompt == "" ? "" : "\n") + content;
+        } else if (role == "user") {
+            if (have_assistant) {
+                job.turns.emplace_back(std::move(user), std::move(assistant));
+                user.clear();
+                assistant.clear();
+                have_user      = false;
+                have_assistant = false;
+            }
+            user += (have_user ? "\n" : "") + content;
+            have_user = true;
+        } else if (role == "assistant") {
+            if (!have_user) {
+                error = "an assistant message must follow a user message";
+                return false;
+            }
+            assistant += (have_assistant ? "\n" : "") + content;
+            have_assistant = true;
+        } else {
+            error = "unsupported message role '" + role + "'";
+            return false;
+        }
+    }
+    if (!have_user || have_assistant) {
+        error = "the last message must be from the user";
+        return false;
+    }
+    job.prompt = std::move(user);
+
+    // sampling options
+    if (const JsonValue* stream = root.find("stream")) {
+        job.stream = stream->asBool();
+    }
+    const JsonValue* max_tokens = root.find("max_completion_tokens") ? root.find("max_completion_tokens") : root.find("max_tokens");
+    if (max_tokens && max_tokens->type() != JsonValue::Type::NUL) {
+        if (max_tokens->asNumber() < 1) {
+            error = "max_tokens must be at least 1";
+            return false;
+        }
+        job.max_tokens = (int32_t)std::min(max_tokens->asNumber(), (double)INT32_MAX);
+    }
+    if (const JsonValue* stop = root.find("stop")) {
+        if (stop->type() == JsonValue::Type::STRING) {
+            job.stop.push_back(stop->asString());
+        } else if (stop->type() == JsonValue::Type::ARRAY) {
+            for (const auto& item : stop->items()) {
+                if (item.type() != JsonValue::Type::STRING) {
+                    error = "stop must be a string or a list of strings";
+                    return false;
+                }
+                job.stop.push_back(item.asString());
+            }
+        }
+    }
+    if (const JsonValue* temperature = root.find("temperature"); temperature && temperature->type() == JsonValue::Type::NUMBER) {
+        job.temperature = std::max(0.0, temperature->asNumber());
+    }
+    if (const JsonValue* seed = root.find("seed"); seed && seed->type() == JsonValue::Type::NUMBER) {
+        job.seed = (int64_t)seed->asNumber() & 0xFFFFFFFF;
+    }
+
+    // constrained output, a GBNF grammar or a JSON response format
+    if (const JsonValue* grammar = root.find("grammar"); grammar && grammar->type() == JsonValue::Type::STRING) {
+        job.grammar = grammar->asString();
+    }
+    if (const JsonValue* format = root.find("response_format"); format && format->type() == JsonValue::Type::OBJECT) {
+        const JsonValue*  type        = format->find("type");
+        const std::string format_type = type ? type->asString() : "text";
+        if (format_type == "json_object") {
+            job.grammar = JsonSchemaGrammar::anyObject();
+        } else if (format_type == "json_schema") {
+            const JsonValue* json_schema = format->find("json_schema");
+            const JsonValue* schema      = json_schema ? json_schema->find("schema") : nullptr;
+            if (!schema) {
+                error = "response_format json_schema must have a schema";
+                return false;
+            }
+            if (!JsonSchemaGrammar::convert(schema->dump(), job.grammar, error)) {
+                return false;
+            }
+        } else if (format_type != "text") {
+            error = "response_format type must be text, json_object or json_schema";
+            return false;
+        }
+    }
+    return true;
+}
+
+void InferenceServer::workerLoop(Engine& engine) {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_queue_mutex);
+            m_queue_cv.wait(lock, [this]() {
+                return m_stopping || !m_queue.empty();
+            });
+            if (m_stopping) {
+                return;  // the destructor rejects whatever is still queued
+            }
+            job = std::move(m_queue.front());
+            m_queue.pop_front();
+            ++m_active_jobs;
+        }
+
+        processJob(engine, job);
+        close(job.fd);
+
+        std::lock_guard<std::mutex> lock(m_queue_mutex);
+        --m_active_jobs;
+    }
+}
+
+void InferenceServer::processJob(Engine& engine, Job& job) {
+    LLM& llm = *engine.llm;
+
+    // switching adapters re-evaluates the engine's chat, so clear it first as it is replaced anyway
+    if (job.adapter != llm.getAdapter()) {
+        llm.clearChat();
+        engine.turns.clear();
+        if (!llm.setAdapter(job.adapter)) {
+            sendError(job.fd, 500, "could not load the adapter of model '" + job.model + "'", "server_error");
+            return;
+        }
+    }
+
+    // a new system prompt rebuilds the prefix cache and starts an empty chat
+    if (job.system_prompt != engine.system_prompt) {
+        llm.setSystemPrompt(job.system_prompt);
+        engine.system_prompt = job.system_prompt;
+        engine.turns.clear();
+    }
+
+    // keep the engine's chat if the request continues it, otherwise replace it and let the engine keep the cells up to the first edit
+    const bool continues = engine.turns.size() <= job.turns.size() && std::equal(engine.turns.begin(), engine.turns.end(), job.turns.begin());
+    if (!continues) {
+        engine.turns.clear();
+        if (!llm.setChat(job.turns)) {
+            sendError(job.fd, 400, "the conversation does not fit in the context", "context_length_exceeded");
+            return;
+        }
+        engine.turns = job.turns;
+    }
+    for (size_t i = engine.turns.size(); i < job.turns.size(); ++i) {
+        if (!llm.addTurn(job.turns[i].first, job.turns[i].second)) {
+            llm.clearChat();
+            engine.turns.clear();
+            sendError(job.fd, 400, "the conversation does not fit in the context", "context_length_exceeded");
+            return;
+        }
+        engine.turns.push_back(job.turns[i]);
+    }
+
+    // sampling settings apply to this request only
+    llm.setTemperature(job.temperature >= 0.0f ? job.temperature : DEFAULT_TEMPERATURE);
+    llm.setSeed(job.seed >= 0 ? (uint32_t)job.seed : LLAMA_DEFAULT_SEED);
+    ChatOptions options;
+    options.max_tokens = job.max_tokens;
+    options.stop       = job.stop;
+    options.grammar    = job.grammar;
+    std::string grammar_error;
+    if (!llm.checkGrammar(options, &grammar_error)) {
+        sendError(job.fd, 400, grammar_error, "invalid_request_error");
+        return;
+    }
+
+    const int64_t created = std::time(nullptr);
+    auto          chunk   = [&](JsonValue delta, const char* finish_reason) {
+        JsonValue choice;
+        choice["index"]         = 0;
+        choice["delta"]         = std::move(delta);
+        choice["finish_reason"] = finish_reason ? JsonValue(finish_reason) : JsonValue();
+        JsonValue event;
+        event["id"]      = job.id;
+        event["object"]  = "chat.completion.chunk";
+        event["created"] = created;
+        event["model"]   = job.model;
+        event["choices"].push(std::move(choice));
+        return "data: " + event.dump() + "\n\n";
+    };
+
+    // pieces are streamed from the LLM worker thread while this thread watches for the client going away
+    std::atomic<bool> connected = true;
+    if (job.stream) {
+        JsonValue role;
+        role["role"] = "assistant";
+        connected    = sendAll(job.fd, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n") && sendAll(job.fd, chunk(std::move(role), nullptr));
+        options.on_piece = [&](const std::string& piece) {
+            if (connected) {
+                JsonValue delta;
+                delta["content"] = piece;
+                connected        = sendAll(job.fd, chunk(std::move(delta), nullptr));
+            }
+        };
+    }
+    ChatHandle handle = llm.getChatResponseAsync(job.prompt, options);
+    while (!handle.waitFor(std::chrono::milliseconds(POLL_INTERVAL_MS))) {
+        if (!connected || clientClosed(job.fd)) {
+            handle.cancel();
+        }
+    }
+    const ChatResult result = handle.get();
+    engine.turns.emplace_back(job.prompt, result.text);
+    if (m_debug_level > 0 && result.finish_reason == FinishReason::CANCELLED) {
+        std::cout << job.id << " cancelled, client disconnected" << std::endl;
+    }
+
+    // the chat sequence holds the whole conversation followed by the reply, only the new part of it was prefilled
+    const TurnMetrics& metrics       = llm.getTurnMetrics();
+    const uint32_t     prompt_tokens = metrics.kv_cells_used > metrics.sampled_tokens ? metrics.kv_cells_used - metrics.sampled_tokens : metrics.prompt_tokens;
+    const char*        finish_reason = result.finish_reason == FinishReason::LENGTH || result.finish_reason == FinishReason::CONTEXT_FULL ? "length" : "stop";
+
+    if (job.stream) {
+        sendAll(job.fd, chunk(JsonValue::object(), finish_reason) + "data: [DONE]\n\n");
+        return;
+    }
+
+    JsonValue message;
+    message["role"]    = "assistant";
+    message["content"] = result.text;
+    JsonValue choice;
+    choice["index"]         = 0;
+    choice["message"]       = std::move(message);
+    choice["finish_reason"] = finish_reason;
+    JsonValue usage;
+    usage["prompt_tokens"]                         = (uint64_t)prompt_tokens;
+    usage["completion_tokens"]                     = (uint64_t)metrics.sampled_tokens;
+    usage["total_tokens"]                          = (uint64_t)(prompt_tokens + metrics.sampled_tokens);
+    usage["prompt_tokens_details"]["cached_tokens"] = (uint64_t)(prompt_tokens - std::min(prompt_tokens, metrics.prompt_tokens));
+    JsonValue completion;
+    completion["id"]      = job.id;
+    completion["object"]  = "chat.completion";
+    completion["created"] = created;
+    completion["model"]   = job.model;
+    completion["choices"].push(std::move(choice));
+    completion["usage"] = std::move(usage);
+    sendResponse(job.fd, 200, "application/json", completion.dump());
+}
+
+bool InferenceServer::clientClosed(int fd) {
+    pollfd poll_fd{ fd, POLLRDHUP, 0 };
+    return poll(&poll_fd, 1, 0) > 0 && (poll_fd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+bool InferenceServer::sendAll(int fd, std::string_view data) {
+    while (!data.empty()) {
+        // no SIGPIPE if the client has closed the connection
+        const ssize_t n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data.remove_prefix(n);
+    }
+    return true;
+}
+
+void InferenceServer::sendResponse(int fd, int status, std::string_view content_type, std::string_view body) {
+    const char* reason = "Error";
+    switch (status) {
+        case 200:
+            reason = "OK";
+            break;
+        case 400:
+            reason = "Bad Request";
+            break;
+        case 404:
+            reason = "Not Found";
+            break;
+        case 405:
+            reason = "Method Not Allowed";
+            break;
+        case 429:
+            reason = "Too Many Requests";
+            break;
+        case 503:
+            reason = "Service Unavailable";
+            break;
+    }
+
+    std::string response = "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n";
+    response += "Content-Type: " + std::string(content_type) + "\r\n";
+    response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    if (status == 429 || status == 503) {
+        response += "Retry-After: 1\r\n";
+    }
+    response += "Connection: close\r\n\r\n";
+    response += body;
+    sendAll(fd, response);
+}
+
+void InferenceServer::sendError(int fd, int status, const std::string& message, const std::string& type) {
+    JsonValue error;
+    error["error"]["message"] = message;
+    error["error"]["type"]    = type;
+    sendResponse(fd, status, "application/json", error.dump());
+}
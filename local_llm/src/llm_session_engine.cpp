@@ -0,0 +1,329 @@
+#include "llm_session_engine.hpp"
+#include "llm_model_registry.hpp"
+#include <algorithm>
+#include <iostream>
+#include <chrono>
+
+SessionEngine::SessionEngine(std::string model_path, int max_sessions, int n_ctx, float temperature, uint8_t debug_level, EngineConfig engine_config) {
+
+    m_debug_level = debug_level;
+    m_temperature = std::clamp(temperature, 0.1f, 1.0f);
+
+    if (m_debug_level < 2) {
+        // only print errors
+        llama_log_set([](enum ggml_log_level level, const char* text, void* /* user_data */) {
+            if (level >= GGML_LOG_LEVEL_ERROR) {
+                fprintf(stderr, "%s", text);
+            }
+        },
+                      nullptr);
+    }
+
+    // load model, or share the weights of an instance that already loaded it
+    ModelRegistry::instance().initBackend(engine_config.numa);
+    m_model_handle = ModelRegistry::instance().acquire(model_path, engine_config.n_gpu_layers);
+    m_model        = m_model_handle.get();
+    if (!m_model) {
+        std::cout << "Model initialization failed" << std::endl;
+        std::exit(1);
+    }
+    m_vocab         = llama_model_get_vocab(m_model);
+    m_tokenizer.setVocab(m_vocab);
+    m_chat_template = llama_model_chat_template(m_model, nullptr);
+
+    // setup context with one sequence per session sharing a single KV buffer
+    auto context_parameters       = llama_context_default_params();
+    context_parameters.n_ctx      = n_ctx;
+    context_parameters.n_seq_max  = max_sessions;
+    context_parameters.kv_unified = true;  // sessions draw from the whole context rather than n_ctx / max_sessions each
+    m_engine_config               = engine_config.resolved(n_ctx);
+    if (engine_config.n_batch == 0) {
+        m_engine_config.n_batch  = std::min(m_engine_config.n_ctx, 2048u);  // decode tokens plus prefill chunks per step
+        m_engine_config.n_ubatch = std::min(m_engine_config.n_ubatch, m_engine_config.n_batch);
+    }
+    m_engine_config.apply(context_parameters);
+    m_context = llama_init_from_model(m_model, context_parameters);
+    if (!m_context) {
+        std::cout << "model context initialization failed!" << std::endl;
+        std::exit(1);
+    }
+    if (m_debug_level > 0) {
+        std::cout << "context: " << llama_n_ctx(m_context) << " tokens for " << max_sessions << " sessions, KV cache " << ggml_type_name(m_engine_config.type_k) << "/" << ggml_type_name(m_engine_config.type_v) << " estimated " << estimatedKvCacheBytes() / (1024.0 * 1024.0) << " MiB" << std::endl;
+    }
+
+    m_batch = llama_batch_init(llama_n_batch(m_context), 0, 1);
+
+    // setup session slots
+    m_sessions.resize(max_sessions);
+    for (int i = 0; i < max_sessions; ++i) {
+        m_sessions[i].seq_id  = i;
+        m_sessions[i].sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
+        llama_sampler_chain_add(m_sessions[i].sampler, llama_sampler_init_min_p(0.05f, 1));  // filter low probability noise
+        llama_sampler_chain_add(m_sessions[i].sampler, llama_sampler_init_temp(m_temperature));  // level of creativity
+        llama_sampler_chain_add(m_sessions[i].sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    }
+}
+
+SessionEngine::~SessionEngine() {
+    for (auto& session : m_sessions) {
+        llama_sampler_free(session.sampler);
+    }
+    llama_batch_free(m_batch);
+    llama_free(m_context);
+}
+
+int SessionEngine::openSession() {
+    for (auto& session : m_sessions) {
+        if (session.state == SessionState::FREE) {
+            session.state              = SessionState::IDLE;
+            session.n_past             = 0;
+            session.prev_prompt_length = 0;
+            session.response_ready     = false;
+            session.chat.setTemplate(m_chat_template);
+            session.response.clear();
+            llama_sampler_reset(session.sampler);
+            return session.seq_id;
+        }
+    }
+    return -1;
+}
+
+void SessionEngine::closeSession(int session_id) {
+    if (session_id < 0 || session_id >= (int)m_sessions.size()) {
+        return;
+    }
+    Session& session = m_sessions[session_id];
+    llama_memory_seq_rm(llama_get_memory(m_context), session.seq_id, -1, -1);
+    session.state = SessionState::FREE;
+    session.prompt_tokens.clear();
+}
+
+bool SessionEngine::submit(int session_id, const std::string& prompt, int32_t max_tokens) {
+    if (session_id < 0 || session_id >= (int)m_sessions.size() || m_sessions[session_id].state != SessionState::IDLE) {
+        return false;
+    }
+    Session& session = m_sessions[session_id];
+    if (!preparePrompt(session, prompt)) {
+        return false;
+    }
+    session.state          = SessionState::PREFILL;
+    session.last_used      = ++m_use_counter;
+    session.prefill_offset = 0;
+    session.max_tokens     = max_tokens;
+    session.n_generated    = 0;
+    session.response.clear();
+    session.response_ready = false;
+    return true;
+}
+
+bool SessionEngine::preparePrompt(Session& session, const std::string& prompt) {
+    // format only the new message and keep the part the model has not seen yet
+    if (session.chat.append("user", prompt, true) < 0) {
+        std::cout << "could not apply chat template!" << std::endl;
+        return false;
+    }
+    std::string input          = session.chat.formatted().substr(std::min(session.prev_prompt_length, session.chat.formatted().size()));
+    session.prev_prompt_length = session.chat.formatted().size();
+
+    // tokenize, adding BOS at the start of the sequence
+    const bool is_first = session.n_past == 0;
+    return m_tokenizer.tokenize(input, is_first, session.prompt_tokens) && !session.prompt_tokens.empty();
+}
+
+void SessionEngine::finishTurn(Session& session, FinishReason reason) {
+    // the model has seen the reply itself but not the template text closing it
+    const size_t reply_start = session.chat.formatted().size();
+    session.chat.append("assistant", session.response, false);
+    const size_t reply_offset  = session.chat.formatted().find(session.response, reply_start);
+    session.prev_prompt_length = reply_offset != std::string::npos ? reply_offset + session.response.size() : session.chat.formatted().size();
+
+    session.prompt_tokens.clear();
+    session.state          = SessionState::IDLE;
+    session.response_ready = true;
+    session.finish_reason  = reason;
+}
+
+void SessionEngine::resetSession(Session& session) {
+    llama_memory_seq_rm(llama_get_memory(m_context), session.seq_id, -1, -1);
+    session.chat.clear();
+    session.n_past             = 0;
+    session.prev_prompt_length = 0;
+    session.prompt_tokens.clear();
+    session.state = SessionState::IDLE;
+}
+
+void SessionEngine::addToBatch(llama_token token, llama_pos pos, llama_seq_id seq_id, bool output) {
+    m_batch.token[m_batch.n_tokens]     = token;
+    m_batch.pos[m_batch.n_tokens]       = pos;
+    m_batch.n_seq_id[m_batch.n_tokens]  = 1;
+    m_batch.seq_id[m_batch.n_tokens][0] = seq_id;
+    m_batch.logits[m_batch.n_tokens]    = output;
+    m_batch.n_tokens++;
+}
+
+bool SessionEngine::step() {
+    const int n_batch = llama_n_batch(m_context);
+
+    // number of tokens each session adds to the batch this step
+    std::vector<int> added(m_sessions.size(), 0);
+
+    m_batch.n_tokens = 0;
+
+    // one token for every generating session first, these are latency critical
+    for (auto& session : m_sessions) {
+        session.batch_index = -1;
+        if (session.state == SessionState::DECODE) {
+            session.batch_index = m_batch.n_tokens;
+            addToBatch(session.next_token, session.n_past, session.seq_id, true);
+            added[session.seq_id] = 1;
+        }
+    }
+
+    // fill the rest of the batch with prefill chunks, starting from a rotating session so no request starves
+    for (size_t offset = 0; offset < m_sessions.size() && m_batch.n_tokens < n_batch; ++offset) {
+        Session& session = m_sessions[(m_next_prefill + offset) % m_sessions.size()];
+        if (session.state != SessionState::PREFILL) {
+            continue;
+        }
+        const size_t remaining = session.prompt_tokens.size() - session.prefill_offset;
+        const size_t chunk     = std::min(remaining, (size_t)(n_batch - m_batch.n_tokens));
+        for (size_t i = 0; i < chunk; ++i) {
+            const size_t token_index = session.prefill_offset + i;
+            const bool   last        = token_index + 1 == session.prompt_tokens.size();
+            if (last) {
+                session.batch_index = m_batch.n_tokens;
+            }
+            addToBatch(session.prompt_tokens[token_index], session.n_past + i, session.seq_id, last);
+        }
+        added[session.seq_id] = chunk;
+    }
+    m_next_prefill = (m_next_prefill + 1) % m_sessions.size();
+
+    if (m_batch.n_tokens == 0) {
+        return false;
+    }
+
+    const int ret = llama_decode(m_context, m_batch);
+    if (ret == 1) {
+        // no space left in the KV cache, idle conversations give up their history first, least recently used, then retry next step
+        Session* coldest = nullptr;
+        for (auto& session : m_sessions) {
+            if (session.state == SessionState::IDLE && session.n_past > 0 && (!coldest || session.last_used < coldest->last_used)) {
+                coldest = &session;
+            }
+        }
+        if (coldest) {
+            if (m_debug_level > 0) {
+                std::cout << "context full, clearing the history of idle session " << coldest->seq_id << std::endl;
+            }
+            resetSession(*coldest);
+            return true;
+        }
+
+        // only active requests hold cells, end the largest conversation
+        auto largest = std::max_element(m_sessions.begin(), m_sessions.end(), [](const Session& a, const Session& b) {
+            return (a.state == SessionState::PREFILL || a.state == SessionState::DECODE ? a.n_past : -1) < (b.state == SessionState::PREFILL || b.state == SessionState::DECODE ? b.n_past : -1);
+        });
+        if (m_debug_level > 0) {
+            std::cout << "context full, resetting session " << largest->seq_id << std::endl;
+        }
+        resetSession(*largest);
+        largest->response_ready = true;
+        largest->finish_reason  = FinishReason::CONTEXT_FULL;
+        return true;
+    } else if (ret != 0) {
+        // the batch could not be evaluated, end the turns it held rather than the process
+        std::cout << "decode failure, ending the turns in the batch" << std::endl;
+        for (auto& session : m_sessions) {
+            if (added[session.seq_id] > 0) {
+                resetSession(session);
+                session.response_ready = true;
+                session.finish_reason  = FinishReason::DECODE_ERROR;
+            }
+        }
+        return true;
+    }
+
+    // advance sessions and sample the next token for those that produced output
+    for (auto& session : m_sessions) {
+        if (added[session.seq_id] == 0) {
+            continue;
+        }
+        session.n_past += added[session.seq_id];
+        if (session.state == SessionState::PREFILL) {
+            session.prefill_offset += added[session.seq_id];
+        }
+        if (session.batch_index < 0) {
+            continue;
+        }
+
+        const llama_token new_token_id = llama_sampler_sample(session.sampler, m_context, session.batch_index);
+        if (llama_vocab_is_eog(m_vocab, new_token_id)) {
+            finishTurn(session, FinishReason::END_OF_TEXT);
+            continue;
+        } else if (session.max_tokens >= 0 && session.n_generated >= (uint32_t)session.max_tokens) {
+            finishTurn(session, FinishReason::LENGTH);
+            continue;
+        } else if (session.n_past >= (llama_pos)llama_n_ctx(m_context)) {
+            finishTurn(session, FinishReason::CONTEXT_FULL);
+            continue;
+        }
+
+        char char_buffer[256];
+        int  n = llama_token_to_piece(m_vocab, new_token_id, char_buffer, sizeof(char_buffer), 0, true);
+        session.response.append(char_buffer, std::max(n, 0));
+        ++session.n_generated;
+        session.next_token = new_token_id;
+        session.state      = SessionState::DECODE;
+    }
+
+    return true;
+}
+
+void SessionEngine::run() {
+    auto run_start = std::chrono::steady_clock::now();
+    int  steps     = 0;
+
+    while (step()) {
+        ++steps;
+    }
+
+    if (m_debug_level > 0) {
+        std::cout << "engine steps: " << steps << ", time: " << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - run_start).count() << " ms" << std::endl;
+    }
+}
+
+bool SessionEngine::isBusy(int session_id) const {
+    if (session_id < 0 || session_id >= (int)m_sessions.size()) {
+        return false;
+    }
+    return m_sessions[session_id].state == SessionState::PREFILL || m_sessions[session_id].state == SessionState::DECODE;
+}
+
+std::string SessionEngine::takeResponse(int session_id) {
+    if (session_id < 0 || session_id >= (int)m_sessions.size() || !m_sessions[session_id].response_ready) {
+        return "";
+    }
+    m_sessions[session_id].response_ready = false;
+    return std::move(m_sessions[session_id].response);
+}
+
+FinishReason SessionEngine::finishReason(int session_id) const {
+    if (session_id < 0 || session_id >= (int)m_sessions.size()) {
+        return FinishReason::END_OF_TEXT;
+    }
+    return m_sessions[session_id].finish_reason;
+}
+
+uint32_t SessionEngine::generatedTokens(int session_id) const {
+    if (session_id < 0 || session_id >= (int)m_sessions.size()) {
+        return 0;
+    }
+    return m_sessions[session_id].n_generated;
+}
+
+int SessionEngine::busySessions() const {
+    return std::count_if(m_sessions.begin(), m_sessions.end(), [](const Session& session) {
+        return session.state == SessionState::PREFILL || session.state == SessionState::DECODE;
+    });
+}
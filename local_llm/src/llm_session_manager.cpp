@@ -0,0 +1,244 @@
+#include "llm_session_manager.hpp"
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <iterator>
+#include <chrono>
+
+SessionManager::SessionManager(std::vector<LLM*> engines, size_t ram_budget, std::string disk_path, uint8_t debug_level) {
+    m_slots.resize(engines.size());
+    for (size_t i = 0; i < engines.size(); ++i) {
+        m_slots[i].llm = engines[i];
+    }
+    m_ram_budget  = ram_budget;
+    m_disk_path   = disk_path;
+    m_debug_level = debug_level;
+
+    std::error_code error;
+    if (m_disk_path != "" && !std::filesystem::create_directories(m_disk_path, error) && error) {
+        std::cout << "could not create session directory " << m_disk_path << ", sessions beyond the memory budget are discarded" << std::endl;
+        m_disk_path.clear();
+    }
+}
+
+SessionManager::~SessionManager() {
+    std::error_code error;
+    for (const auto& [session_id, parked] : m_parked) {
+        if (parked.file != "") {
+            std::filesystem::remove(parked.file, error);
+        }
+    }
+}
+
+ChatResult SessionManager::chat(const std::string& session_id, std::string prompt, const ChatOptions& options) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // wait for the engine holding the session, or for an idle engine to move the session into
+    Slot* slot = nullptr;
+    m_cv.wait(lock, [&]() {
+        slot = nullptr;
+        if (m_moving.contains(session_id)) {
+            return false;
+        }
+        for (auto& candidate : m_slots) {
+            if (candidate.session_id == session_id) {
+                slot = candidate.busy ? nullptr : &candidate;
+                return slot != nullptr;
+            }
+        }
+        for (auto& candidate : m_slots) {
+            if (!candidate.busy && (!slot || candidate.last_used < slot->last_used)) {
+                slot = &candidate;
+            }
+        }
+        return slot != nullptr;
+    });
+    const uint64_t evicted_last_used = slot->last_used;
+    slot->busy                       = true;
+    slot->last_used                  = ++m_use_counter;
+
+    if (slot->session_id != session_id) {
+        // claim both sessions so concurrent chats for either wait until the move is done
+        const std::string evicted_id = slot->session_id;
+        Parked            restored;
+        if (auto parked = m_parked.find(session_id); parked != m_parked.end()) {
+            restored = std::move(parked->second);
+            m_ram_bytes -= restored.state.size();
+            m_parked.erase(parked);
+        }
+        if (evicted_id != "") {
+            m_moving.insert(evicted_id);
+        }
+        slot->session_id = session_id;
+        lock.unlock();
+
+        // serialize the engine's session with its KV cells and restore the requested one in their place
+        auto   move_start = std::chrono::steady_clock::now();
+        Parked evicted;
+        evicted.last_used = evicted_last_used;
+        if (evicted_id != "") {
+            slot->llm->saveState(evicted.state);
+        }
+        const bool from_disk = restored.file != "";
+        if (from_disk) {
+            std::ifstream file(restored.file, std::ios::binary);
+            restored.state.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            if (!file.is_open() || file.bad()) {
+                restored.state.clear();
+            }
+            std::error_code error;
+            std::filesystem::remove(restored.file, error);
+        }
+        if (restored.state.empty()) {
+            if (from_disk) {
+                std::cout << "could not restore session " << session_id << ", starting it again" << std::endl;
+            }
+            slot->llm->clearChat();
+        } else if (!slot->llm->loadState(restored.state)) {
+            // a rejected state leaves the engine holding the evicted session's chat
+            std::cout << "could not restore session " << session_id << ", starting it again" << std::endl;
+            slot->llm->clearChat();
+        }
+        if (m_debug_level > 0) {
+            std::cout << "session " << session_id << (restored.state.empty() ? " started" : from_disk ? " restored from disk" : " restored from memory") << (evicted_id != "" ? ", session " + evicted_id + " moved to memory" : "") << " in " << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - move_start).count() << " ms" << std::endl;
+        }
+
+        lock.lock();
+        if (evicted_id != "") {
+            m_moving.erase(evicted_id);
+            m_ram_bytes += evicted.state.size();
+            m_parked[evicted_id] = std::move(evicted);
+            m_cv.notify_all();
+            enforceRamBudget(lock);
+        }
+    }
+    lock.unlock();
+
+    ChatResult result = slot->llm->getChatResponse(std::move(prompt), options);
+
+    lock.lock();
+    slot->busy = false;
+    m_cv.notify_all();
+    return result;
+}
+
+void SessionManager::closeSession(const std::string& session_id) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [&]() {
+        if (m_moving.contains(session_id)) {
+            return false;
+        }
+        for (const auto& slot : m_slots) {
+            if (slot.session_id == session_id && slot.busy) {
+                return false;
+            }
+        }
+        return true;
+    });
+
+    for (auto& slot : m_slots) {
+        if (slot.session_id == session_id) {
+            slot.llm->clearChat();
+            slot.session_id.clear();
+            slot.last_used = 0;
+        }
+    }
+    if (auto parked = m_parked.find(session_id); parked != m_parked.end()) {
+        dropParked(parked);
+    }
+}
+
+SessionTier SessionManager::tier(const std::string& session_id) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const auto& slot : m_slots) {
+        if (slot.session_id == session_id) {
+            return SessionTier::HOT;
+        }
+    }
+    if (m_moving.contains(session_id)) {
+        return SessionTier::RAM;
+    }
+    auto parked = m_parked.find(session_id);
+    if (parked == m_parked.end()) {
+        return SessionTier::NONE;
+    }
+    return parked->second.file != "" ? SessionTier::DISK : SessionTier::RAM;
+}
+
+size_t SessionManager::ramBytes() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_ram_bytes;
+}
+
+void SessionManager::enforceRamBudget(std::unique_lock<std::mutex>& lock) {
+    // take the coldest sessions in memory out of every tier until the budget is met, chats for them wait until they are on disk
+    std::vector<std::pair<std::string, Parked>> writing;
+    while (m_ram_bytes > m_ram_budget) {
+        auto coldest = m_parked.end();
+        for (auto it = m_parked.begin(); it != m_parked.end(); ++it) {
+            if (it->second.file == "" && (coldest == m_parked.end() || it->second.last_used < coldest->second.last_used)) {
+                coldest = it;
+            }
+        }
+        if (coldest == m_parked.end()) {
+            break;
+        }
+        if (m_disk_path == "") {
+            if (m_debug_level > 0) {
+                std::cout << "session " << coldest->first << " discarded, memory budget exceeded" << std::endl;
+            }
+            dropParked(coldest);
+            continue;
+        }
+        Parked& parked = coldest->second;
+        parked.file    = (std::filesystem::path(m_disk_path) / ("session_" + std::to_string(m_next_file++) + ".llms")).string();
+        m_ram_bytes   -= parked.state.size();
+        m_moving.insert(coldest->first);
+        writing.emplace_back(coldest->first, std::move(parked));
+        m_parked.erase(coldest);
+    }
+    if (writing.empty()) {
+        return;
+    }
+
+    // write the sessions in the session file format, so they could also be opened with LLM::loadSession
+    lock.unlock();
+    std::vector<bool> written(writing.size());
+    for (size_t i = 0; i < writing.size(); ++i) {
+        auto& [session_id, parked] = writing[i];
+        std::ofstream file(parked.file, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(parked.state.data()), parked.state.size());
+        written[i] = static_cast<bool>(file);
+        if (written[i]) {
+            if (m_debug_level > 0) {
+                std::cout << "session " << session_id << " moved to disk, " << parked.state.size() << " bytes" << std::endl;
+            }
+            parked.state.clear();
+            parked.state.shrink_to_fit();
+            continue;
+        }
+        std::cout << "could not write session file " << parked.file << ", session " << session_id << " discarded" << std::endl;
+        file.close();
+        std::error_code error;
+        std::filesystem::remove(parked.file, error);
+    }
+    lock.lock();
+
+    // the sessions are in the disk tier from now on
+    for (size_t i = 0; i < writing.size(); ++i) {
+        m_moving.erase(writing[i].first);
+        if (written[i]) {
+            m_parked[writing[i].first] = std::move(writing[i].second);
+        }
+    }
+    m_cv.notify_all();
+}
+
+void SessionManager::dropParked(std::unordered_map<std::string, Parked>::iterator it) {
+    if (it->second.file != "") {
+        std::error_code error;
+        std::filesystem::remove(it->second.file, error);
+    }
+    m_ram_bytes -= it->second.state.size();
+    m_parked.erase(it);
+}
@@ -0,0 +1,85 @@
+#include "llm_tokenizer.hpp"
+#include <algorithm>
+#include <thread>
+
+Tokenizer::Tokenizer(const llama_vocab* vocab) {
+    setVocab(vocab);
+}
+
+void Tokenizer::setVocab(const llama_vocab* vocab) {
+    m_vocab = vocab;
+
+    // only BPE pre-tokenizers are guaranteed to start a new token after a newline, and an EOS would end up mid-text
+    m_can_split = m_vocab && llama_vocab_type(m_vocab) == LLAMA_VOCAB_TYPE_BPE && !llama_vocab_get_add_eos(m_vocab);
+}
+
+bool Tokenizer::tokenize(std::string_view text, bool add_special, std::vector<llama_token>& tokens) {
+    if (m_can_split && text.size() >= PARALLEL_MIN_CHARS && std::thread::hardware_concurrency() > 1) {
+        return tokenizeParallel(text, add_special, tokens);
+    }
+    return tokenizeSerial(text, add_special, tokens);
+}
+
+bool Tokenizer::tokenizeSerial(std::string_view text, bool add_special, std::vector<llama_token>& tokens) {
+    // every token covers at least one byte, plus BOS/EOS and a possible leading space, so this is nearly always enough
+    tokens.resize(text.size() + 3);
+    int n_tokens = llama_tokenize(m_vocab, text.data(), text.size(), tokens.data(), tokens.size(), add_special, true);
+
+    // a negative number means the buffer is too small, it gives the required size
+    if (n_tokens < 0) {
+        tokens.resize(-n_tokens);
+        n_tokens = llama_tokenize(m_vocab, text.data(), text.size(), tokens.data(), tokens.size(), add_special, true);
+    }
+    if (n_tokens < 0) {
+        tokens.clear();
+        return false;
+    }
+
+    tokens.resize(n_tokens);
+    return true;
+}
+
+bool Tokenizer::tokenizeParallel(std::string_view text, bool add_special, std::vector<llama_token>& tokens) {
+    const size_t n_threads = std::min<size_t>(std::thread::hardware_concurrency(), text.size() / PARALLEL_CHUNK_SIZE);
+
+    // split after a newline that is followed by non-whitespace, the pre-tokenizer never joins text across such a point
+    std::vector<size_t> boundaries = { 0 };
+    const size_t        chunk_size = text.size() / n_threads;
+    for (size_t i = 1; i < n_threads; ++i) {
+        size_t split = std::max(boundaries.back(), i * chunk_size);
+        while (split + 1 < text.size() && !(text[split] == '\n' && text[split + 1] != '\n' && text[split + 1] != '\r' && text[split + 1] != ' ' && text[split + 1] != '\t')) {
+            ++split;
+        }
+        if (split + 1 >= text.size()) {
+            break;
+        }
+        boundaries.push_back(split + 1);
+    }
+    boundaries.push_back(text.size());
+
+    // tokenize each chunk into its own buffer, only the first gets BOS
+    const size_t n_chunks = boundaries.size() - 1;
+    m_chunk_tokens.resize(n_chunks);
+    std::vector<char>        chunk_success(n_chunks, false);
+    std::vector<std::thread> workers;
+    for (size_t chunk = 1; chunk < n_chunks; ++chunk) {
+        workers.emplace_back([this, &text, &boundaries, &chunk_success, chunk]() {
+            chunk_success[chunk] = tokenizeSerial(text.substr(boundaries[chunk], boundaries[chunk + 1] - boundaries[chunk]), false, m_chunk_tokens[chunk]);
+        });
+    }
+    chunk_success[0] = tokenizeSerial(text.substr(0, boundaries[1]), add_special, m_chunk_tokens[0]);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    // join the chunks
+    tokens.clear();
+    for (size_t chunk = 0; chunk < n_chunks; ++chunk) {
+        if (!chunk_success[chunk]) {
+            tokens.clear();
+            return false;
+        }
+        tokens.insert(tokens.end(), m_chunk_tokens[chunk].begin(), m_chunk_tokens[chunk].end());
+    }
+    return true;
+}
@@ -33,4 +33,44 @@ std::string ConsoleInput::getInput() {
     }
 
     return user_input;
-}
\ No newline at end of file
+}
+
+std::string Utf8StreamBuffer::push(const std::string& piece) {
+    m_pending += piece;
+
+    // find the start of the last (possibly incomplete) character by skipping back over continuation bytes
+    size_t lead = m_pending.size();
+    size_t back = 0;
+    while (lead > 0 && back < 4) {
+        --lead;
+        ++back;
+        if ((static_cast<unsigned char>(m_pending[lead]) & 0xC0) != 0x80) {
+            break;
+        }
+    }
+
+    // work out how long the sequence starting at the lead byte should be
+    size_t              complete_length = m_pending.size();
+    const unsigned char lead_byte       = m_pending.empty() ? 0 : static_cast<unsigned char>(m_pending[lead]);
+    size_t              expected        = 1;
+    if ((lead_byte & 0xE0) == 0xC0) {
+        expected = 2;
+    } else if ((lead_byte & 0xF0) == 0xE0) {
+        expected = 3;
+    } else if ((lead_byte & 0xF8) == 0xF0) {
+        expected = 4;
+    }
+    if (back < expected) {
+        complete_length = lead;
+    }
+
+    std::string complete = m_pending.substr(0, complete_length);
+    m_pending.erase(0, complete_length);
+    return complete;
+}
+
+std::string Utf8StreamBuffer::flush() {
+    std::string remaining;
+    remaining.swap(m_pending);
+    return remaining;
+}
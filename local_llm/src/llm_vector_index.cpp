@@ -0,0 +1,580 @@
+#include "llm_vector_index.hpp"
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <queue>
+#include <cmath>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+VectorIndex::VectorIndex(EmbeddingPooling pooling) {
+    m_pooling = pooling;
+    m_dot     = selectDot();
+    refreshViews();
+}
+
+VectorIndex::~VectorIndex() {
+    unmap();
+}
+
+bool VectorIndex::addDocuments(LLM& llm, std::span<const std::string> documents) {
+    if (documents.empty()) {
+        return true;
+    }
+    EmbeddingMatrix embeddings = llm.embed(documents, m_pooling, true);
+    return embeddings.rows == documents.size() && add(embeddings, documents);
+}
+
+bool VectorIndex::add(const EmbeddingMatrix& embeddings, std::span<const std::string> documents) {
+    if (embeddings.rows != documents.size() || embeddings.dim == 0 || (m_dim != 0 && embeddings.dim != m_dim)) {
+        return false;
+    }
+    materialize();
+    m_dim = embeddings.dim;
+
+    // append unit length embeddings and the document text
+    const size_t first = m_count;
+    m_owned_vectors.insert(m_owned_vectors.end(), embeddings.values.begin(), embeddings.values.begin() + embeddings.rows * embeddings.dim);
+    for (size_t row = 0; row < embeddings.rows; ++row) {
+        float*       embedding = m_owned_vectors.data() + (first + row) * m_dim;
+        const double norm      = std::sqrt((double)dotScalar(embedding, embedding, m_dim));
+        if (norm > 0.0) {
+            std::transform(embedding, embedding + m_dim, embedding, [norm](float value) { return (float)(value / norm); });
+        }
+        m_owned_text.append(documents[row]);
+        m_owned_text_offsets.push_back(m_owned_text.size());
+    }
+    m_count += embeddings.rows;
+    refreshViews();
+
+    // keep the graph covering every document
+    if (m_has_graph) {
+        for (size_t id = first; id < m_count; ++id) {
+            insertNode(id);
+        }
+    }
+    return true;
+}
+
+void VectorIndex::buildGraph(uint32_t max_neighbors, uint32_t ef_construction) {
+    materialize();
+
+    m_max_neighbors   = std::max(2u, max_neighbors);
+    m_ef_construction = std::max(ef_construction, m_max_neighbors);
+    m_entry_point     = NO_NODE;
+    m_max_level       = 0;
+    m_level_rng       = 0x9E3779B97F4A7C15;
+    m_owned_levels.clear();
+    m_owned_links.clear();
+    m_owned_upper_offsets.clear();
+    m_owned_upper_links.clear();
+    m_has_graph = true;
+
+    for (size_t id = 0; id < m_count; ++id) {
+        insertNode(id);
+    }
+}
+
+std::vector<SearchResult> VectorIndex::search(const float* query, size_t top_k, uint32_t ef_search) const {
+    if (!m_has_graph || m_entry_point == NO_NODE) {
+        return searchExact(query, top_k);
+    }
+    if (top_k == 0) {
+        return {};
+    }
+
+    // greedy descent through the upper layers, then a wide search of the bottom layer
+    uint32_t entry = m_entry_point;
+    for (uint32_t level = m_max_level; level > 0; --level) {
+        entry = searchLayer(query, entry, 1, level).front().id;
+    }
+    std::vector<SearchResult> results = searchLayer(query, entry, std::max<size_t>(ef_search, top_k), 0);
+    results.resize(std::min(top_k, results.size()));
+    return results;
+}
+
+std::vector<SearchResult> VectorIndex::searchExact(const float* query, size_t top_k) const {
+    // keep the best results in a min-heap so each document costs one comparison with the worst kept result
+    auto further = [](const SearchResult& a, const SearchResult& b) {
+        return a.score > b.score;
+    };
+    std::priority_queue<SearchResult, std::vector<SearchResult>, decltype(further)> best(further);
+    for (uint32_t id = 0; id < m_count && top_k > 0; ++id) {
+        const float score = m_dot(query, vector(id), m_dim);
+        if (best.size() < top_k) {
+            best.push({ id, score });
+        } else if (score > best.top().score) {
+            best.pop();
+            best.push({ id, score });
+        }
+    }
+
+    std::vector<SearchResult> results(best.size());
+    for (size_t i = results.size(); i > 0; --i) {
+        results[i - 1] = best.top();
+        best.pop();
+    }
+    return results;
+}
+
+std::string_view VectorIndex::document(uint32_t id) const {
+    if (id >= m_count) {
+        return {};
+    }
+    return std::string_view(m_text + m_text_offsets[id], m_text_offsets[id + 1] - m_text_offsets[id]);
+}
+
+bool VectorIndex::save(const std::string& path) const {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cout << "could not open index file '" << path << "' for writing!" << std::endl;
+        return false;
+    }
+
+    // lay out the sections at 64 byte boundaries so they can be used in place once mapped
+    auto align = [](uint64_t offset) {
+        return (offset + 63) & ~(uint64_t)63;
+    };
+    FileHeader header          = {};
+    header.magic               = INDEX_MAGIC;
+    header.version             = INDEX_VERSION;
+    header.dim                 = m_dim;
+    header.pooling             = (uint32_t)m_pooling;
+    header.count               = m_count;
+    header.has_graph           = m_has_graph;
+    header.max_neighbors       = m_max_neighbors;
+    header.ef_construction     = m_ef_construction;
+    header.entry_point         = m_entry_point;
+    header.max_level           = m_max_level;
+    header.vectors_offset      = align(sizeof(FileHeader));
+    header.text_offsets_offset = align(header.vectors_offset + m_count * m_dim * sizeof(float));
+    header.text_offset         = align(header.text_offsets_offset + (m_count + 1) * sizeof(uint64_t));
+    uint64_t end               = header.text_offset + m_text_offsets[m_count];
+    if (m_has_graph) {
+        header.levels_offset        = align(end);
+        header.links_offset         = align(header.levels_offset + m_count);
+        header.upper_offsets_offset = align(header.links_offset + m_count * 2 * m_max_neighbors * sizeof(uint32_t));
+        header.upper_links_offset   = align(header.upper_offsets_offset + m_count * sizeof(uint64_t));
+        header.upper_links_count    = m_upper_links_count;
+    }
+
+    auto write_section = [&file](uint64_t offset, const void* data, size_t size) {
+        static const char padding[64] = {};
+        file.write(padding, offset - (uint64_t)file.tellp());
+        file.write(reinterpret_cast<const char*>(data), size);
+    };
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    write_section(header.vectors_offset, m_vectors, m_count * m_dim * sizeof(float));
+    write_section(header.text_offsets_offset, m_text_offsets, (m_count + 1) * sizeof(uint64_t));
+    write_section(header.text_offset, m_text, m_text_offsets[m_count]);
+    if (m_has_graph) {
+        write_section(header.levels_offset, m_levels, m_count);
+        write_section(header.links_offset, m_links, m_count * 2 * m_max_neighbors * sizeof(uint32_t));
+        write_section(header.upper_offsets_offset, m_upper_offsets, m_count * sizeof(uint64_t));
+        write_section(header.upper_links_offset, m_upper_links, m_upper_links_count * sizeof(uint32_t));
+    }
+
+    if (!file) {
+        std::cout << "failed to write index file '" << path << "'!" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool VectorIndex::open(const std::string& path) {
+    // start from an empty index
+    unmap();
+    m_owned_vectors.clear();
+    m_owned_text_offsets.assign(1, 0);
+    m_owned_text.clear();
+    m_owned_levels.clear();
+    m_owned_links.clear();
+    m_owned_upper_offsets.clear();
+    m_owned_upper_links.clear();
+    m_dim         = 0;
+    m_count       = 0;
+    m_has_graph   = false;
+    m_entry_point = NO_NODE;
+    m_max_level   = 0;
+    refreshViews();
+
+    const int file = ::open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+        std::cout << "could not open index file '" << path << "'!" << std::endl;
+        return false;
+    }
+    struct stat file_stat;
+    const size_t size   = fstat(file, &file_stat) == 0 ? file_stat.st_size : 0;
+    void*        mapped = size >= sizeof(FileHeader) ? mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0) : MAP_FAILED;
+    ::close(file);
+    if (mapped == MAP_FAILED) {
+        std::cout << "could not map index file '" << path << "'!" << std::endl;
+        return false;
+    }
+
+    // check every section lies inside the file and every offset and link stays inside its section before using them in place
+    const FileHeader& header = *static_cast<const FileHeader*>(mapped);
+    const char*       base   = static_cast<const char*>(mapped);
+    auto              fits   = [size](uint64_t offset, uint64_t bytes) {
+        return offset % 64 == 0 && offset <= size && bytes <= size - offset;
+    };
+    auto bytes = [](uint64_t count, uint64_t width, uint64_t element_size) {
+        uint64_t product = 0;
+        if (__builtin_mul_overflow(count, width, &product) || __builtin_mul_overflow(product, element_size, &product)) {
+            return UINT64_MAX;  // never fits
+        }
+        return product;
+    };
+    bool valid = header.magic == INDEX_MAGIC && header.version == INDEX_VERSION && header.count < NO_NODE && header.pooling <= (uint32_t)EmbeddingPooling::LAST;
+    valid      = valid && fits(header.vectors_offset, bytes(header.count, header.dim, sizeof(float))) && fits(header.text_offsets_offset, bytes(header.count + 1, 1, sizeof(uint64_t)));
+    if (valid) {
+        const uint64_t* text_offsets = reinterpret_cast<const uint64_t*>(base + header.text_offsets_offset);
+        valid                        = text_offsets[0] == 0 && fits(header.text_offset, text_offsets[header.count]);
+        for (uint64_t i = 0; valid && i < header.count; ++i) {
+            valid = text_offsets[i] <= text_offsets[i + 1];
+        }
+    }
+    if (valid && header.has_graph) {
+        valid = header.max_neighbors >= 2 && header.max_level <= MAX_LEVEL && (header.count == 0 || header.entry_point < header.count);
+        valid = valid && fits(header.levels_offset, header.count) && fits(header.links_offset, bytes(header.count, 2 * (uint64_t)header.max_neighbors, sizeof(uint32_t)));
+        valid = valid && fits(header.upper_offsets_offset, bytes(header.count, 1, sizeof(uint64_t))) && fits(header.upper_links_offset, bytes(header.upper_links_count, 1, sizeof(uint32_t)));
+    }
+    if (valid && header.has_graph) {
+        // every node's upper layers lie inside the upper links, the entry point reaches the top layer and every link names a node
+        const uint8_t*  levels        = reinterpret_cast<const uint8_t*>(base + header.levels_offset);
+        const uint64_t* upper_offsets = reinterpret_cast<const uint64_t*>(base + header.upper_offsets_offset);
+        valid                         = header.count == 0 || levels[header.entry_point] >= header.max_level;
+        for (uint64_t i = 0; valid && i < header.count; ++i) {
+            const uint64_t upper_slots = (uint64_t)levels[i] * header.max_neighbors;
+            valid                      = levels[i] <= header.max_level && upper_offsets[i] <= header.upper_links_count && upper_slots <= header.upper_links_count - upper_offsets[i];
+        }
+        auto links_valid = [&header](const uint32_t* links, uint64_t n_links) {
+            for (uint64_t i = 0; i < n_links; ++i) {
+                if (links[i] != NO_NODE && links[i] >= header.count) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        valid = valid && links_valid(reinterpret_cast<const uint32_t*>(base + header.links_offset), header.count * 2 * header.max_neighbors);
+        valid = valid && links_valid(reinterpret_cast<const uint32_t*>(base + header.upper_links_offset), header.upper_links_count);
+    }
+    if (!valid) {
+        std::cout << "index file '" << path << "' is invalid or from an incompatible version!" << std::endl;
+        munmap(mapped, size);
+        return false;
+    }
+
+    m_mapped          = mapped;
+    m_mapped_size     = size;
+    m_dim             = header.dim;
+    m_count           = header.count;
+    m_pooling         = (EmbeddingPooling)header.pooling;
+    m_has_graph       = header.has_graph;
+    m_max_neighbors   = header.max_neighbors;
+    m_ef_construction = header.ef_construction;
+    m_entry_point     = header.has_graph && header.count > 0 ? header.entry_point : NO_NODE;
+    m_max_level       = header.max_level;
+
+    m_vectors           = reinterpret_cast<const float*>(base + header.vectors_offset);
+    m_text_offsets      = reinterpret_cast<const uint64_t*>(base + header.text_offsets_offset);
+    m_text              = base + header.text_offset;
+    m_levels            = reinterpret_cast<const uint8_t*>(base + header.levels_offset);
+    m_links             = reinterpret_cast<const uint32_t*>(base + header.links_offset);
+    m_upper_offsets     = reinterpret_cast<const uint64_t*>(base + header.upper_offsets_offset);
+    m_upper_links       = reinterpret_cast<const uint32_t*>(base + header.upper_links_offset);
+    m_upper_links_count = header.upper_links_count;
+    return true;
+}
+
+void VectorIndex::materialize() {
+    if (!m_mapped) {
+        return;
+    }
+    m_owned_vectors.assign(m_vectors, m_vectors + m_count * m_dim);
+    m_owned_text_offsets.assign(m_text_offsets, m_text_offsets + m_count + 1);
+    m_owned_text.assign(m_text, m_text_offsets[m_count]);
+    if (m_has_graph) {
+        m_owned_levels.assign(m_levels, m_levels + m_count);
+        m_owned_links.assign(m_links, m_links + m_count * 2 * m_max_neighbors);
+        m_owned_upper_offsets.assign(m_upper_offsets, m_upper_offsets + m_count);
+        m_owned_upper_links.assign(m_upper_links, m_upper_links + m_upper_links_count);
+    }
+    unmap();
+    refreshViews();
+}
+
+void VectorIndex::refreshViews() {
+    m_vectors           = m_owned_vectors.data();
+    m_text_offsets      = m_owned_text_offsets.data();
+    m_text              = m_owned_text.data();
+    m_levels            = m_owned_levels.data();
+    m_links             = m_owned_links.data();
+    m_upper_offsets     = m_owned_upper_offsets.data();
+    m_upper_links       = m_owned_upper_links.data();
+    m_upper_links_count = m_owned_upper_links.size();
+}
+
+void VectorIndex::unmap() {
+    if (m_mapped) {
+        munmap(m_mapped, m_mapped_size);
+        m_mapped      = nullptr;
+        m_mapped_size = 0;
+    }
+}
+
+const uint32_t* VectorIndex::neighbors(uint32_t id, uint32_t level) const {
+    if (level == 0) {
+        return m_links + (size_t)id * 2 * m_max_neighbors;
+    }
+    return m_upper_links + m_upper_offsets[id] + (size_t)(level - 1) * m_max_neighbors;
+}
+
+uint32_t* VectorIndex::mutableNeighbors(uint32_t id, uint32_t level) {
+    if (level == 0) {
+        return m_owned_links.data() + (size_t)id * 2 * m_max_neighbors;
+    }
+    return m_owned_upper_links.data() + m_owned_upper_offsets[id] + (size_t)(level - 1) * m_max_neighbors;
+}
+
+std::vector<SearchResult> VectorIndex::searchLayer(const float* query, uint32_t entry, uint32_t ef, uint32_t level) const {
+    // visited marks are kept per thread and invalidated by bumping the generation rather than clearing them
+    thread_local std::vector<uint32_t> visited;
+    thread_local uint32_t              generation = 0;
+    if (visited.size() < m_count) {
+        visited.resize(m_count, 0);
+    }
+    if (++generation == 0) {
+        std::fill(visited.begin(), visited.end(), 0);
+        generation = 1;
+    }
+
+    // candidates to expand, most similar on top, and the results so far, least similar on top
+    auto closer = [](const SearchResult& a, const SearchResult& b) {
+        return a.score < b.score;
+    };
+    auto further = [](const SearchResult& a, const SearchResult& b) {
+        return a.score > b.score;
+    };
+    std::priority_queue<SearchResult, std::vector<SearchResult>, decltype(closer)>  candidates(closer);
+    std::priority_queue<SearchResult, std::vector<SearchResult>, decltype(further)> results(further);
+
+    const SearchResult start = { entry, m_dot(query, vector(entry), m_dim) };
+    visited[entry]           = generation;
+    candidates.push(start);
+    results.push(start);
+
+    const uint32_t slots = neighborSlots(level);
+    while (!candidates.empty()) {
+        const SearchResult current = candidates.top();
+        if (results.size() >= ef && current.score < results.top().score) {
+            break;  // every remaining candidate is worse than the worst result
+        }
+        candidates.pop();
+
+        const uint32_t* links = neighbors(current.id, level);
+        for (uint32_t i = 0; i < slots && links[i] != NO_NODE; ++i) {
+            const uint32_t neighbor = links[i];
+            if (i + 1 < slots && links[i + 1] != NO_NODE) {
+                __builtin_prefetch(vector(links[i + 1]));
+            }
+            if (visited[neighbor] == generation) {
+                continue;
+            }
+            visited[neighbor] = generation;
+
+            const float score = m_dot(query, vector(neighbor), m_dim);
+            if (results.size() < ef || score > results.top().score) {
+                candidates.push({ neighbor, score });
+                results.push({ neighbor, score });
+                if (results.size() > ef) {
+                    results.pop();
+                }
+            }
+        }
+    }
+
+    std::vector<SearchResult> found(results.size());
+    for (size_t i = found.size(); i > 0; --i) {
+        found[i - 1] = results.top();
+        results.pop();
+    }
+    return found;
+}
+
+void VectorIndex::insertNode(uint32_t id) {
+    // draw the node's top layer from an exponential distribution so each layer holds about 1/max_neighbors of the one below
+    m_level_rng ^= m_level_rng >> 12;
+    m_level_rng ^= m_level_rng << 25;
+    m_level_rng ^= m_level_rng >> 27;
+    const double   uniform = ((m_level_rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0) + 1e-12;
+    const uint32_t level   = std::min<uint32_t>(MAX_LEVEL, -std::log(uniform) / std::log((double)m_max_neighbors));
+
+    // reserve the node's neighbor slots on every layer it is on
+    m_owned_levels.push_back(level);
+    m_owned_links.resize((size_t)(id + 1) * 2 * m_max_neighbors, NO_NODE);
+    m_owned_upper_offsets.push_back(m_owned_upper_links.size());
+    m_owned_upper_links.resize(m_owned_upper_links.size() + (size_t)level * m_max_neighbors, NO_NODE);
+    refreshViews();
+
+    if (m_entry_point == NO_NODE) {
+        m_entry_point = id;
+        m_max_level   = level;
+        return;
+    }
+
+    // descend greedily to the node's top layer, then link it on each layer down to the bottom
+    const float* query = vector(id);
+    uint32_t     entry = m_entry_point;
+    for (uint32_t search_level = m_max_level; search_level > level; --search_level) {
+        entry = searchLayer(query, entry, 1, search_level).front().id;
+    }
+    for (int32_t link_level = std::min(level, m_max_level); link_level >= 0; --link_level) {
+        const uint32_t            slots      = neighborSlots(link_level);
+        std::vector<SearchResult> candidates = searchLayer(query, entry, m_ef_construction, link_level);
+        entry                                = candidates.front().id;
+
+        selectNeighbors(candidates, slots);
+        uint32_t* links = mutableNeighbors(id, link_level);
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            links[i] = candidates[i].id;
+        }
+
+        // link back from each neighbor, re-selecting its neighbors if its list is full
+        for (const auto& candidate : candidates) {
+            uint32_t* back_links = mutableNeighbors(candidate.id, link_level);
+            uint32_t* free_slot  = std::find(back_links, back_links + slots, NO_NODE);
+            if (free_slot != back_links + slots) {
+                *free_slot = id;
+                continue;
+            }
+            std::vector<SearchResult> pool = { { id, candidate.score } };
+            for (uint32_t i = 0; i < slots; ++i) {
+                pool.push_back({ back_links[i], m_dot(vector(candidate.id), vector(back_links[i]), m_dim) });
+            }
+            std::sort(pool.begin(), pool.end(), [](const SearchResult& a, const SearchResult& b) {
+                return a.score > b.score;
+            });
+            selectNeighbors(pool, slots);
+            std::fill(back_links, back_links + slots, NO_NODE);
+            for (size_t i = 0; i < pool.size(); ++i) {
+                back_links[i] = pool[i].id;
+            }
+        }
+    }
+
+    if (level > m_max_level) {
+        m_entry_point = id;
+        m_max_level   = level;
+    }
+}
+
+void VectorIndex::selectNeighbors(std::vector<SearchResult>& candidates, uint32_t n) const {
+    if (candidates.size() <= n) {
+        return;
+    }
+
+    // skip candidates that are closer to an already chosen neighbor than to the node, they are reachable through it
+    std::vector<SearchResult> selected;
+    std::vector<SearchResult> pruned;
+    for (const auto& candidate : candidates) {
+        if (selected.size() >= n) {
+            break;
+        }
+        const bool diverse = std::none_of(selected.begin(), selected.end(), [&](const SearchResult& chosen) {
+            return m_dot(vector(candidate.id), vector(chosen.id), m_dim) > candidate.score;
+        });
+        (diverse ? selected : pruned).push_back(candidate);
+    }
+
+    // fill the remaining slots with the closest skipped candidates so nodes keep enough links
+    for (size_t i = 0; i < pruned.size() && selected.size() < n; ++i) {
+        selected.push_back(pruned[i]);
+    }
+    candidates.swap(selected);
+}
+
+float VectorIndex::dotScalar(const float* a, const float* b, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+__attribute__((target("avx2,fma"))) float VectorIndex::dotAvx2(const float* a, const float* b, size_t n) {
+    // two accumulators hide the FMA latency
+    __m256 sum_0 = _mm256_setzero_ps();
+    __m256 sum_1 = _mm256_setzero_ps();
+    size_t i     = 0;
+    for (; i + 16 <= n; i += 16) {
+        sum_0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum_0);
+        sum_1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum_1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        sum_0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum_0);
+    }
+    sum_0        = _mm256_add_ps(sum_0, sum_1);
+    __m128 lanes = _mm_add_ps(_mm256_castps256_ps128(sum_0), _mm256_extractf128_ps(sum_0, 1));
+    lanes        = _mm_hadd_ps(lanes, lanes);
+    lanes        = _mm_hadd_ps(lanes, lanes);
+    float sum    = _mm_cvtss_f32(lanes);
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f"))) float VectorIndex::dotAvx512(const float* a, const float* b, size_t n) {
+    __m512 sum_0 = _mm512_setzero_ps();
+    __m512 sum_1 = _mm512_setzero_ps();
+    size_t i     = 0;
+    for (; i + 32 <= n; i += 32) {
+        sum_0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum_0);
+        sum_1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), sum_1);
+    }
+    for (; i + 16 <= n; i += 16) {
+        sum_0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum_0);
+    }
+
+    // masked loads handle the tail without a scalar loop
+    if (i < n) {
+        const __mmask16 mask = (__mmask16)((1u << (n - i)) - 1);
+        sum_1                = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), sum_1);
+    }
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, _mm512_add_ps(sum_0, sum_1));
+    float sum = 0.0f;
+    for (float lane : lanes) {
+        sum += lane;
+    }
+    return sum;
+}
+#else
+float VectorIndex::dotAvx2(const float* a, const float* b, size_t n) {
+    return dotScalar(a, b, n);
+}
+
+float VectorIndex::dotAvx512(const float* a, const float* b, size_t n) {
+    return dotScalar(a, b, n);
+}
+#endif
+
+VectorIndex::DotFunction VectorIndex::selectDot() {
+#if defined(__x86_64__) || defined(_M_X64)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return dotAvx512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return dotAvx2;
+    }
+#endif
+    return dotScalar;
+}
@@ -1,10 +1,18 @@
 #include "llm_wrapper.hpp"
+#include "llm_utils.hpp"
+#include "llm_model_registry.hpp"
+#include "llm_vector_index.hpp"
+#include "llm_sampler.hpp"
+#include "llm_grammar.hpp"
 #include <algorithm>
 #include <iostream>
 #include <cstring>
 #include <chrono>
+#include <fstream>
+#include <cmath>
+#include <iterator>
 
-LLM::LLM(std::string model_path, float temperature, bool print_progress, uint8_t debug_level) {
+LLM::LLM(std::string model_path, float temperature, bool print_progress, uint8_t debug_level, std::string draft_model_path, EngineConfig engine_config) {
 
     // record whether to print model progress and debug output
     m_print_progress = print_progress;
@@ -22,180 +30,1756 @@ LLM::LLM(std::string model_path, float temperature, bool print_progress, uint8_t
 
     setTemperature(temperature);
 
-    // initialize llama cpp backend
-    ggml_backend_load_all();
-
-    // setup model parameters
-    llama_model_params model_params = llama_model_default_params();
-    model_params.n_gpu_layers       = 100;  // offload all processing to GPU
-
-    // load model
-    m_model = llama_model_load_from_file("/home/chriz/Downloads/Llama-3.2-3B-Instruct-uncensored-Q6_K.gguf", model_params);
+    // load model, or share the weights of an instance that already loaded it
+    auto load_start = std::chrono::steady_clock::now();
+    ModelRegistry::instance().initBackend(engine_config.numa);
+    m_model_handle  = ModelRegistry::instance().acquire(model_path, engine_config.n_gpu_layers);
+    m_model         = m_model_handle.get();
     if (!m_model) {
         std::cout << "Model initialization failed" << std::endl;
         std::exit(1);
     }
+    if (m_debug_level > 0) {
+        std::cout << "model ready in " << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - load_start).count() << " ms" << std::endl;
+    }
 
     // setup model vocabulary
     m_vocab = llama_model_get_vocab(m_model);
+    m_tokenizer.setVocab(m_vocab);
 
     // setup context
-    auto context_parameters    = llama_context_default_params();
-    context_parameters.n_ctx   = 4096;  // context size in tokens
-    context_parameters.n_batch = context_parameters.n_ctx;  // number of tokens processed in each call to model
-    m_context                  = llama_init_from_model(m_model, context_parameters);
+    auto context_parameters       = llama_context_default_params();
+    context_parameters.n_ctx      = DEFAULT_N_CTX;  // context size in tokens unless the engine config sets one
+    context_parameters.n_seq_max  = FIRST_FORK_SEQ + MAX_FORKS;  // chat sequence, prefix cache sequence, forks and reply candidates
+    context_parameters.kv_unified = true;  // sequences share one KV buffer so copying the prefix or forking shares cells rather than duplicating them
+    context_parameters.no_perf    = false;  // keep prompt and generation timings for getPerformance
+    m_engine_config               = engine_config.resolved(context_parameters.n_ctx);
+    m_engine_config.apply(context_parameters);  // context size, KV cache types, threads and tokens processed in each call to model
+    m_context = llama_init_from_model(m_model, context_parameters);
     if (!m_context) {
         std::cout << "model context initialization failed!" << std::endl;
         std::exit(1);
     }
+    if (!m_threadpools.attach(m_context, m_engine_config)) {
+        std::cout << "could not pin threads to CPU mask '" << m_engine_config.cpu_mask << "', using unpinned threads" << std::endl;
+    }
+    if (m_debug_level > 0) {
+        std::cout << "threads: " << m_engine_config.n_threads << ", batch threads: " << m_engine_config.n_threads_batch << ", batch: " << m_engine_config.n_batch << ", ubatch: " << m_engine_config.n_ubatch << ", gpu layers: " << m_engine_config.n_gpu_layers << std::endl;
+    }
+    if (m_debug_level > 0) {
+        std::cout << "context: " << llama_n_ctx(m_context) << " tokens, KV cache " << ggml_type_name(m_engine_config.type_k) << "/" << ggml_type_name(m_engine_config.type_v) << " estimated " << getEstimatedKvCacheBytes() / (1024.0 * 1024.0) << " MiB, flash attention " << (m_engine_config.flash_attn == LLAMA_FLASH_ATTN_TYPE_ENABLED ? "on" : m_engine_config.flash_attn == LLAMA_FLASH_ATTN_TYPE_DISABLED ? "off" : "auto") << std::endl;
+    }
+
+    // setup the draft model for speculative decoding, it must tokenize text identically to the main model
+    if (draft_model_path != "") {
+        m_draft_model_handle = ModelRegistry::instance().acquire(draft_model_path, m_engine_config.n_gpu_layers);
+        m_draft_model        = m_draft_model_handle.get();
+        if (!m_draft_model) {
+            std::cout << "Draft model initialization failed" << std::endl;
+            std::exit(1);
+        }
+        const llama_vocab* draft_vocab = llama_model_get_vocab(m_draft_model);
+        if (llama_vocab_n_tokens(draft_vocab) != llama_vocab_n_tokens(m_vocab) || llama_vocab_bos(draft_vocab) != llama_vocab_bos(m_vocab)) {
+            std::cout << "draft model vocabulary does not match the model, speculative decoding disabled" << std::endl;
+            m_draft_model_handle.reset();
+            m_draft_model = nullptr;
+        } else {
+            auto draft_parameters  = llama_context_default_params();
+            draft_parameters.n_ctx = context_parameters.n_ctx;
+            m_engine_config.apply(draft_parameters);
+            m_draft_context = llama_init_from_model(m_draft_model, draft_parameters);
+            if (!m_draft_context) {
+                std::cout << "draft model context initialization failed!" << std::endl;
+                std::exit(1);
+            }
+            m_draft_sampler = llama_sampler_init_greedy();
+        }
+    }
 
     // setup sampler
-    m_sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
-    llama_sampler_chain_add(m_sampler, llama_sampler_init_min_p(0.05f, 1));  // filter low probability noise
-    llama_sampler_chain_add(m_sampler, llama_sampler_init_temp(temperature));  // level of creativity
-    llama_sampler_chain_add(m_sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    m_sampler = createSampler(temperature, LLAMA_DEFAULT_SEED);
+
+    // fork sequences are handed out lowest first
+    for (llama_seq_id seq_id = FIRST_FORK_SEQ + MAX_FORKS - 1; seq_id >= FIRST_FORK_SEQ; --seq_id) {
+        m_free_seqs.push_back(seq_id);
+    }
 
     // get the chat template
     m_chat_template = llama_model_chat_template(m_model, nullptr);
+    m_chat.setTemplate(m_chat_template);
 
-    // setup vector for llama chat messages
-    m_formatted_chat_messages = std::vector<char>(llama_n_ctx(m_context));
+    // evaluate the preamble shared by every conversation and start the first one
+    m_batch = llama_batch_init(llama_n_batch(m_context), 0, 1);
+    buildPrefixCache();
+    clearChat();
 }
 
 LLM::~LLM() {
 
-    // clear chat messages
-    for (auto& msg : m_chat_history) {
-        free(const_cast<char*>(msg.content));
+    // cancel outstanding asynchronous turns and stop the worker before the context goes away
+    {
+        std::lock_guard<std::mutex> lock(m_async_mutex);
+        m_async_stopping = true;
+        for (auto& job : m_async_jobs) {
+            job.cancel->store(true, std::memory_order_relaxed);
+        }
+        if (m_async_current) {
+            m_async_current->store(true, std::memory_order_relaxed);
+        }
+    }
+    m_async_cv.notify_all();
+    if (m_async_worker.joinable()) {
+        m_async_worker.join();
     }
 
     // free resources
+    llama_batch_free(m_batch);
     llama_sampler_free(m_sampler);
     llama_free(m_context);
-    llama_model_free(m_model);
+    if (m_draft_model) {
+        llama_sampler_free(m_draft_sampler);
+        llama_free(m_draft_context);
+    }
+    if (m_embed_context) {
+        llama_free(m_embed_context);
+    }
+    if (m_embed_batch.token) {
+        llama_batch_free(m_embed_batch);
+    }
 }
 
 void LLM::clearChat() {
-    // reset the memory used by the model
-    llama_memory_seq_rm(llama_get_memory(m_context), -1, -1, -1);
+    // reset the memory used by the conversation, keeping the prefix cache
+    removeChatCells(0);
+    m_stale_tokens.clear();
 
-    // clear chat messages
-    for (auto& msg : m_chat_history) {
-        free(const_cast<char*>(msg.content));
+    // start the new conversation from the cached preamble, this shares the KV cells rather than re-evaluating them
+    llama_memory_seq_cp(llama_get_memory(m_context), PREFIX_SEQ, CHAT_SEQ, -1, -1);
+    m_context_tokens  = m_prefix_tokens;
+    m_unshared_prefix = 0;
+    resetHistory();
+}
+
+void LLM::resetHistory() {
+    // clear chat messages, the reply candidates of the last turn go with them
+    releaseCandidates();
+    m_chat.clear();
+    if (m_system_prompt != "") {
+        m_chat.append(SYSTEM_ROLE, m_system_prompt, false);
     }
-    m_chat_history.clear();
-    m_formatted_chat_messages.clear();
+    m_prefix_tokens_saved = m_prefix_tokens.size();
+    m_turn_starts.clear();
 
-    // clear prompt history
-    m_prev_prompt_length = 0;
+    // the preamble text has already been given to the model
+    m_prev_prompt_length = m_prefix_text_length;
 }
 
-std::string LLM::getChatResponse(std::string prompt) {
-    // add the user input to the message list and format it
-    m_chat_history.push_back({ "user: ", strdup(prompt.c_str()) });
-    // copy chat messages to raw chars in model format
-    int new_len = llama_chat_apply_template(m_chat_template, m_chat_history.data(), m_chat_history.size(), true, m_formatted_chat_messages.data(), m_formatted_chat_messages.size());
-    if (new_len > (int)m_formatted_chat_messages.size()) {
-        m_formatted_chat_messages.resize(new_len);
-        new_len = llama_chat_apply_template(m_chat_template, m_chat_history.data(), m_chat_history.size(), true, m_formatted_chat_messages.data(), m_formatted_chat_messages.size());
-    }
-    if (new_len < 0) {
+bool LLM::setChat(const std::vector<std::pair<std::string, std::string>>& turns) {
+    // the cells after the preamble become stale, replaying the turns keeps them up to the first token that differs
+    dropStaleTokens();
+    const size_t n_keep = m_prefix_tokens.size();
+    if (m_context_tokens.size() < n_keep || !std::equal(m_prefix_tokens.begin(), m_prefix_tokens.end(), m_context_tokens.begin())) {
+        clearChat();
+    } else {
+        m_stale_tokens.assign(m_context_tokens.begin() + n_keep, m_context_tokens.end());
+        m_context_tokens.resize(n_keep);
+        resetHistory();
+    }
+
+    for (const auto& [prompt, reply] : turns) {
+        if (!addTurn(prompt, reply)) {
+            clearChat();
+            return false;
+        }
+    }
+    return true;
+}
+
+ChatResult LLM::regenerate(const ChatOptions& options) {
+    std::lock_guard<std::mutex> lock(m_turn_mutex);
+    std::vector<std::pair<std::string, std::string>> turns = chatTurns();
+    if (turns.empty()) {
+        return { "", FinishReason::END_OF_TEXT };
+    }
+
+    // the stored prompt already holds the passages retrieved for it, and its cells are still in the context
+    std::string prompt = std::move(turns.back().first);
+    turns.pop_back();
+    if (!setChat(turns)) {
+        return { "", FinishReason::CONTEXT_FULL };
+    }
+    return runTurn(std::move(prompt), options, nullptr, false);
+}
+
+ChatResult LLM::editLastMessage(std::string prompt, const ChatOptions& options) {
+    std::lock_guard<std::mutex> lock(m_turn_mutex);
+    std::vector<std::pair<std::string, std::string>> turns = chatTurns();
+    if (!turns.empty()) {
+        turns.pop_back();
+    }
+    if (!setChat(turns)) {
+        return { "", FinishReason::CONTEXT_FULL };
+    }
+    return runTurn(std::move(prompt), options, nullptr);
+}
+
+std::vector<std::pair<std::string, std::string>> LLM::chatTurns() const {
+    // messages alternate between user and reply after the optional system message
+    std::vector<std::pair<std::string, std::string>> turns;
+    for (const auto& message : m_chat.messages()) {
+        if (std::string_view(message.role) == USER_ROLE) {
+            turns.emplace_back(message.content, "");
+        } else if (std::string_view(message.role) == MACHINE_ROLE && !turns.empty()) {
+            turns.back().second = message.content;
+        }
+    }
+    return turns;
+}
+
+void LLM::dropStaleTokens() {
+    if (!m_stale_tokens.empty()) {
+        removeChatCells(m_context_tokens.size());
+        m_stale_tokens.clear();
+    }
+}
+
+std::vector<ChatResult> LLM::getChatResponses(std::string prompt, size_t n_replies, const ChatOptions& options) {
+    std::lock_guard<std::mutex> lock(m_turn_mutex);
+    releaseCandidates();
+
+    // one reply needs no fork, and without free sequences only one can be generated
+    n_replies = std::min(n_replies, m_free_seqs.size());
+    if (n_replies < 2) {
+        return { runTurn(std::move(prompt), options, nullptr) };
+    }
+    if (options.deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= options.deadline) {
+        return std::vector<ChatResult>(n_replies, { "", FinishReason::DEADLINE });
+    }
+    if (!prepareGrammar(options, n_replies)) {
+        return std::vector<ChatResult>(n_replies, { "", FinishReason::GRAMMAR_ERROR });
+    }
+
+    const bool record_metrics = metricsEnabled();
+    const auto turn_start     = std::chrono::steady_clock::now();
+    if (record_metrics) {
+        m_turn_metrics = TurnMetrics();
+    }
+
+    // evaluate the prompt once in the chat sequence
+    std::vector<ChatResult> results(n_replies);
+    const std::string       llm_input = appendPrompt(std::move(prompt), true);
+    if (!m_tokenizer.tokenize(llm_input, m_context_tokens.empty(), m_prompt_tokens) || !decodeChatTokens(m_prompt_tokens.data(), m_prompt_tokens.size())) {
+        std::cout << "prompt is too long for the context!" << std::endl;
+        rollbackPrompt(llm_input.size());
+        for (auto& result : results) {
+            result.finish_reason = FinishReason::CONTEXT_FULL;
+        }
+        return results;
+    }
+    if (record_metrics) {
+        m_turn_metrics.prompt_tokens       = m_prompt_tokens.size();
+        m_turn_metrics.prefix_tokens_saved = m_prefix_tokens_saved;
+        m_turn_metrics.reused_tokens       = m_reused_tokens;
+    }
+    m_prefix_tokens_saved = 0;
+    m_reused_tokens       = 0;
+
+    // fork the conversation into a sequence per candidate sharing its cells, each candidate samples its first token from the same logits
+    llama_memory_t                   memory = llama_get_memory(m_context);
+    std::vector<llama_sampler*>      samplers(n_replies);
+    std::vector<llama_token>         next_tokens(n_replies);
+    std::vector<int32_t>             batch_indices(n_replies, -1);
+    std::vector<bool>                active(n_replies, true);
+    std::vector<std::vector<size_t>> token_ends(n_replies);
+    m_candidates_start = m_context_tokens.size();
+    m_candidates.resize(n_replies);
+    for (size_t i = 0; i < n_replies; ++i) {
+        m_candidates[i].seq_id = m_free_seqs.back();
+        m_free_seqs.pop_back();
+        llama_memory_seq_cp(memory, CHAT_SEQ, m_candidates[i].seq_id, -1, -1);
+        samplers[i]    = createSampler(m_temperature, m_seed == LLAMA_DEFAULT_SEED ? LLAMA_DEFAULT_SEED : m_seed + i);
+        next_tokens[i] = m_grammar ? m_grammar->sample(samplers[i], m_context, -1, i) : llama_sampler_sample(samplers[i], m_context, -1);
+    }
+    if (record_metrics) {
+        m_turn_metrics.prefill_time = std::chrono::steady_clock::now() - turn_start;
+    }
+
+    // limits for this turn
+    const int64_t max_tokens   = options.max_tokens >= 0 ? options.max_tokens : m_max_tokens;
+    const bool    has_deadline = options.deadline != std::chrono::steady_clock::time_point::max();
+    size_t        max_stop     = 0;
+    for (const auto& stop : options.stop) {
+        max_stop = std::max(max_stop, stop.size());
+    }
+
+    // every candidate still going adds its sampled token to one shared batch, so a step costs about as much as a single reply's
+    const size_t n_ctx       = llama_n_ctx(m_context);
+    size_t       n_cells     = m_context_tokens.size() + m_unshared_prefix + forkCells();
+    uint32_t     n_generated = 0;
+    while (true) {
+        m_batch.n_tokens = 0;
+        for (size_t i = 0; i < n_replies; ++i) {
+            if (!active[i]) {
+                continue;
+            }
+            Candidate&  candidate = m_candidates[i];
+            ChatResult& result    = results[i];
+            active[i]             = false;
+
+            // check for end of output
+            if (llama_vocab_is_eog(m_vocab, next_tokens[i])) {
+                result.finish_reason = FinishReason::END_OF_TEXT;
+                continue;
+            }
+            if (max_tokens >= 0 && token_ends[i].size() >= (uint64_t)max_tokens) {
+                result.finish_reason = FinishReason::LENGTH;
+                continue;
+            }
+            if (has_deadline && std::chrono::steady_clock::now() >= options.deadline) {
+                result.finish_reason = FinishReason::DEADLINE;
+                continue;
+            }
+            if (n_cells + m_batch.n_tokens >= n_ctx) {
+                result.finish_reason = FinishReason::CONTEXT_FULL;
+                continue;
+            }
+
+            // add the piece to the reply, which ends before a stop string without evaluating the token
+            char char_buffer[256];
+            int  n = llama_token_to_piece(m_vocab, next_tokens[i], char_buffer, sizeof(char_buffer), 0, true);
+            result.text.append(char_buffer, n);
+            ++n_generated;
+            if (max_stop > 0) {
+                const size_t stop_start = findStop(result.text, n, options.stop, max_stop);
+                if (stop_start != std::string::npos) {
+                    result.text.resize(stop_start);
+                    result.finish_reason = FinishReason::STOP_STRING;
+                    continue;
+                }
+            }
+            token_ends[i].push_back(result.text.size());
+            candidate.tokens.push_back(next_tokens[i]);
+
+            active[i]                           = true;
+            batch_indices[i]                    = m_batch.n_tokens;
+            m_batch.token[m_batch.n_tokens]     = next_tokens[i];
+            m_batch.pos[m_batch.n_tokens]       = m_candidates_start + candidate.tokens.size() - 1;
+            m_batch.n_seq_id[m_batch.n_tokens]  = 1;
+            m_batch.seq_id[m_batch.n_tokens][0] = candidate.seq_id;
+            m_batch.logits[m_batch.n_tokens]    = true;
+            m_batch.n_tokens++;
+        }
+        if (m_batch.n_tokens == 0) {
+            break;
+        }
+
+        // a batch that finds no room leaves its tokens out of the replies' cells
+        if (llama_decode(m_context, m_batch) != 0) {
+            for (size_t i = 0; i < n_replies; ++i) {
+                if (active[i]) {
+                    m_candidates[i].tokens.pop_back();
+                    token_ends[i].pop_back();
+                    results[i].finish_reason = FinishReason::CONTEXT_FULL;
+                }
+            }
+            break;
+        }
+        n_cells += m_batch.n_tokens;
+        for (size_t i = 0; i < n_replies; ++i) {
+            if (active[i]) {
+                next_tokens[i] = m_grammar ? m_grammar->sample(samplers[i], m_context, batch_indices[i], i) : llama_sampler_sample(samplers[i], m_context, batch_indices[i]);
+            }
+        }
+    }
+
+    // a stop string may begin inside tokens already evaluated, drop those so no sequence holds text past its reply
+    for (size_t i = 0; i < n_replies; ++i) {
+        Candidate& candidate      = m_candidates[i];
+        size_t     n_reply_tokens = token_ends[i].size();
+        while (n_reply_tokens > 0 && token_ends[i][n_reply_tokens - 1] > results[i].text.size()) {
+            --n_reply_tokens;
+        }
+        if (n_reply_tokens < candidate.tokens.size()) {
+            llama_memory_seq_rm(memory, candidate.seq_id, m_candidates_start + n_reply_tokens, -1);
+            candidate.tokens.resize(n_reply_tokens);
+        }
+        candidate.context_bytes = n_reply_tokens > 0 ? token_ends[i][n_reply_tokens - 1] : 0;
+        candidate.text          = results[i].text;
+        llama_sampler_free(samplers[i]);
+    }
+
+    // continue the chat with the first candidate
+    llama_memory_seq_cp(memory, m_candidates[0].seq_id, CHAT_SEQ, m_candidates_start, -1);
+    m_context_tokens.insert(m_context_tokens.end(), m_candidates[0].tokens.begin(), m_candidates[0].tokens.end());
+    appendReply(m_candidates[0].text, m_candidates[0].context_bytes);
+
+    if (record_metrics) {
+        m_turn_metrics.sampled_tokens = n_generated;
+        if (m_debug_level > 0) {
+            std::cout << n_replies << " candidates, " << n_generated << " tokens in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - turn_start).count() << " seconds" << std::endl;
+        }
+        completeTurnMetrics(turn_start);
+    }
+    return results;
+}
+
+bool LLM::selectResponse(size_t index) {
+    std::lock_guard<std::mutex> lock(m_turn_mutex);
+    if (index >= m_candidates.size()) {
+        return false;
+    }
+
+    // swap the reply cells of the chat sequence for the candidate's, the conversation before them is shared
+    const Candidate& candidate = m_candidates[index];
+    removeChatCells(m_candidates_start);
+    llama_memory_seq_cp(llama_get_memory(m_context), candidate.seq_id, CHAT_SEQ, m_candidates_start, -1);
+    m_context_tokens.resize(m_candidates_start);
+    m_context_tokens.insert(m_context_tokens.end(), candidate.tokens.begin(), candidate.tokens.end());
+
+    // replace the reply in the chat history
+    if (!m_chat.erase(m_chat.messages().size() - 1, 1)) {
         std::cout << "could not apply chat template!" << std::endl;
         std::exit(1);
     }
+    appendReply(candidate.text, candidate.context_bytes);
+    return true;
+}
 
-    // remove previous messages to obtain the prompt to give to the LLM to generate the response
-    std::string llm_input(m_formatted_chat_messages.begin() + m_prev_prompt_length, m_formatted_chat_messages.begin() + new_len);
+int32_t LLM::forkChat() {
+    std::lock_guard<std::mutex> lock(m_turn_mutex);
+    if (m_free_seqs.empty()) {
+        return -1;
+    }
+
+    // the fork shares every cell of the conversation, cells of a replaced conversation after it are not included
+    Fork fork;
+    fork.seq_id = m_free_seqs.back();
+    fork.tokens = m_context_tokens;
+    fork.shared = m_context_tokens.size();
+    fork.turns  = chatTurns();
+    m_free_seqs.pop_back();
+    llama_memory_seq_cp(llama_get_memory(m_context), CHAT_SEQ, fork.seq_id, 0, m_context_tokens.size());
+
+    m_forks[m_next_fork_id] = std::move(fork);
+    return m_next_fork_id++;
+}
+
+bool LLM::restoreFork(int32_t fork_id) {
+    std::lock_guard<std::mutex> lock(m_turn_mutex);
+    auto                        it = m_forks.find(fork_id);
+    if (it == m_forks.end()) {
+        return false;
+    }
+
+    // hold the fork's cells in the chat sequence, replaying its conversation then keeps them instead of evaluating it
+    Fork& fork = it->second;
+    releaseCandidates();
+    removeChatCells(0);
+    m_stale_tokens.clear();
+    llama_memory_seq_cp(llama_get_memory(m_context), fork.seq_id, CHAT_SEQ, -1, -1);
+    m_context_tokens = fork.tokens;
+    fork.shared      = fork.tokens.size();
+    return setChat(fork.turns);
+}
+
+void LLM::dropFork(int32_t fork_id) {
+    std::lock_guard<std::mutex> lock(m_turn_mutex);
+    auto                        it = m_forks.find(fork_id);
+    if (it != m_forks.end()) {
+        llama_memory_seq_rm(llama_get_memory(m_context), it->second.seq_id, -1, -1);
+        m_free_seqs.push_back(it->second.seq_id);
+        m_forks.erase(it);
+    }
+}
+
+void LLM::releaseCandidates() {
+    for (const auto& candidate : m_candidates) {
+        llama_memory_seq_rm(llama_get_memory(m_context), candidate.seq_id, -1, -1);
+        m_free_seqs.push_back(candidate.seq_id);
+    }
+    m_candidates.clear();
+}
+
+size_t LLM::forkCells() const {
+    size_t n_cells = 0;
+    for (const auto& [fork_id, fork] : m_forks) {
+        n_cells += fork.tokens.size() - fork.shared;
+    }
+    return n_cells;
+}
+
+void LLM::releaseForkCells() {
+    for (auto& [fork_id, fork] : m_forks) {
+        if (!fork.tokens.empty()) {
+            llama_memory_seq_rm(llama_get_memory(m_context), fork.seq_id, -1, -1);
+            fork.tokens.clear();
+            fork.shared = 0;
+            if (m_debug_level > 0) {
+                std::cout << "fork " << fork_id << " gave up its KV cells" << std::endl;
+            }
+        }
+    }
+}
+
+void LLM::removeChatCells(llama_pos start_pos) {
+    llama_memory_seq_rm(llama_get_memory(m_context), CHAT_SEQ, start_pos, -1);
+    for (auto& [fork_id, fork] : m_forks) {
+        fork.shared = std::min<size_t>(fork.shared, start_pos);
+    }
+}
+
+void LLM::setSeed(uint32_t seed) {
+    llama_sampler_free(m_sampler);
+    m_sampler = createSampler(m_temperature, seed);
+    m_seed    = seed;
+}
+
+llama_sampler* LLM::createSampler(float temperature, uint32_t seed) {
+    llama_sampler* sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(sampler, FusedSampler::init({ .temperature = temperature, .min_p = 0.05f, .seed = seed }));  // min-p filters low probability noise, temperature sets the level of creativity
+    return sampler;
+}
+
+bool LLM::checkGrammar(const ChatOptions& options, std::string* error) {
+    std::lock_guard<std::mutex> lock(m_turn_mutex);
+    return prepareGrammar(options, 1, error);
+}
+
+bool LLM::prepareGrammar(const ChatOptions& options, size_t n_replies, std::string* error) {
+    m_grammar           = nullptr;
+    std::string grammar = options.grammar;
+    if (grammar == "" && options.json_schema != "") {
+        std::string schema_error;
+        if (!JsonSchemaGrammar::convert(options.json_schema, grammar, schema_error)) {
+            std::cout << "could not use JSON schema: " << schema_error << std::endl;
+            if (error) {
+                *error = "could not use JSON schema: " + schema_error;
+            }
+            return false;
+        }
+    }
+    if (grammar == "") {
+        return true;
+    }
+
+    // replies to the same grammar reuse its parsed rules and the token masks of the states they reached
+    auto cached = std::find_if(m_grammars.begin(), m_grammars.end(), [&grammar](const auto& entry) {
+        return entry.first == grammar;
+    });
+    if (cached != m_grammars.end()) {
+        m_grammars.splice(m_grammars.begin(), m_grammars, cached);
+    } else {
+        auto compiled = std::make_unique<GrammarConstraint>(m_vocab, grammar);
+        if (!compiled->valid()) {
+            std::cout << "could not parse grammar!" << std::endl;
+            if (error) {
+                *error = options.grammar == "" ? "could not parse the grammar converted from the JSON schema" : "could not parse the grammar";
+            }
+            return false;
+        }
+        m_grammars.emplace_front(grammar, std::move(compiled));
+        while (m_grammars.size() > GRAMMAR_CACHE_SIZE) {
+            m_grammars.pop_back();
+        }
+    }
+    m_grammar = m_grammars.front().second.get();
+    m_grammar->begin(n_replies);
+    return true;
+}
+
+void LLM::setSystemPrompt(const std::string& system_prompt) {
+    m_system_prompt = system_prompt;
+    buildPrefixCache();
+    clearChat();
+}
+
+bool LLM::setAdapter(const std::string& adapter_path, float scale) {
+    std::lock_guard<std::mutex> lock(m_turn_mutex);
+    if (adapter_path == m_adapter_path && (adapter_path == "" || scale == m_adapter_scale)) {
+        return true;
+    }
+    auto switch_start = std::chrono::steady_clock::now();
+
+    // take the adapter from the cache, or load it
+    std::shared_ptr<llama_adapter_lora> adapter;
+    if (adapter_path != "") {
+        auto cached = std::find_if(m_adapters.begin(), m_adapters.end(), [&adapter_path](const auto& entry) {
+            return entry.first == adapter_path;
+        });
+        if (cached != m_adapters.end()) {
+            m_adapters.splice(m_adapters.begin(), m_adapters, cached);
+        } else {
+            std::shared_ptr<llama_adapter_lora> loaded = ModelRegistry::instance().acquireAdapter(m_model_handle, adapter_path);
+            if (!loaded) {
+                std::cout << "could not load LoRA adapter '" << adapter_path << "'" << std::endl;
+                return false;
+            }
+            m_adapters.emplace_front(adapter_path, std::move(loaded));
+        }
+        adapter = m_adapters.front().second;
+    }
+
+    // swap the adapter on the context, the base weights are untouched
+    llama_clear_adapter_lora(m_context);
+    if (adapter && llama_set_adapter_lora(m_context, adapter.get(), scale) != 0) {
+        std::cout << "could not apply LoRA adapter '" << adapter_path << "'" << std::endl;
+        auto previous = std::find_if(m_adapters.begin(), m_adapters.end(), [this](const auto& entry) {
+            return entry.first == m_adapter_path;
+        });
+        if (previous != m_adapters.end()) {
+            llama_set_adapter_lora(m_context, previous->second.get(), m_adapter_scale);
+            m_adapters.splice(m_adapters.begin(), m_adapters, previous);
+        }
+        return false;
+    }
+    m_adapter_path  = adapter_path;
+    m_adapter_scale = scale;
+    trimAdapterCache();
+
+    // cached cells were computed with the previous weights
+    rebuildKvCache();
+    if (m_debug_level > 0) {
+        std::cout << "switched to " << (m_adapter_path == "" ? std::string("base weights") : "adapter " + m_adapter_path) << " in " << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - switch_start).count() << " ms" << std::endl;
+    }
+    return true;
+}
+
+void LLM::setAdapterCacheSize(size_t cache_size) {
+    std::lock_guard<std::mutex> lock(m_turn_mutex);
+    m_adapter_cache_size = cache_size;
+    trimAdapterCache();
+}
+
+void LLM::trimAdapterCache() {
+    // the adapter in use is at the front, so it is never released
+    const size_t n_keep = std::max(m_adapter_cache_size, m_adapter_path == "" ? (size_t)0 : (size_t)1);
+    while (m_adapters.size() > n_keep) {
+        m_adapters.pop_back();
+    }
+}
+
+bool LLM::rebuildKvCache() {
+    std::vector<llama_token> chat_tokens = std::move(m_context_tokens);
+    m_stale_tokens.clear();
+    releaseCandidates();
+    releaseForkCells();
+    buildPrefixCache();
+
+    // share the preamble cells again and evaluate only the conversation that follows them
+    llama_memory_t memory = llama_get_memory(m_context);
+    removeChatCells(0);
+    size_t n_shared = 0;
+    if (chat_tokens.size() >= m_prefix_tokens.size() && std::equal(m_prefix_tokens.begin(), m_prefix_tokens.end(), chat_tokens.begin())) {
+        llama_memory_seq_cp(memory, PREFIX_SEQ, CHAT_SEQ, -1, -1);
+        n_shared = m_prefix_tokens.size();
+    }
+    m_unshared_prefix = n_shared > 0 ? 0 : m_prefix_tokens.size();
+    if (chat_tokens.size() > n_shared && !decodeTokens(m_context, chat_tokens.data() + n_shared, chat_tokens.size() - n_shared, CHAT_SEQ, n_shared)) {
+        std::cout << "failed to evaluate the chat with the new weights, chat cleared" << std::endl;
+        clearChat();
+        return false;
+    }
+    m_context_tokens = std::move(chat_tokens);
+    return true;
+}
+
+void LLM::buildPrefixCache() {
+    llama_memory_seq_rm(llama_get_memory(m_context), PREFIX_SEQ, -1, -1);
+
+    // format the preamble on its own
+    std::string preamble;
+    if (m_system_prompt != "") {
+        llama_chat_message system_message = { SYSTEM_ROLE, m_system_prompt.c_str() };
+        llama_chat_message probe_messages[] = { system_message, { USER_ROLE, "" } };
+
+        std::vector<char> formatted(m_system_prompt.size() + 256);
+        int               length = llama_chat_apply_template(m_chat_template, &system_message, 1, false, formatted.data(), formatted.size());
+        if (length > (int)formatted.size()) {
+            formatted.resize(length);
+            length = llama_chat_apply_template(m_chat_template, &system_message, 1, false, formatted.data(), formatted.size());
+        }
+        preamble = std::string(formatted.data(), std::max(length, 0));
+
+        // some templates merge the system prompt into the first user turn, in which case only BOS can be cached
+        std::vector<char> probe(preamble.size() + 256);
+        int               probe_length = llama_chat_apply_template(m_chat_template, probe_messages, 2, true, probe.data(), probe.size());
+        if (probe_length > (int)probe.size()) {
+            probe.resize(probe_length);
+            probe_length = llama_chat_apply_template(m_chat_template, probe_messages, 2, true, probe.data(), probe.size());
+        }
+        if (length < 0 || probe_length < (int)preamble.size() || std::string(probe.data(), preamble.size()) != preamble) {
+            if (m_debug_level > 1) {
+                std::cout << "chat template does not keep the system prompt separate, only caching BOS" << std::endl;
+            }
+            preamble.clear();
+        }
+    }
+
+    // tokenize with BOS so the prefix cache always covers the start of the sequence
+    std::vector<llama_token> prefix_tokens;
+    m_tokenizer.tokenize(preamble, true, prefix_tokens);
+
+    if (!decodeTokens(m_context, prefix_tokens.data(), prefix_tokens.size(), PREFIX_SEQ, 0)) {
+        std::cout << "failed to evaluate prefix cache!" << std::endl;
+        std::exit(1);
+    }
+
+    m_prefix_text_length = preamble.size();
+    m_prefix_tokens      = prefix_tokens;
+
+    if (m_debug_level > 1) {
+        std::cout << "prefix cache holds " << m_prefix_tokens.size() << " tokens" << std::endl;
+    }
+}
+
+bool LLM::decodeTokens(llama_context* context, const llama_token* tokens, size_t n_tokens, llama_seq_id seq_id, llama_pos start_pos, bool output_all) {
+    const size_t n_batch = llama_n_batch(context);
+
+    for (size_t chunk_start = 0; chunk_start < n_tokens; chunk_start += n_batch) {
+        const size_t chunk_end = std::min(n_tokens, chunk_start + n_batch);
+
+        m_batch.n_tokens = 0;
+        for (size_t i = chunk_start; i < chunk_end; ++i) {
+            m_batch.token[m_batch.n_tokens]     = tokens[i];
+            m_batch.pos[m_batch.n_tokens]       = start_pos + i;
+            m_batch.n_seq_id[m_batch.n_tokens]  = 1;
+            m_batch.seq_id[m_batch.n_tokens][0] = seq_id;
+            m_batch.logits[m_batch.n_tokens]    = output_all || i + 1 == n_tokens;
+            m_batch.n_tokens++;
+        }
+
+        if (llama_decode(context, m_batch) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool LLM::decodeChatTokens(const llama_token* tokens, size_t n_tokens, bool output_all, bool need_logits) {
+    // keep the cells of a replaced conversation while they hold the same tokens, the last token is evaluated again if its logits are needed
+    if (!m_stale_tokens.empty()) {
+        size_t n_common = 0;
+        while (n_common < n_tokens && n_common < m_stale_tokens.size() && tokens[n_common] == m_stale_tokens[n_common]) {
+            ++n_common;
+        }
+        if (n_common == n_tokens && (need_logits || output_all) && n_common > 0) {
+            --n_common;
+        }
+        m_context_tokens.insert(m_context_tokens.end(), tokens, tokens + n_common);
+        m_stale_tokens.erase(m_stale_tokens.begin(), m_stale_tokens.begin() + n_common);
+        m_reused_tokens += n_common;
+        tokens          += n_common;
+        n_tokens        -= n_common;
+        if (n_tokens == 0) {
+            return true;
+        }
+        dropStaleTokens();
+    }
+
+    // check that we still have context space available
+    if (!ensureContextSpace(n_tokens)) {
+        std::cout << "context exceeded!" << std::endl;
+        return false;
+    }
+
+    // run the tokens through the network; updates KV-cache in context with batch tokens
+    if (!decodeTokens(m_context, tokens, n_tokens, CHAT_SEQ, m_context_tokens.size(), output_all)) {
+        // no free slot in a fragmented cache: drop the chunks already decoded, free the cells of the reply candidates and try once more;
+        // forks belong to the caller and keep theirs
+        removeChatCells(m_context_tokens.size());
+        const bool freed = !m_candidates.empty();
+        releaseCandidates();
+        if (!freed || !decodeTokens(m_context, tokens, n_tokens, CHAT_SEQ, m_context_tokens.size(), output_all)) {
+            std::cout << "decode failure, no room for the tokens in the KV cache!" << std::endl;
+            removeChatCells(m_context_tokens.size());
+            return false;
+        }
+    }
+    m_context_tokens.insert(m_context_tokens.end(), tokens, tokens + n_tokens);
+    return true;
+}
+
+bool LLM::ensureContextSpace(size_t n_tokens) {
+    // a preamble the chat sequence does not share with the prefix sequence takes its cells twice
+    const size_t n_ctx = llama_n_ctx(m_context) - std::min<size_t>(m_unshared_prefix, llama_n_ctx(m_context));
+    if (m_context_tokens.size() + n_tokens + forkCells() <= n_ctx) {
+        return true;
+    }
+
+    // forks give up their cells first, shifting positions would also move the cells they share with the chat sequence
+    releaseForkCells();
+    if (m_context_tokens.size() + n_tokens <= n_ctx) {
+        return true;
+    }
+
+    // the preamble is always kept, so the tokens have to fit alongside it
+    const size_t   n_keep = m_prefix_tokens.size();
+    llama_memory_t memory = llama_get_memory(m_context);
+    if (n_keep + n_tokens > n_ctx || m_context_tokens.size() <= n_keep || !llama_memory_can_shift(memory)) {
+        return false;
+    }
+
+    // free at least half of the chat so shifting is not needed again on the next token
+    const size_t n_needed     = m_context_tokens.size() + n_tokens - n_ctx;
+    const size_t n_target     = std::max(n_needed, (m_context_tokens.size() - n_keep) / 2);
+    size_t       discard_end  = 0;
+    size_t       turns_erased = 0;
+
+    // prefer discarding whole turns so the chat history can be trimmed to match
+    for (size_t turn = 1; turn < m_turn_starts.size(); ++turn) {
+        if (m_turn_starts[turn].token_pos >= n_keep + n_target) {
+            discard_end  = m_turn_starts[turn].token_pos;
+            turns_erased = turn;
+            break;
+        }
+    }
+
+    // a single turn is too long, discard all earlier turns and the oldest part of the current one
+    if (turns_erased == 0) {
+        discard_end  = std::min(m_context_tokens.size(), n_keep + std::max(n_needed, n_target));
+        turns_erased = m_turn_starts.empty() ? 0 : m_turn_starts.size() - 1;
+    }
+    const size_t n_discard = discard_end - n_keep;
+
+    // remove the discarded cells and move the remaining ones back to follow the preamble
+    llama_memory_seq_rm(memory, CHAT_SEQ, n_keep, discard_end);
+    llama_memory_seq_add(memory, CHAT_SEQ, discard_end, -1, -static_cast<llama_pos>(n_discard));
+    m_context_tokens.erase(m_context_tokens.begin() + n_keep, m_context_tokens.begin() + discard_end);
+
+    // keep the draft context aligned with the chat sequence
+    if (m_draft_model && m_draft_tokens.size() > n_keep) {
+        const size_t   draft_end    = std::min(discard_end, m_draft_tokens.size());
+        llama_memory_t draft_memory = llama_get_memory(m_draft_context);
+        llama_memory_seq_rm(draft_memory, 0, n_keep, draft_end);
+        llama_memory_seq_add(draft_memory, 0, draft_end, -1, -static_cast<llama_pos>(draft_end - n_keep));
+        m_draft_tokens.erase(m_draft_tokens.begin() + n_keep, m_draft_tokens.begin() + draft_end);
+    }
+
+    // trim the chat history of the discarded turns, text already given to the model moves back by the length removed
+    if (turns_erased > 0) {
+        const uint32_t first_message    = m_turn_starts.front().message_index;
+        const uint32_t n_messages       = m_turn_starts[turns_erased].message_index - first_message;
+        const size_t   formatted_length = m_chat.formatted().size();
+        m_chat.erase(first_message, n_messages);
+        m_prev_prompt_length = std::max<int>(0, m_prev_prompt_length - (formatted_length - m_chat.formatted().size()));
+        m_turn_starts.erase(m_turn_starts.begin(), m_turn_starts.begin() + turns_erased);
+        for (auto& turn_start : m_turn_starts) {
+            turn_start.message_index -= n_messages;
+        }
+    }
+    for (auto& turn_start : m_turn_starts) {
+        turn_start.token_pos = turn_start.token_pos > discard_end ? turn_start.token_pos - n_discard : n_keep;
+    }
+
+    if (m_debug_level > 0) {
+        std::cout << "context shifted: discarded " << n_discard << " tokens and " << turns_erased << " turns" << std::endl;
+    }
+
+    return m_context_tokens.size() + n_tokens <= n_ctx;
+}
+
+std::vector<llama_token> LLM::draftTokens(llama_token last_token) {
+    std::vector<llama_token> draft;
+    if (!m_draft_model) {
+        return m_lookup_ngram > 0 ? lookupTokens(last_token) : draft;
+    }
+
+    // bring the draft context in line with the chat, only re-evaluating from the first token that differs
+    size_t common = 0;
+    while (common < m_draft_tokens.size() && common < m_context_tokens.size() && m_draft_tokens[common] == m_context_tokens[common]) {
+        ++common;
+    }
+    llama_memory_seq_rm(llama_get_memory(m_draft_context), 0, common, -1);
+    m_draft_tokens.resize(common);
+
+    std::vector<llama_token> pending(m_context_tokens.begin() + common, m_context_tokens.end());
+    pending.push_back(last_token);
+
+    // greedily propose tokens, each one is fed back to propose the next
+    const int n_draft = std::min<int>(m_n_draft, llama_n_ctx(m_context) - m_context_tokens.size() - 1);
+    for (int i = 0; i < n_draft; ++i) {
+        if (!decodeTokens(m_draft_context, pending.data(), pending.size(), 0, m_draft_tokens.size())) {
+            break;
+        }
+        m_draft_tokens.insert(m_draft_tokens.end(), pending.begin(), pending.end());
+
+        const llama_token draft_token = llama_sampler_sample(m_draft_sampler, m_draft_context, -1);
+        if (llama_vocab_is_eog(m_vocab, draft_token)) {
+            break;
+        }
+        draft.push_back(draft_token);
+        pending = { draft_token };
+    }
+
+    return draft;
+}
+
+std::vector<llama_token> LLM::lookupTokens(llama_token last_token) {
+    std::vector<llama_token> draft;
+
+    // index the runs of the context that are followed by a token, starting again if the context changed in the indexed part
+    const size_t common = std::mismatch(m_lookup_tokens.begin(), m_lookup_tokens.end(), m_context_tokens.begin(), m_context_tokens.end()).first - m_lookup_tokens.begin();
+    if (common < m_lookup_tokens.size()) {
+        m_lookup_index.clear();
+        m_lookup_tokens.clear();
+    }
+    for (size_t end = m_lookup_tokens.empty() ? 0 : m_lookup_tokens.size() - 1; end + 1 < m_context_tokens.size(); ++end) {
+        for (size_t n = LOOKUP_MIN_NGRAM; n <= std::min<size_t>(m_lookup_ngram, end + 1); ++n) {
+            m_lookup_index[ngramKey(m_context_tokens.data() + end + 1 - n, n)] = end + 1;
+        }
+    }
+    m_lookup_tokens.insert(m_lookup_tokens.end(), m_context_tokens.begin() + m_lookup_tokens.size(), m_context_tokens.end());
+
+    // the run looked up is the latest context tokens followed by the sampled token, the longest one found proposes what followed it
+    const size_t             n_context = m_context_tokens.size();
+    const int64_t            n_draft   = std::min<int64_t>(m_lookup_draft, (int64_t)llama_n_ctx(m_context) - n_context - 1);
+    std::vector<llama_token> run(m_context_tokens.end() - std::min<size_t>(n_context, m_lookup_ngram - 1), m_context_tokens.end());
+    run.push_back(last_token);
+    for (size_t n = run.size(); n >= LOOKUP_MIN_NGRAM && draft.empty(); --n) {
+        const llama_token* ngram = run.data() + run.size() - n;
+        auto               found = m_lookup_index.find(ngramKey(ngram, n));
+        if (found == m_lookup_index.end() || !std::equal(ngram, ngram + n, m_context_tokens.begin() + found->second - n)) {
+            continue;
+        }
+        for (size_t pos = found->second; pos < n_context && (int64_t)draft.size() < n_draft && !llama_vocab_is_eog(m_vocab, m_context_tokens[pos]); ++pos) {
+            draft.push_back(m_context_tokens[pos]);
+        }
+    }
+
+    return draft;
+}
+
+uint64_t LLM::ngramKey(const llama_token* tokens, size_t n_tokens) {
+    // FNV-1a over the token values, the length separates runs that hash the same otherwise
+    uint64_t       hash  = (0xcbf29ce484222325ULL ^ n_tokens) * 0x100000001b3ULL;
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(tokens);
+    for (size_t i = 0; i < n_tokens * sizeof(llama_token); ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+std::string LLM::getChatResponse(std::string prompt) {
+    return getChatResponse(prompt, nullptr);
+}
+
+std::string LLM::getChatResponse(std::string prompt, const std::function<void(const std::string&)>& on_piece) {
+    ChatOptions options;
+    options.on_piece = on_piece;
+    return getChatResponse(std::move(prompt), options).text;
+}
+
+ChatResult LLM::getChatResponse(std::string prompt, const ChatOptions& options) {
+    std::lock_guard<std::mutex> lock(m_turn_mutex);
+    return runTurn(std::move(prompt), options, nullptr);
+}
+
+ChatHandle LLM::getChatResponseAsync(std::string prompt, ChatOptions options) {
+    auto                             cancel = std::make_shared<std::atomic<bool>>(false);
+    std::packaged_task<ChatResult()> task([this, prompt = std::move(prompt), options = std::move(options), cancel]() mutable {
+        std::lock_guard<std::mutex> lock(m_turn_mutex);
+        return runTurn(std::move(prompt), options, cancel.get());
+    });
+    ChatHandle handle(task.get_future(), cancel);
+
+    // the worker is started on first use so synchronous-only users do not pay for the thread
+    {
+        std::lock_guard<std::mutex> lock(m_async_mutex);
+        m_async_jobs.push_back({ std::move(task), cancel });
+        if (!m_async_worker.joinable()) {
+            m_async_worker = std::thread(&LLM::asyncLoop, this);
+        }
+    }
+    m_async_cv.notify_one();
+    return handle;
+}
+
+void LLM::asyncLoop() {
+    while (true) {
+        AsyncJob job;
+        {
+            std::unique_lock<std::mutex> lock(m_async_mutex);
+            m_async_cv.wait(lock, [this]() {
+                return m_async_stopping || !m_async_jobs.empty();
+            });
+            if (m_async_jobs.empty()) {
+                return;
+            }
+            job = std::move(m_async_jobs.front());
+            m_async_jobs.pop_front();
+            m_async_current = job.cancel;
+        }
+
+        job.task();
+
+        std::lock_guard<std::mutex> lock(m_async_mutex);
+        m_async_current.reset();
+    }
+}
+
+ChatResult LLM::runTurn(std::string prompt, const ChatOptions& options, const std::atomic<bool>* cancel, bool retrieve) {
+    // a turn cancelled or out of time before it starts leaves the chat untouched
+    if (cancel && cancel->load(std::memory_order_relaxed)) {
+        return { "", FinishReason::CANCELLED };
+    }
+    if (options.deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= options.deadline) {
+        return { "", FinishReason::DEADLINE };
+    }
+    if (!prepareGrammar(options, 1)) {
+        return { "", FinishReason::GRAMMAR_ERROR };
+    }
+
+    // clocks are only read when metrics are recorded
+    const bool record_metrics = metricsEnabled();
+    const auto turn_start     = record_metrics ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+    if (record_metrics) {
+        m_turn_metrics = TurnMetrics();
+    }
+
+    // the reply candidates of the last turn no longer follow the chat
+    releaseCandidates();
+    std::string llm_input = appendPrompt(std::move(prompt), retrieve);
+    if (record_metrics) {
+        m_turn_metrics.format_time = std::chrono::steady_clock::now() - turn_start - m_turn_metrics.retrieval_time;
+    }
 
     // generate a response
-    std::string response = getResponseString(llm_input);
+    size_t     context_bytes    = 0;
+    bool       prompt_evaluated = false;
+    ChatResult result           = getResponseString(llm_input, options, cancel, context_bytes, prompt_evaluated);
+    if (prompt_evaluated) {
+        appendReply(result.text, context_bytes);
+    } else {
+        rollbackPrompt(llm_input.size());
+    }
+
+    if (record_metrics) {
+        completeTurnMetrics(turn_start);
+    }
+
+    return result;
+}
 
-    // add the response to the messages
-    m_chat_history.push_back({ "machine: ", strdup(response.c_str()) });
-    m_prev_prompt_length = llama_chat_apply_template(m_chat_template, m_chat_history.data(), m_chat_history.size(), false, nullptr, 0);
-    if (m_prev_prompt_length < 0) {
+std::string LLM::appendPrompt(std::string prompt, bool retrieve) {
+    // ground the reply in the most relevant passages from the retrieval index
+    if (retrieve && m_retrieval_index && m_retrieval_top_k > 0) {
+        const auto retrieval_start = std::chrono::steady_clock::now();
+        prompt                     = retrieveContext(prompt) + prompt;
+        if (metricsEnabled()) {
+            m_turn_metrics.retrieval_time = std::chrono::steady_clock::now() - retrieval_start;
+        }
+    }
+
+    // add the user input to the message list, only the new message is formatted
+    const int64_t changed = m_chat.append(USER_ROLE, prompt, true);
+    if (changed < 0) {
+        std::cout << "could not apply chat template!" << std::endl;
+        std::exit(1);
+    }
+    if (changed < m_prev_prompt_length && m_debug_level > 1) {
+        std::cout << "chat template rewrote text already given to the model" << std::endl;
+    }
+
+    // remove previous messages to obtain the prompt to give to the LLM to generate the response
+    std::string llm_input = m_chat.formatted().substr(m_prev_prompt_length);
+    m_prev_prompt_length  = m_chat.formatted().size();
+    m_turn_starts.push_back({ static_cast<uint32_t>(m_context_tokens.size()), static_cast<uint32_t>(m_chat.messages().size() - 1) });
+    return llm_input;
+}
+
+void LLM::appendReply(const std::string& response, size_t context_bytes) {
+    // the model has seen the reply, or the part of it whose tokens are kept, but not the template text closing it
+    const size_t reply_start = m_chat.formatted().size();
+    if (m_chat.append(MACHINE_ROLE, response, false) < 0) {
         std::cout << "failed to apply chat template!" << std::endl;
         std::exit(1);
     }
+    const size_t reply_offset = m_chat.formatted().find(response, reply_start);
+    m_prev_prompt_length      = reply_offset != std::string::npos ? reply_offset + context_bytes : m_chat.formatted().size();
+}
 
-    return m_chat_history.back().content;
+void LLM::rollbackPrompt(size_t prompt_length) {
+    // a context shift while evaluating the prompt keeps the turn's start in step with the history and moves text given to the model back
+    const TurnStart turn = m_turn_starts.back();
+    m_turn_starts.pop_back();
+    removeChatCells(turn.token_pos);
+    m_context_tokens.resize(std::min<size_t>(m_context_tokens.size(), turn.token_pos));
+    m_chat.erase(turn.message_index, 1);
+    m_prev_prompt_length = std::max<int>(0, m_prev_prompt_length - (int)prompt_length);
 }
 
-std::string LLM::getResponseString(std::string prompt) {
-    // check if this is the first turn
-    const bool is_first = llama_memory_seq_pos_max(llama_get_memory(m_context), 0) == -1;
+void LLM::completeTurnMetrics(std::chrono::steady_clock::time_point turn_start) {
+    m_turn_metrics.total_time    = std::chrono::steady_clock::now() - turn_start;
+    m_turn_metrics.kv_cells_used = m_context_tokens.size();
+    m_turn_metrics.n_ctx         = llama_n_ctx(m_context);
+    m_turn_metrics.history_bytes = m_chat.contentBytes();
+    if (m_debug_level > 0) {
+        std::cout << "context used: " << m_turn_metrics.kv_cells_used << "/" << m_turn_metrics.n_ctx << " tokens, history: " << m_turn_metrics.history_bytes << " bytes" << std::endl;
+    }
+    if (m_metrics_observer) {
+        m_metrics_observer(m_turn_metrics);
+    }
+}
+
+size_t LLM::findStop(const std::string& response, size_t piece_size, const std::vector<std::string>& stop, size_t max_stop) {
+    const size_t search_start = response.size() - std::min(response.size(), piece_size + max_stop - 1);
+    size_t       stop_start   = std::string::npos;
+    for (const auto& stop_string : stop) {
+        if (!stop_string.empty()) {
+            stop_start = std::min(stop_start, response.find(stop_string, search_start));
+        }
+    }
+    return stop_start;
+}
+
+bool LLM::addTurn(const std::string& prompt, const std::string& reply) {
+    releaseCandidates();
+
+    // format both messages, unlike a generated reply the model is also given the template text closing it
+    const uint32_t message_index = m_chat.messages().size();
+    if (m_chat.append(USER_ROLE, prompt, true) < 0 || m_chat.append(MACHINE_ROLE, reply, false) < 0) {
+        std::cout << "could not apply chat template!" << std::endl;
+        std::exit(1);
+    }
+    std::string llm_input = m_chat.formatted().substr(m_prev_prompt_length);
+    m_prev_prompt_length  = m_chat.formatted().size();
+    m_turn_starts.push_back({ static_cast<uint32_t>(m_context_tokens.size()), message_index });
+
+    if (!m_tokenizer.tokenize(llm_input, m_context_tokens.empty(), m_prompt_tokens)) {
+        std::cout << "failed to tokenize prompt!" << std::endl;
+        return false;
+    }
+    m_prefix_tokens_saved = 0;
+    return decodeChatTokens(m_prompt_tokens.data(), m_prompt_tokens.size(), false, false);
+}
+
+EmbeddingMatrix LLM::embed(std::span<const std::string> texts, EmbeddingPooling pooling, bool normalize) {
+    EmbeddingMatrix matrix;
+    if (texts.empty()) {
+        return matrix;
+    }
+    if (!ensureEmbedContext(pooling)) {
+        std::cout << "embeddings context initialization failed!" << std::endl;
+        return matrix;
+    }
+    const size_t n_batch = llama_n_batch(m_embed_context);
+    const size_t n_seq   = llama_n_seq_max(m_embed_context);
+
+    // tokenize every text into one flat buffer
+    m_embed_tokens.clear();
+    m_embed_offsets.assign(1, 0);
+    for (const auto& text : texts) {
+        if (m_tokenizer.tokenize(text, true, m_prompt_tokens)) {
+            m_embed_tokens.insert(m_embed_tokens.end(), m_prompt_tokens.begin(), m_prompt_tokens.begin() + std::min(m_prompt_tokens.size(), n_batch));
+        }
+        m_embed_offsets.push_back(m_embed_tokens.size());
+    }
+
+    matrix.rows = texts.size();
+    matrix.dim  = llama_model_n_embd(m_model);
+    matrix.values.assign(matrix.rows * matrix.dim, 0.0f);
+
+    // evaluate the texts packed in the batch and copy their pooled embeddings, sequence i holds row first_row + i
+    size_t first_row      = 0;
+    auto   evaluate_batch = [&](size_t end_row) {
+        if (m_embed_batch.n_tokens == 0) {
+            return true;
+        }
+        if (llama_memory_t memory = llama_get_memory(m_embed_context)) {
+            llama_memory_clear(memory, true);
+        }
+        if (llama_decode(m_embed_context, m_embed_batch) != 0) {
+            return false;
+        }
+        for (size_t row = first_row; row < end_row; ++row) {
+            if (m_embed_offsets[row + 1] == m_embed_offsets[row]) {
+                continue;  // nothing to embed, the row stays zero
+            }
+            const float* embedding = llama_get_embeddings_seq(m_embed_context, row - first_row);
+            if (!embedding) {
+                return false;
+            }
+            float* destination = matrix.values.data() + row * matrix.dim;
+            std::copy(embedding, embedding + matrix.dim, destination);
+            if (normalize) {
+                double norm = 0.0;
+                for (size_t i = 0; i < matrix.dim; ++i) {
+                    norm += (double)destination[i] * destination[i];
+                }
+                const float scale = norm > 0.0 ? 1.0 / std::sqrt(norm) : 0.0;
+                for (size_t i = 0; i < matrix.dim; ++i) {
+                    destination[i] *= scale;
+                }
+            }
+        }
+        m_embed_batch.n_tokens = 0;
+        return true;
+    };
+
+    // pack texts until the batch runs out of tokens or sequences
+    m_embed_batch.n_tokens = 0;
+    for (size_t row = 0; row < matrix.rows; ++row) {
+        const size_t n_tokens = m_embed_offsets[row + 1] - m_embed_offsets[row];
+        if (m_embed_batch.n_tokens + n_tokens > n_batch || row - first_row >= n_seq) {
+            if (!evaluate_batch(row)) {
+                std::cout << "failed to compute embeddings!" << std::endl;
+                return EmbeddingMatrix();
+            }
+            first_row = row;
+        }
+        for (size_t i = 0; i < n_tokens; ++i) {
+            const int32_t index            = m_embed_batch.n_tokens++;
+            m_embed_batch.token[index]     = m_embed_tokens[m_embed_offsets[row] + i];
+            m_embed_batch.pos[index]       = i;
+            m_embed_batch.n_seq_id[index]  = 1;
+            m_embed_batch.seq_id[index][0] = row - first_row;
+            m_embed_batch.logits[index]    = true;
+        }
+    }
+    if (!evaluate_batch(matrix.rows)) {
+        std::cout << "failed to compute embeddings!" << std::endl;
+        return EmbeddingMatrix();
+    }
+
+    return matrix;
+}
+
+std::string LLM::retrieveContext(const std::string& prompt) {
+    if (m_retrieval_index->size() == 0) {
+        return "";
+    }
+    EmbeddingMatrix query = embed(std::span<const std::string>(&prompt, 1), m_retrieval_index->pooling(), true);
+    if (query.rows != 1 || query.dim != m_retrieval_index->dim()) {
+        if (m_debug_level > 0) {
+            std::cout << "retrieval index does not match the model embeddings, no passages added" << std::endl;
+        }
+        return "";
+    }
+
+    std::vector<SearchResult> results = m_retrieval_index->search(query.row(0), m_retrieval_top_k);
+    if (results.empty()) {
+        return "";
+    }
+    std::string context = "Use these passages if they are relevant:\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        context += "[" + std::to_string(i + 1) + "] ";
+        context += m_retrieval_index->document(results[i].id);
+        context += "\n";
+    }
+    context += "\nQuestion: ";
+
+    if (m_debug_level > 1) {
+        std::cout << "retrieved " << results.size() << " passages, best score " << results.front().score << std::endl;
+    }
+    return context;
+}
+
+bool LLM::ensureEmbedContext(EmbeddingPooling pooling) {
+    if (m_embed_context && m_embed_pooling == pooling) {
+        return true;
+    }
+    if (m_embed_context) {
+        llama_free(m_embed_context);
+        m_embed_context = nullptr;
+    }
+
+    // every text of a batch must be in one micro-batch so pooling sees all of its tokens
+    auto embed_parameters            = llama_context_default_params();
+    embed_parameters.n_ctx           = EMBED_BATCH;
+    embed_parameters.n_batch         = EMBED_BATCH;
+    embed_parameters.n_ubatch        = EMBED_BATCH;
+    embed_parameters.n_seq_max       = EMBED_MAX_SEQ;
+    embed_parameters.kv_unified      = true;  // texts of different lengths share the whole context
+    embed_parameters.n_threads       = m_engine_config.n_threads;
+    embed_parameters.n_threads_batch = m_engine_config.n_threads_batch;
+    embed_parameters.embeddings      = true;
+    embed_parameters.pooling_type    = pooling == EmbeddingPooling::MEAN ? LLAMA_POOLING_TYPE_MEAN : pooling == EmbeddingPooling::CLS ? LLAMA_POOLING_TYPE_CLS : LLAMA_POOLING_TYPE_LAST;
+    m_embed_context                  = llama_init_from_model(m_model, embed_parameters);
+    if (!m_embed_context) {
+        return false;
+    }
+    m_embed_pooling = pooling;
+
+    if (!m_embed_batch.token) {
+        m_embed_batch = llama_batch_init(EMBED_BATCH, 0, 1);
+    }
+    return true;
+}
+
+bool LLM::saveSession(const std::string& path) {
+    std::vector<uint8_t> state;
+    saveState(state);
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cout << "could not open session file '" << path << "' for writing!" << std::endl;
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(state.data()), state.size());
+    if (!file) {
+        std::cout << "failed to write session file '" << path << "'!" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool LLM::loadSession(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cout << "could not open session file '" << path << "'!" << std::endl;
+        return false;
+    }
+    std::vector<uint8_t> state((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (file.bad()) {
+        std::cout << "failed to read session file '" << path << "'!" << std::endl;
+        return false;
+    }
+
+    return loadState(state);
+}
+
+void LLM::saveState(std::vector<uint8_t>& state) {
+    dropStaleTokens();
+    state.clear();
+    auto write_bytes = [&state](const void* data, size_t size) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        state.insert(state.end(), bytes, bytes + size);
+    };
+    auto write_value = [&write_bytes](const auto& value) {
+        write_bytes(&value, sizeof(value));
+    };
+    auto write_string = [&write_bytes, &write_value](const char* str) {
+        const uint32_t length = std::strlen(str);
+        write_value(length);
+        write_bytes(str, length);
+    };
+
+    // header identifying the format and the model the cache belongs to
+    write_value(SESSION_MAGIC);
+    write_value(SESSION_VERSION);
+    write_value(getModelHash());
+
+    // chat state
+    write_value(static_cast<int32_t>(m_prev_prompt_length));
+    write_value(static_cast<uint32_t>(m_chat.messages().size()));
+    for (const auto& msg : m_chat.messages()) {
+        write_string(msg.role);
+        write_string(msg.content);
+    }
+
+    // tokens held in the chat sequence
+    write_value(static_cast<uint32_t>(m_context_tokens.size()));
+    write_bytes(m_context_tokens.data(), m_context_tokens.size() * sizeof(llama_token));
 
-    // tokenize the input string
-    const int num_tokens = std::abs(llama_tokenize(m_vocab, prompt.c_str(), prompt.size(), NULL, 0, is_first, true));  // call first with null to get buffer size; a negative number means the buffer is too small
+    // turn boundaries used for context shifting
+    write_value(static_cast<uint32_t>(m_turn_starts.size()));
+    write_bytes(m_turn_starts.data(), m_turn_starts.size() * sizeof(TurnStart));
+
+    // KV cache of the chat sequence, written in place after its size
+    const size_t size_offset = state.size();
+    write_value(static_cast<uint64_t>(0));
+    const size_t data_offset = state.size();
+    state.resize(data_offset + llama_state_seq_get_size(m_context, CHAT_SEQ));
+    const uint64_t state_size = llama_state_seq_get_data(m_context, state.data() + data_offset, state.size() - data_offset, CHAT_SEQ);
+    std::memcpy(state.data() + size_offset, &state_size, sizeof(state_size));
+    state.resize(data_offset + state_size);
 
     if (m_debug_level > 0) {
-        std::cout << "input tokens: " << num_tokens << std::endl;
+        std::cout << "saved session: " << m_chat.messages().size() << " messages, " << state_size << " bytes of KV state" << std::endl;
     }
+}
 
-    std::vector<llama_token> prompt_tokens(num_tokens);
-    llama_tokenize(m_vocab, prompt.c_str(), prompt.size(), prompt_tokens.data(), prompt_tokens.size(), is_first, true);  // fill out tokens
+bool LLM::loadState(std::span<const uint8_t> state) {
+    size_t offset     = 0;
+    auto   read_bytes = [&state, &offset](void* data, size_t size) {
+        if (size > state.size() - offset) {
+            return false;
+        }
+        std::memcpy(data, state.data() + offset, size);
+        offset += size;
+        return true;
+    };
+    auto read_value = [&read_bytes](auto& value) {
+        return read_bytes(&value, sizeof(value));
+    };
+    auto read_string = [&read_bytes, &read_value](std::string& str) {
+        uint32_t length = 0;
+        if (!read_value(length)) {
+            return false;
+        }
+        str.resize(length);
+        return read_bytes(str.data(), length);
+    };
 
-    // get batch to tell llama which tokens to process
-    llama_batch token_batch = llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
-    llama_token new_token_id;
+    // validate the header before touching the current chat
+    uint32_t magic      = 0;
+    uint32_t version    = 0;
+    uint64_t model_hash = 0;
+    if (!read_value(magic) || !read_value(version) || !read_value(model_hash) || magic != SESSION_MAGIC) {
+        std::cout << "not a session!" << std::endl;
+        return false;
+    }
+    if (version != SESSION_VERSION) {
+        std::cout << "session version " << version << " does not match expected version " << SESSION_VERSION << "!" << std::endl;
+        return false;
+    }
+    if (model_hash != getModelHash()) {
+        std::cout << "session was saved for a different model!" << std::endl;
+        return false;
+    }
 
-    // string to hold network response
-    std::string response;
+    // empty the chat sequence entirely, the saved state includes its own copy of the preamble
+    removeChatCells(0);
+    m_stale_tokens.clear();
+    releaseCandidates();
+    m_chat.clear();
+    m_prefix_tokens_saved = 0;
 
-    // record start time of response
-    auto response_start = std::chrono::steady_clock::now();
-    auto last_dot_time  = response_start;
+    // chat state
+    int32_t  prev_prompt_length = 0;
+    uint32_t num_messages       = 0;
+    bool     success            = read_value(prev_prompt_length) && read_value(num_messages);
+    for (uint32_t i = 0; success && i < num_messages; ++i) {
+        std::string role;
+        std::string content;
+        success = read_string(role) && read_string(content);
+        if (success) {
+            const char* message_role = role == SYSTEM_ROLE ? SYSTEM_ROLE : (role == USER_ROLE ? USER_ROLE : MACHINE_ROLE);
+            success = m_chat.append(message_role, content, false) >= 0;
+        }
+    }
 
-    // process the tokens
-    while (true) {
-        int n_ctx      = llama_n_ctx(m_context);  // total token capacity
-        int n_ctx_used = llama_memory_seq_pos_max(llama_get_memory(m_context), 0) + 1;  // current position in input token vector
+    // tokens held in the chat sequence
+    uint32_t num_tokens = 0;
+    success             = success && read_value(num_tokens);
+    if (success) {
+        m_context_tokens.resize(num_tokens);
+        success = read_bytes(m_context_tokens.data(), num_tokens * sizeof(llama_token));
+    }
+
+    // turn boundaries used for context shifting
+    uint32_t num_turns = 0;
+    success            = success && read_value(num_turns);
+    if (success) {
+        m_turn_starts.resize(num_turns);
+        success = read_bytes(m_turn_starts.data(), num_turns * sizeof(TurnStart));
+    }
 
-        // check that we still have context space available
-        if (n_ctx_used + token_batch.n_tokens > n_ctx) {
-            std::cout << "context exceeded!" << std::endl;
+    // KV cache of the chat sequence
+    uint64_t state_size = 0;
+    success             = success && read_value(state_size) && state_size <= state.size() - offset;
+    success             = success && llama_state_seq_set_data(m_context, state.data() + offset, state_size, CHAT_SEQ) != 0;
+
+    if (!success) {
+        std::cout << "failed to read session!" << std::endl;
+        clearChat();
+        return false;
+    }
+
+    m_prev_prompt_length = prev_prompt_length;
+
+    // the saved state holds its own copy of the preamble, share the prefix sequence's cells again so they are not held twice
+    const size_t   n_keep = m_prefix_tokens.size();
+    llama_memory_t memory = llama_get_memory(m_context);
+    if (m_context_tokens.size() >= n_keep && std::equal(m_prefix_tokens.begin(), m_prefix_tokens.end(), m_context_tokens.begin())) {
+        llama_memory_seq_rm(memory, CHAT_SEQ, 0, n_keep);
+        llama_memory_seq_cp(memory, PREFIX_SEQ, CHAT_SEQ, 0, n_keep);
+        m_unshared_prefix = 0;
+    } else {
+        m_unshared_prefix = n_keep;
+    }
+
+    if (m_debug_level > 0) {
+        std::cout << "loaded session: " << m_chat.messages().size() << " messages, " << llama_memory_seq_pos_max(llama_get_memory(m_context), CHAT_SEQ) + 1 << " tokens" << std::endl;
+    }
+
+    return true;
+}
+
+uint64_t LLM::getModelHash() const {
+    // FNV-1a over the values that identify the model file
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    auto     add  = [&hash](const void* data, size_t size) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
         }
+    };
 
-        // run the token through the network; updates KV-cache in context with batch tokens
-        int ret = llama_decode(m_context, token_batch);
-        if (ret != 0) {
-            // decode failure!
-            std::cout << "Decode failure" << std::endl;
-            GGML_ABORT("failed to decode");
+    char      description[256];
+    const int max_length = sizeof(description) - 1;
+    int       n          = llama_model_desc(m_model, description, sizeof(description));
+    add(description, std::clamp(n, 0, max_length));
+    n = llama_model_meta_val_str(m_model, "general.name", description, sizeof(description));
+    add(description, std::clamp(n, 0, max_length));
+
+    const uint64_t values[] = {
+        llama_model_size(m_model),
+        llama_model_n_params(m_model),
+        static_cast<uint64_t>(llama_vocab_n_tokens(m_vocab)),
+        static_cast<uint64_t>(llama_model_n_embd(m_model)),
+        static_cast<uint64_t>(llama_model_n_layer(m_model)),
+    };
+    add(values, sizeof(values));
+
+    // an adapter changes the KV cells as much as a different model does
+    if (m_adapter_path != "") {
+        add(m_adapter_path.data(), m_adapter_path.size());
+        add(&m_adapter_scale, sizeof(m_adapter_scale));
+    }
+
+    return hash;
+}
+
+ChatResult LLM::getResponseString(std::string prompt, const ChatOptions& options, const std::atomic<bool>* cancel, size_t& context_bytes, bool& prompt_evaluated) {
+    prompt_evaluated = false;
+
+    // check if this is the first turn
+    const bool is_first = m_context_tokens.empty();
+
+    // clocks are only read when metrics are recorded
+    const bool record_metrics = metricsEnabled();
+    auto       now            = [record_metrics]() {
+        return record_metrics ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+    };
+
+    // tokenize the input string into the reused token buffer
+    auto tokenize_start = now();
+    if (!m_tokenizer.tokenize(prompt, is_first, m_prompt_tokens)) {
+        std::cout << "failed to tokenize prompt!" << std::endl;
+        return { "", FinishReason::CONTEXT_FULL };
+    }
+    const std::vector<llama_token>& prompt_tokens = m_prompt_tokens;
+
+    if (record_metrics) {
+        m_turn_metrics.tokenize_time       = now() - tokenize_start;
+        m_turn_metrics.prompt_tokens       = prompt_tokens.size();
+        m_turn_metrics.prefix_tokens_saved = m_prefix_tokens_saved;
+    }
+    if (m_debug_level > 0) {
+        std::cout << "input tokens: " << prompt_tokens.size() << std::endl;
+        std::cout << "tokenization time: " << std::chrono::duration<double, std::milli>(m_turn_metrics.tokenize_time).count() << " ms" << std::endl;
+        std::cout << "prefill tokens saved by prefix cache: " << m_prefix_tokens_saved << std::endl;
+    }
+    m_prefix_tokens_saved = 0;
+
+    // network response and why it ended
+    ChatResult   result;
+    std::string& response = result.text;
+
+    // limits for this turn
+    const int64_t max_tokens   = options.max_tokens >= 0 ? options.max_tokens : m_max_tokens;
+    const bool    has_deadline = options.deadline != std::chrono::steady_clock::time_point::max();
+    size_t        max_stop     = 0;
+    for (const auto& stop : options.stop) {
+        max_stop = std::max(max_stop, stop.size());
+    }
+
+    // holds back streamed bytes until they form complete UTF-8 characters, and text that may be the start of a stop string
+    Utf8StreamBuffer stream_buffer;
+    size_t           streamed = 0;
+    auto             stream   = [&](size_t end) {
+        if (end > streamed) {
+            std::string complete_text = stream_buffer.push(response.substr(streamed, end - streamed));
+            streamed                  = end;
+            if (!complete_text.empty()) {
+                options.on_piece(complete_text);
+            }
         }
+    };
 
-        // take output from network and picks best token; -1 selects last token in batch
-        new_token_id = llama_sampler_sample(m_sampler, m_context, -1);
+    // length of the response after each token that has been or is about to be evaluated into the context
+    std::vector<size_t> token_ends;
+
+    // record start time of response
+    auto     response_start = std::chrono::steady_clock::now();
+    auto     last_dot_time  = response_start;
+    auto     last_token     = response_start;
+    uint64_t n_generated    = 0;
+    m_n_drafted             = 0;
+    m_n_accepted            = 0;
 
+    // sample from the logits of a batch position, following the grammar of the turn if it has one
+    const GrammarStats grammar_start = m_grammar ? m_grammar->stats() : GrammarStats();
+    auto               sample_token  = [&](int32_t idx) {
+        return m_grammar ? m_grammar->sample(m_sampler, m_context, idx) : llama_sampler_sample(m_sampler, m_context, idx);
+    };
+
+    // add a sampled token to the response, returns false at the end of output
+    auto emit_token = [&](llama_token token_id) {
         // check for end of output
-        if (llama_vocab_is_eog(m_vocab, new_token_id)) {
-            break;
+        if (llama_vocab_is_eog(m_vocab, token_id)) {
+            result.finish_reason = FinishReason::END_OF_TEXT;
+            return false;
+        }
+        if (max_tokens >= 0 && n_generated >= (uint64_t)max_tokens) {
+            result.finish_reason = FinishReason::LENGTH;
+            return false;
+        }
+        if (cancel && cancel->load(std::memory_order_relaxed)) {
+            result.finish_reason = FinishReason::CANCELLED;
+            return false;
+        }
+        if (has_deadline && std::chrono::steady_clock::now() >= options.deadline) {
+            result.finish_reason = FinishReason::DEADLINE;
+            return false;
         }
 
         // convert integer token back into string
         char        char_buffer[256];
-        int         n = llama_token_to_piece(m_vocab, new_token_id, char_buffer, sizeof(char_buffer), 0, true);
+        int         n = llama_token_to_piece(m_vocab, token_id, char_buffer, sizeof(char_buffer), 0, true);
         std::string response_piece(char_buffer, n);
 
         // add the string to the output
         response += response_piece;
+        ++n_generated;
 
-        // take generated token and put it into new batch to feed back to the model
-        token_batch = llama_batch_get_one(&new_token_id, 1);
+        // a stop string may have started in earlier pieces, the reply ends before it and this token is not evaluated
+        if (max_stop > 0) {
+            const size_t stop_start = findStop(response, response_piece.size(), options.stop, max_stop);
+            if (stop_start != std::string::npos) {
+                response.resize(stop_start);
+                result.finish_reason = FinishReason::STOP_STRING;
+                return false;
+            }
+        }
+        token_ends.push_back(response.size());
 
-        if (m_print_progress && std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - last_dot_time).count() >= m_time_between_dots_s) {
+        if (record_metrics) {
+            const auto token_time = now();
+            if (n_generated > 1) {
+                m_turn_metrics.token_times.push_back(token_time - last_token);
+            }
+            last_token = token_time;
+        }
+        if (options.on_piece) {
+            // keep back the longest end of the response that could still grow into a stop string
+            size_t held = 0;
+            for (const auto& stop : options.stop) {
+                if (stop.empty()) {
+                    continue;
+                }
+                for (size_t length = std::min(stop.size() - 1, response.size()); length > held; --length) {
+                    if (response.compare(response.size() - length, length, stop, 0, length) == 0) {
+                        held = length;
+                        break;
+                    }
+                }
+            }
+            stream(response.size() - held);
+        }
+
+        if (m_print_progress && !options.on_piece && std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - last_dot_time).count() >= m_time_between_dots_s) {
             std::cout << ".";
             std::cout.flush();
             last_dot_time = std::chrono::steady_clock::now();
         }
+        return true;
+    };
+
+    // process the prompt and take output from network to pick the first token; -1 selects last token in batch
+    if (!decodeChatTokens(prompt_tokens.data(), prompt_tokens.size())) {
+        std::cout << "prompt is too long for the context!" << std::endl;
+        result.finish_reason = FinishReason::CONTEXT_FULL;
+        return result;
+    }
+    prompt_evaluated = true;
+    llama_token new_token_id = sample_token(-1);
+    if (record_metrics) {
+        m_turn_metrics.prefill_time  = now() - response_start;
+        m_turn_metrics.reused_tokens = m_reused_tokens;
+    }
+    if (m_debug_level > 0 && m_reused_tokens > 0) {
+        std::cout << "prefill tokens saved by reusing the previous conversation: " << m_reused_tokens << std::endl;
+    }
+    m_reused_tokens = 0;
+
+    // process the tokens
+    while (emit_token(new_token_id)) {
+        std::vector<llama_token> draft = draftTokens(new_token_id);
+
+        // verify the sampled token and the draft in one batch, the output at each position predicts the next draft token
+        std::vector<llama_token> verify_tokens = { new_token_id };
+        verify_tokens.insert(verify_tokens.end(), draft.begin(), draft.end());
+
+        if (draft.empty() || !decodeChatTokens(verify_tokens.data(), verify_tokens.size(), true)) {
+            // take generated token and feed it back to the model
+            if (!decodeChatTokens(&new_token_id, 1)) {
+                token_ends.pop_back();
+                result.finish_reason = FinishReason::CONTEXT_FULL;
+                break;
+            }
+            new_token_id = sample_token(-1);
+            continue;
+        }
+        const llama_pos verify_start = m_context_tokens.size() - verify_tokens.size();  // the context may have shifted to fit the batch
+        m_n_drafted += draft.size();
+
+        // accept draft tokens while they match what the model samples itself, the first mismatch is replaced by the model's token
+        size_t n_kept    = 1;
+        bool   stopped   = false;
+        new_token_id     = sample_token(0);
+        while (n_kept < verify_tokens.size() && new_token_id == verify_tokens[n_kept]) {
+            ++m_n_accepted;
+            if (!emit_token(new_token_id)) {
+                stopped = true;
+                break;
+            }
+            new_token_id = sample_token(n_kept);
+            ++n_kept;
+        }
+
+        // remove rejected draft tokens from the KV cache
+        removeChatCells(verify_start + n_kept);
+        m_context_tokens.resize(verify_start + n_kept);
+
+        if (stopped) {
+            break;
+        }
+    }
+
+    // a stop string may begin inside tokens already evaluated, drop those so the context holds no text past the reply
+    size_t n_reply_tokens = token_ends.size();
+    while (n_reply_tokens > 0 && token_ends[n_reply_tokens - 1] > response.size()) {
+        --n_reply_tokens;
     }
-    if (m_print_progress) {
+    if (n_reply_tokens < token_ends.size()) {
+        const size_t n_remove = token_ends.size() - n_reply_tokens;
+        removeChatCells(m_context_tokens.size() - n_remove);
+        m_context_tokens.resize(m_context_tokens.size() - n_remove);
+    }
+    context_bytes = n_reply_tokens > 0 ? token_ends[n_reply_tokens - 1] : 0;
+
+    if (options.on_piece) {
+        stream(response.size());
+        std::string remaining_text = stream_buffer.flush();
+        if (!remaining_text.empty()) {
+            options.on_piece(remaining_text);
+        }
+    } else if (m_print_progress) {
         std::cout << std::endl;
     }
 
+    if (record_metrics) {
+        m_turn_metrics.sampled_tokens  = n_generated;
+        m_turn_metrics.drafted_tokens  = m_n_drafted;
+        m_turn_metrics.accepted_tokens = m_n_accepted;
+    }
     if (m_debug_level > 0) {
-        std::cout << "inference time: " << std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - response_start).count() << " seconds" << std::endl; 
+        const double inference_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - response_start).count();
+        std::cout << "prefill time: " << std::chrono::duration<double, std::milli>(m_turn_metrics.prefill_time).count() << " ms" << std::endl;
+        std::cout << "inference time: " << inference_s << " seconds" << std::endl;
+        std::cout << "effective tokens/s: " << (inference_s > 0.0 ? n_generated / inference_s : 0.0) << std::endl;
+        if (m_draft_model || m_lookup_ngram > 0) {
+            std::cout << "draft acceptance rate: " << (m_n_drafted > 0 ? 100.0 * m_n_accepted / m_n_drafted : 0.0) << "% (" << m_n_accepted << "/" << m_n_drafted << ")" << std::endl;
+        }
+        if (m_grammar) {
+            const GrammarStats& stats = m_grammar->stats();
+            std::cout << "grammar: " << stats.resampled - grammar_start.resampled << " of " << stats.sampled - grammar_start.sampled << " tokens drawn again, " << stats.masks_built - grammar_start.masks_built << " token masks built, " << stats.mask_hits - grammar_start.mask_hits << " cached masks used" << std::endl;
+        }
     }
 
-    return response;
-}
\ No newline at end of file
+    return result;
+}
@@ -3,19 +3,160 @@
 #include <memory>
 #include <vector>
 #include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <cstdlib>
+#include <iterator>
 #include "llm_wrapper.hpp"
+#include "llm_vector_index.hpp"
+#include "llm_batch_runner.hpp"
 #include "llm_utils.hpp"
 #include "commandline_args.hpp"
 
 int main(int argc, char* argv[]) {
 
+    constexpr size_t GRAPH_MIN_PASSAGES = 10000;  // below this exact search is as fast as the HNSW graph
+
     // get arguments
-    std::unique_ptr<CommandLineArgs> arg_parser = std::make_unique<CommandLineArgs>("LLM chat", "Simple LLM chat using model specified with command line parameters. Type 'clear' in chat to reset the context/conversation");
+    std::unique_ptr<CommandLineArgs> arg_parser = std::make_unique<CommandLineArgs>("LLM chat", "Simple LLM chat using model specified with command line parameters. Type 'clear' in chat to reset the context/conversation, 'adapter <path>' to switch LoRA adapter ('adapter' alone for the base weights), 'regenerate' to answer the last message again, 'edit <message>' to replace it, 'fork' to keep the conversation so far and 'restore <fork>' to return to it, 'save' to write the session file and 'exit' to save and quit");
     arg_parser->addArgument<std::string>("model_path", "path to the .gguf file for the model to use", "mp");
+    arg_parser->addArgument<std::string>("session_path", "session file to resume the chat from and save it to", "sp", "");
+    arg_parser->addArgument<std::string>("draft_model_path", "path to a smaller .gguf sharing the model vocabulary, enables speculative decoding", "dp", "");
+    arg_parser->addArgument<int32_t>("prompt_lookup", "longest run of latest tokens looked up in the context to propose draft tokens without a draft model, 0 to disable", "pl", 0);
+    arg_parser->addArgument<std::string>("lora_path", "LoRA adapter of the model to chat with, switch with 'adapter <path>' in chat", "lp", "");
+    arg_parser->addArgument<std::string>("system_prompt", "system prompt that starts every conversation", "sys", "");
+    arg_parser->addArgument<std::string>("grammar_file", "GBNF grammar file every reply must match, with the rule root", "gf", "");
+    arg_parser->addArgument<std::string>("json_schema_file", "JSON schema file every reply must be a value of, used if no grammar file is given", "jsf", "");
+    arg_parser->addArgument<int32_t>("threads", "threads used for generation, 0 for one per physical core", "t", 0);
+    arg_parser->addArgument<int32_t>("threads_batch", "threads used for prompt processing, 0 for the same as threads", "tb", 0);
+    arg_parser->addArgument<std::string>("cpu_mask", "hex mask of the CPUs to run worker threads on, e.g. 0xff", "cm", "");
+    arg_parser->addFlag("strict_cpu", "pin each worker thread to its own CPU of the mask", "sc");
+    arg_parser->addArgument<std::string>("numa", "NUMA policy: disabled, distribute, isolate, numactl or mirror", "numa", "disabled");
+    arg_parser->addArgument<int32_t>("batch_size", "maximum tokens per decode call, 0 for the context size", "b", 0);
+    arg_parser->addArgument<int32_t>("ubatch_size", "tokens per physical compute batch", "ub", 512);
+    arg_parser->addArgument<int32_t>("gpu_layers", "number of layers to offload to the GPU, 0 for CPU only", "ngl", 100);
+    arg_parser->addArgument<int32_t>("context_size", "context size in tokens, 0 for 4096 (or batch_context in batch mode)", "c", 0);
+    arg_parser->addArgument<std::string>("cache_type_k", "KV cache key type: f16, bf16, f32, q8_0, q5_1, q5_0, q4_1 or q4_0", "ctk", "f16");
+    arg_parser->addArgument<std::string>("cache_type_v", "KV cache value type, quantized types need flash attention: f16, bf16, f32, q8_0, q5_1, q5_0, q4_1 or q4_0", "ctv", "f16");
+    arg_parser->addArgument<std::string>("flash_attn", "flash attention: auto, on or off", "fa", "auto");
+    arg_parser->addFlag("auto_tune", "benchmark thread and batch settings for the model on this machine, results are cached", "at");
+    arg_parser->addArgument<std::string>("tune_cache", "file caching auto-tune results", "tc", "llm_tune.cache");
+    arg_parser->addArgument<std::string>("index_path", "vector index of passages to ground replies in, built from documents_path if it does not exist", "ip", "");
+    arg_parser->addArgument<std::string>("documents_path", "text file of passages separated by blank lines to build the vector index from", "doc", "");
+    arg_parser->addArgument<int32_t>("top_k", "number of passages retrieved for each prompt", "k", 3);
+    arg_parser->addArgument<std::string>("batch", "JSONL file of {\"id\", \"prompt\"} lines to answer without chatting, resumes after the last line already in the output", "batch", "");
+    arg_parser->addArgument<std::string>("batch_output", "JSONL file the batch results are appended to, defaults to the batch file with .out.jsonl added", "bo", "");
+    arg_parser->addArgument<int32_t>("batch_sessions", "prompts run concurrently in batch mode", "bs", 16);
+    arg_parser->addArgument<int32_t>("batch_context", "context size in tokens shared by the batch sessions", "bc", 16384);
+    arg_parser->addArgument<int32_t>("max_tokens", "reply length limit in tokens for batch prompts that do not set one, -1 for none", "mt", 512);
     arg_parser->parse(argc, argv);
 
+    // engine settings
+    EngineConfig engine_config;
+    engine_config.n_threads       = arg_parser->getArgument<int32_t>("threads");
+    engine_config.n_threads_batch = arg_parser->getArgument<int32_t>("threads_batch");
+    engine_config.cpu_mask        = arg_parser->getArgument<std::string>("cpu_mask");
+    engine_config.strict_cpu      = arg_parser->getArgument<bool>("strict_cpu");
+    engine_config.n_batch         = std::max(0, arg_parser->getArgument<int32_t>("batch_size"));
+    engine_config.n_ubatch        = std::max(0, arg_parser->getArgument<int32_t>("ubatch_size"));
+    engine_config.n_gpu_layers    = arg_parser->getArgument<int32_t>("gpu_layers");
+    engine_config.n_ctx           = std::max(0, arg_parser->getArgument<int32_t>("context_size"));
+    if (!EngineConfig::parseNuma(arg_parser->getArgument<std::string>("numa"), engine_config.numa)) {
+        std::cout << "unknown NUMA policy '" << arg_parser->getArgument<std::string>("numa") << "'" << std::endl;
+        return 1;
+    }
+    if (!EngineConfig::parseCacheType(arg_parser->getArgument<std::string>("cache_type_k"), engine_config.type_k) || !EngineConfig::parseCacheType(arg_parser->getArgument<std::string>("cache_type_v"), engine_config.type_v)) {
+        std::cout << "unknown KV cache type '" << arg_parser->getArgument<std::string>("cache_type_k") << "' or '" << arg_parser->getArgument<std::string>("cache_type_v") << "'" << std::endl;
+        return 1;
+    }
+    if (!EngineConfig::parseFlashAttn(arg_parser->getArgument<std::string>("flash_attn"), engine_config.flash_attn)) {
+        std::cout << "unknown flash attention setting '" << arg_parser->getArgument<std::string>("flash_attn") << "'" << std::endl;
+        return 1;
+    }
+
+    // tuned thread and micro-batch settings apply to batch mode as well as chat
+    if (arg_parser->getArgument<bool>("auto_tune")) {
+        EngineTuner tuner(arg_parser->getArgument<std::string>("tune_cache"));
+        engine_config = tuner.tune(arg_parser->getArgument<std::string>("model_path"), engine_config);
+    }
+
+    // answer a file of independent prompts with continuous batching instead of chatting
+    const std::string batch_path = arg_parser->getArgument<std::string>("batch");
+    if (batch_path != "") {
+        const std::string batch_output = arg_parser->getArgument<std::string>("batch_output") != "" ? arg_parser->getArgument<std::string>("batch_output") : batch_path + ".out.jsonl";
+        SessionEngine     engine(arg_parser->getArgument<std::string>("model_path"), std::max(1, arg_parser->getArgument<int32_t>("batch_sessions")), std::max(512, arg_parser->getArgument<int32_t>("batch_context")), 0.1f, 0, engine_config);
+        BatchRunner       runner(engine, arg_parser->getArgument<int32_t>("max_tokens"));
+        return runner.run(batch_path, batch_output) ? 0 : 1;
+    }
+
     // setup LLM
-    std::unique_ptr<LLM> llm = std::make_unique<LLM>(arg_parser->getArgument<std::string>("model_path"), 0.1, true);
+    std::unique_ptr<LLM> llm = std::make_unique<LLM>(arg_parser->getArgument<std::string>("model_path"), 0.1, false, 0, arg_parser->getArgument<std::string>("draft_model_path"), engine_config);
+    if (arg_parser->getArgument<std::string>("system_prompt") != "") {
+        llm->setSystemPrompt(arg_parser->getArgument<std::string>("system_prompt"));
+    }
+    llm->setPromptLookup(arg_parser->getArgument<int32_t>("prompt_lookup"));
+    if (arg_parser->getArgument<std::string>("lora_path") != "" && !llm->setAdapter(arg_parser->getArgument<std::string>("lora_path"))) {
+        return 1;
+    }
+
+    // open the retrieval index, building it from the documents if it does not exist yet
+    const std::string index_path     = arg_parser->getArgument<std::string>("index_path");
+    const std::string documents_path = arg_parser->getArgument<std::string>("documents_path");
+    VectorIndex       index;
+    if (index_path != "" && std::filesystem::exists(index_path)) {
+        if (!index.open(index_path)) {
+            return 1;
+        }
+    } else if (index_path != "" && documents_path != "") {
+        std::ifstream            documents(documents_path);
+        std::vector<std::string> passages(1);
+        std::string              line;
+        while (std::getline(documents, line)) {
+            if (line == "" && passages.back() != "") {
+                passages.emplace_back();
+            } else if (line != "") {
+                passages.back() += (passages.back() == "" ? "" : "\n") + line;
+            }
+        }
+        if (passages.back() == "") {
+            passages.pop_back();
+        }
+        std::cout << "---- Indexing " << passages.size() << " passages ----" << std::endl;
+        if (!index.addDocuments(*llm, passages)) {
+            std::cout << "failed to index " << documents_path << std::endl;
+            return 1;
+        }
+        if (index.size() >= GRAPH_MIN_PASSAGES) {
+            index.buildGraph();
+        }
+        index.save(index_path);
+    }
+    if (index.size() > 0) {
+        llm->setRetrieval(&index, std::max(1, arg_parser->getArgument<int32_t>("top_k")));
+    }
+
+    // stream replies, constrained to the grammar or JSON schema if one is given
+    ChatOptions reply_options;
+    reply_options.on_piece = [](const std::string& piece) {
+        std::cout << piece << std::flush;
+    };
+    const std::string grammar_path = arg_parser->getArgument<std::string>("grammar_file") != "" ? arg_parser->getArgument<std::string>("grammar_file") : arg_parser->getArgument<std::string>("json_schema_file");
+    if (grammar_path != "") {
+        std::ifstream file(grammar_path);
+        std::string   text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        (arg_parser->getArgument<std::string>("grammar_file") != "" ? reply_options.grammar : reply_options.json_schema) = text;
+        if (!file.is_open() || !llm->checkGrammar(reply_options)) {
+            std::cout << "could not use " << grammar_path << std::endl;
+            return 1;
+        }
+    }
+
+    // resume the previous chat if there is one
+    const std::string session_path = arg_parser->getArgument<std::string>("session_path");
+    if (session_path != "" && std::filesystem::exists(session_path) && llm->loadSession(session_path)) {
+        std::cout << "---- Resumed session from " << session_path << " ----" << std::endl;
+    }
     
     // setup chat
     std::unique_ptr<ConsoleInput> console_input = std::make_unique<ConsoleInput>();
@@ -30,11 +171,48 @@ int main(int argc, char* argv[]) {
             llm->clearChat();
             std::cout << "---- Reset model ----" << std::endl;
             std::cout << "----- Chat Start -----\n" << std::endl;
+        } else if (user_input == "adapter" || user_input.starts_with("adapter ")) {
+            const std::string adapter_path = user_input == "adapter" ? "" : user_input.substr(8);
+            if (llm->setAdapter(adapter_path)) {
+                std::cout << "---- Using " << (adapter_path == "" ? std::string("base weights") : "adapter " + adapter_path) << " ----\n" << std::endl;
+            }
+        } else if (user_input == "regenerate" || user_input.starts_with("edit ")) {
+            // only the tokens after the replaced reply or message are evaluated
+            std::cout << "LLM: " << std::endl;
+            if (user_input == "regenerate") {
+                llm->regenerate(reply_options);
+            } else {
+                llm->editLastMessage(user_input.substr(5), reply_options);
+            }
+            std::cout << "\n" << std::endl;
+        } else if (user_input == "fork") {
+            const int32_t fork_id = llm->forkChat();
+            if (fork_id < 0) {
+                std::cout << "no fork sequences left" << std::endl;
+            } else {
+                std::cout << "---- Kept conversation as fork " << fork_id << " ----\n" << std::endl;
+            }
+        } else if (user_input.starts_with("restore ")) {
+            const int32_t fork_id = std::atoi(user_input.c_str() + 8);
+            if (llm->restoreFork(fork_id)) {
+                std::cout << "---- Restored fork " << fork_id << " ----\n" << std::endl;
+            } else {
+                std::cout << "could not restore fork " << fork_id << std::endl;
+            }
+        } else if (user_input == "save" || user_input == "exit") {
+            if (session_path == "") {
+                std::cout << "no session path specified, session not saved" << std::endl;
+            } else if (llm->saveSession(session_path)) {
+                std::cout << "---- Saved session to " << session_path << " ----" << std::endl;
+            }
+            if (user_input == "exit") {
+                break;
+            }
         } else {
-            std::cout << "processing request";
-            // get the response from the LLM
-            std::string response = llm->getChatResponse(user_input);
-            std::cout << "LLM: \n" << response << "\n" << std::endl;
+            // stream the response from the LLM as it is generated
+            std::cout << "LLM: " << std::endl;
+            llm->getChatResponse(user_input, reply_options);
+            std::cout << "\n" << std::endl;
         }
     }
 
@@ -0,0 +1,218 @@
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <algorithm>
+#include "llm_sampler.hpp"
+#include "commandline_args.hpp"
+
+/**
+ * @brief create the stock llama.cpp chain with the stages of the fused sampler, optionally drawing a token
+ */
+static llama_sampler* createStockChain(const SamplerParams& params, bool draw) {
+    llama_sampler* chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(chain, llama_sampler_init_min_p(params.min_p, 1));
+    llama_sampler_chain_add(chain, llama_sampler_init_temp(params.temperature));
+    llama_sampler_chain_add(chain, llama_sampler_init_top_k(params.top_k));
+    llama_sampler_chain_add(chain, llama_sampler_init_top_p(params.top_p, 1));
+    if (draw) {
+        llama_sampler_chain_add(chain, llama_sampler_init_dist(params.seed));
+    }
+    return chain;
+}
+
+/**
+ * @brief synthetic logits of a language model: gaussian noise over the vocabulary with a few clearly preferred tokens
+ */
+static std::vector<llama_token_data> makeLogits(size_t n_vocab, uint32_t seed) {
+    std::mt19937                    rng(seed);
+    std::normal_distribution<float> noise(0.0f, 2.5f);
+    std::vector<llama_token_data>   tokens(n_vocab);
+    for (size_t i = 0; i < n_vocab; ++i) {
+        tokens[i] = { (llama_token)i, noise(rng), 0.0f };
+    }
+    std::uniform_int_distribution<size_t> position(0, n_vocab - 1);
+    std::uniform_real_distribution<float> boost(3.0f, 9.0f);
+    for (int i = 0; i < 24; ++i) {
+        tokens[position(rng)].logit += boost(rng);
+    }
+    return tokens;
+}
+
+/**
+ * @brief probabilities of the tokens left by a sampler, by token id; tokens masked to -inf by the stock chain are left out
+ */
+static std::vector<std::pair<llama_token, float>> tokenProbabilities(const llama_token_data_array& cur_p, bool normalize) {
+    std::vector<std::pair<llama_token, float>> probabilities;
+    float                                      max_logit = -INFINITY;
+    for (size_t i = 0; i < cur_p.size; ++i) {
+        max_logit = std::max(max_logit, cur_p.data[i].logit);
+    }
+    float sum = 0.0f;
+    for (size_t i = 0; i < cur_p.size; ++i) {
+        if (std::isfinite(cur_p.data[i].logit)) {
+            const float p = normalize ? expf(cur_p.data[i].logit - max_logit) : cur_p.data[i].p;
+            probabilities.push_back({ cur_p.data[i].id, p });
+            sum += p;
+        }
+    }
+    for (auto& [id, p] : probabilities) {
+        p /= sum;
+    }
+    std::sort(probabilities.begin(), probabilities.end());
+    return probabilities;
+}
+
+/**
+ * @brief checks that the fused sampler keeps the tokens and probabilities of the stock chain and draws from them, then compares their time per token
+ */
+int main(int argc, char* argv[]) {
+
+    // get arguments
+    std::unique_ptr<CommandLineArgs> arg_parser = std::make_unique<CommandLineArgs>("Sampler benchmark", "Compares the fused sampler with the stock llama.cpp sampler chain on synthetic logits; no model is needed");
+    arg_parser->addArgument<int32_t>("iterations", "tokens sampled per setting and vocabulary size when timing", "n", 2000);
+    arg_parser->addArgument<int32_t>("draws", "tokens drawn per setting when checking the distribution", "d", 200000);
+    arg_parser->addArgument<std::string>("json_path", "file to write the timings to as JSON", "j", "");
+    arg_parser->parse(argc, argv);
+
+    const int         n_iterations = std::max(1, arg_parser->getArgument<int32_t>("iterations"));
+    const int         n_draws      = std::max(1, arg_parser->getArgument<int32_t>("draws"));
+    const std::string json_path    = arg_parser->getArgument<std::string>("json_path");
+
+    const std::vector<std::pair<std::string, SamplerParams>> settings = {
+        { "default", { .temperature = 0.8f, .min_p = 0.05f, .seed = 1 } },
+        { "top_k_top_p", { .temperature = 1.0f, .min_p = 0.0f, .top_k = 40, .top_p = 0.95f, .seed = 2 } },
+        { "min_p_top_p", { .temperature = 0.7f, .min_p = 0.02f, .top_p = 0.9f, .seed = 3 } },
+        { "hot_top_p", { .temperature = 1.5f, .min_p = 0.0f, .top_p = 0.95f, .seed = 4 } },
+        { "top_k", { .temperature = 1.0f, .min_p = 0.0f, .top_k = 200, .seed = 6 } },
+        { "greedy", { .temperature = 0.0f, .min_p = 0.05f, .seed = 5 } },
+    };
+    const std::vector<size_t> vocab_sizes = { 32000, 128256 };
+
+    // the same tokens and probabilities as the stock chain, up to float rounding
+    bool passed = true;
+    std::cout << "setting\tvocab\ttokens kept\tmax |dp|" << std::endl;
+    for (const auto& [name, params] : settings) {
+        for (size_t n_vocab : vocab_sizes) {
+            const std::vector<llama_token_data> logits = makeLogits(n_vocab, (uint32_t)n_vocab + params.seed);
+
+            std::vector<llama_token_data> stock_tokens = logits;
+            llama_token_data_array        stock_p      = { stock_tokens.data(), stock_tokens.size(), -1, false };
+            llama_sampler*                stock        = createStockChain(params, false);
+            llama_sampler_apply(stock, &stock_p);
+            llama_sampler_free(stock);
+
+            std::vector<llama_token_data> fused_tokens = logits;
+            llama_token_data_array        fused_p      = { fused_tokens.data(), fused_tokens.size(), -1, false };
+            FusedSampler(params).filter(&fused_p);
+
+            // summation order can move the top-p cut by a token when thousands are kept, a token missing on one side counts with its whole probability
+            const auto expected = tokenProbabilities(stock_p, true);
+            const auto actual   = tokenProbabilities(fused_p, false);
+            float      max_diff = 0.0f;
+            for (size_t i = 0, j = 0; i < expected.size() || j < actual.size();) {
+                if (j == actual.size() || (i < expected.size() && expected[i].first < actual[j].first)) {
+                    max_diff = std::max(max_diff, expected[i++].second);
+                } else if (i == expected.size() || actual[j].first < expected[i].first) {
+                    max_diff = std::max(max_diff, actual[j++].second);
+                } else {
+                    max_diff = std::max(max_diff, std::abs(expected[i++].second - actual[j++].second));
+                }
+            }
+            std::cout << name << "\t" << n_vocab << "\t" << actual.size() << " / " << expected.size() << "\t" << max_diff << std::endl;
+            if (!(max_diff <= 1e-5f)) {
+                std::cout << "fused sampler does not match the stock chain for " << name << " with " << n_vocab << " tokens!" << std::endl;
+                passed = false;
+            }
+        }
+    }
+
+    // the drawn tokens follow the probabilities, measured as total variation distance on a small vocabulary
+    std::cout << "setting\ttotal variation" << std::endl;
+    for (const auto& [name, params] : settings) {
+        const std::vector<llama_token_data> logits = makeLogits(512, params.seed);
+        std::vector<llama_token_data>       tokens = logits;
+        llama_token_data_array              cur_p  = { tokens.data(), tokens.size(), -1, false };
+        FusedSampler                        sampler(params);
+        sampler.filter(&cur_p);
+        std::vector<double> expected(logits.size(), 0.0);
+        for (size_t i = 0; i < cur_p.size; ++i) {
+            expected[cur_p.data[i].id] = cur_p.data[i].p;
+        }
+
+        std::vector<double> drawn(logits.size(), 0.0);
+        for (int draw = 0; draw < n_draws; ++draw) {
+            tokens = logits;
+            cur_p  = { tokens.data(), tokens.size(), -1, false };
+            sampler.sample(&cur_p);
+            drawn[cur_p.data[cur_p.selected].id] += 1.0 / n_draws;
+        }
+        // the bound is about two and a half times the distance expected from sampling noise alone
+        double distance = 0.0;
+        double bound    = 0.0;
+        for (size_t i = 0; i < logits.size(); ++i) {
+            distance += std::abs(drawn[i] - expected[i]) / 2.0;
+            bound    += std::sqrt(expected[i] * (1.0 - expected[i]) / n_draws);
+        }
+        std::cout << name << "\t" << distance << std::endl;
+        if (distance > bound + 1e-9) {
+            std::cout << "fused sampler draws do not follow the probabilities for " << name << "!" << std::endl;
+            passed = false;
+        }
+    }
+    if (!passed) {
+        return 1;
+    }
+
+    // time per token including copying the logits, as llama_sampler_sample does
+    std::ofstream json;
+    if (json_path != "") {
+        json.open(json_path);
+        json << "{\n  \"settings\": [\n";
+    }
+    std::cout << "setting\tvocab\tcopy (us/token)\tstock (us/token)\tfused (us/token)\tspeedup" << std::endl;
+    for (size_t s = 0; s < settings.size(); ++s) {
+        const auto& [name, params] = settings[s];
+        for (size_t v = 0; v < vocab_sizes.size(); ++v) {
+            const std::vector<llama_token_data> logits = makeLogits(vocab_sizes[v], params.seed);
+            std::vector<llama_token_data>       tokens(logits.size());
+            llama_token_data_array              cur_p;
+
+            auto timeSampler = [&](llama_sampler* sampler) {
+                auto start = std::chrono::steady_clock::now();
+                for (int i = 0; i < n_iterations; ++i) {
+                    std::copy(logits.begin(), logits.end(), tokens.begin());
+                    cur_p = { tokens.data(), tokens.size(), -1, false };
+                    if (sampler) {
+                        llama_sampler_apply(sampler, &cur_p);
+                    }
+                }
+                return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / n_iterations;
+            };
+            llama_sampler* stock    = createStockChain(params, true);
+            llama_sampler* fused    = FusedSampler::init(params);
+            const double   copy_us  = timeSampler(nullptr);
+            const double   stock_us = timeSampler(stock);
+            const double   fused_us = timeSampler(fused);
+            llama_sampler_free(stock);
+            llama_sampler_free(fused);
+
+            std::cout << name << "\t" << vocab_sizes[v] << "\t" << copy_us << "\t" << stock_us << "\t" << fused_us << "\t" << stock_us / fused_us << "x" << std::endl;
+            if (json_path != "") {
+                json << "    { \"setting\": \"" << name << "\", \"vocab\": " << vocab_sizes[v] << ", \"copy_us\": " << copy_us << ", \"stock_us\": " << stock_us << ", \"fused_us\": " << fused_us << " }" << (s + 1 < settings.size() || v + 1 < vocab_sizes.size() ? "," : "") << "\n";
+            }
+        }
+    }
+    if (json_path != "") {
+        json << "  ]\n}\n";
+        if (!json) {
+            std::cout << "could not write " << json_path << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <csignal>
+#include "llm_server.hpp"
+#include "commandline_args.hpp"
+
+namespace {
+    InferenceServer* running_server = nullptr;  ///< server stopped by SIGINT and SIGTERM
+}
+
+/**
+ * @brief serves OpenAI-style chat completions for a local model over localhost HTTP and/or a Unix domain socket
+ *
+ * example:
+ *  curl -N http://127.0.0.1:8080/v1/chat/completions -d '{"messages":[{"role":"user","content":"hi"}],"stream":true}'
+ *  curl --unix-socket /tmp/llm.sock http://localhost/v1/chat/completions -d '{"messages":[{"role":"user","content":"hi"}]}'
+ */
+int main(int argc, char* argv[]) {
+
+    // get arguments
+    std::unique_ptr<CommandLineArgs> arg_parser = std::make_unique<CommandLineArgs>("LLM server", "Serves OpenAI-style chat completions at /v1/chat/completions over localhost HTTP and/or a Unix domain socket, with streaming as server-sent events");
+    arg_parser->addArgument<std::string>("model_path", "path to the .gguf file for the model to use", "mp");
+    arg_parser->addArgument<std::string>("host", "address to listen on", "host", "127.0.0.1");
+    arg_parser->addArgument<int32_t>("port", "TCP port to listen on, 0 to only listen on the Unix socket", "p", 8080);
+    arg_parser->addArgument<std::string>("unix_socket", "path of a Unix domain socket to listen on", "us", "");
+    arg_parser->addArgument<int32_t>("engines", "number of model instances answering requests concurrently", "e", 1);
+    arg_parser->addArgument<int32_t>("queue_size", "requests that may wait for an engine before new ones are rejected", "q", 16);
+    arg_parser->addArgument<int32_t>("threads", "threads used for generation by each engine, 0 for one per physical core", "t", 0);
+    arg_parser->addArgument<int32_t>("threads_batch", "threads used for prompt processing by each engine, 0 for the same as threads", "tb", 0);
+    arg_parser->addArgument<int32_t>("gpu_layers", "number of layers to offload to the GPU, 0 for CPU only", "ngl", 100);
+    arg_parser->addArgument<int32_t>("context_size", "context size in tokens of each engine, 0 for 4096", "c", 0);
+    arg_parser->addArgument<std::string>("cache_type_k", "KV cache key type: f16, bf16, f32, q8_0, q5_1, q5_0, q4_1 or q4_0", "ctk", "f16");
+    arg_parser->addArgument<std::string>("cache_type_v", "KV cache value type, quantized types need flash attention: f16, bf16, f32, q8_0, q5_1, q5_0, q4_1 or q4_0", "ctv", "f16");
+    arg_parser->addArgument<std::string>("flash_attn", "flash attention: auto, on or off", "fa", "auto");
+    arg_parser->addArgument<std::string>("lora", "LoRA adapters served as further models, comma separated name=path pairs", "lora", "");
+    arg_parser->addArgument<int32_t>("debug_level", "0 for no output, 1 for statistics and requests, 2 for llama output", "dl", 0);
+    arg_parser->parse(argc, argv);
+
+    const std::string host        = arg_parser->getArgument<std::string>("host");
+    const int         port        = arg_parser->getArgument<int32_t>("port");
+    const std::string unix_socket = arg_parser->getArgument<std::string>("unix_socket");
+    if ((port <= 0 && unix_socket == "") || port > 65535) {
+        std::cout << "specify a port between 1 and 65535 or a Unix socket path" << std::endl;
+        return 1;
+    }
+
+    EngineConfig engine_config;
+    engine_config.n_threads       = arg_parser->getArgument<int32_t>("threads");
+    engine_config.n_threads_batch = arg_parser->getArgument<int32_t>("threads_batch");
+    engine_config.n_gpu_layers    = arg_parser->getArgument<int32_t>("gpu_layers");
+    engine_config.n_ctx           = std::max(0, arg_parser->getArgument<int32_t>("context_size"));
+    if (!EngineConfig::parseCacheType(arg_parser->getArgument<std::string>("cache_type_k"), engine_config.type_k) || !EngineConfig::parseCacheType(arg_parser->getArgument<std::string>("cache_type_v"), engine_config.type_v)) {
+        std::cout << "unknown KV cache type '" << arg_parser->getArgument<std::string>("cache_type_k") << "' or '" << arg_parser->getArgument<std::string>("cache_type_v") << "'" << std::endl;
+        return 1;
+    }
+    if (!EngineConfig::parseFlashAttn(arg_parser->getArgument<std::string>("flash_attn"), engine_config.flash_attn)) {
+        std::cout << "unknown flash attention setting '" << arg_parser->getArgument<std::string>("flash_attn") << "'" << std::endl;
+        return 1;
+    }
+
+    InferenceServer server(arg_parser->getArgument<std::string>("model_path"), std::max(1, arg_parser->getArgument<int32_t>("engines")), std::max(0, arg_parser->getArgument<int32_t>("queue_size")), engine_config, std::clamp(arg_parser->getArgument<int32_t>("debug_level"), 0, 2));
+    std::stringstream adapters(arg_parser->getArgument<std::string>("lora"));
+    std::string       adapter;
+    while (std::getline(adapters, adapter, ',')) {
+        const size_t separator = adapter.find('=');
+        if (separator == std::string::npos || !server.addAdapter(adapter.substr(0, separator), adapter.substr(separator + 1))) {
+            std::cout << "invalid adapter '" << adapter << "', expected name=path" << std::endl;
+            return 1;
+        }
+    }
+    if (port > 0 && !server.listenTcp(host, port)) {
+        return 1;
+    }
+    if (unix_socket != "" && !server.listenUnix(unix_socket)) {
+        return 1;
+    }
+
+    running_server = &server;
+    std::signal(SIGINT, [](int) {
+        running_server->stop();
+    });
+    std::signal(SIGTERM, [](int) {
+        running_server->stop();
+    });
+
+    server.run();
+    std::cout << "shutting down" << std::endl;
+    return 0;
+}